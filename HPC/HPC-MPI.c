@@ -45,6 +45,108 @@
 **          |  ----- ----- -----
 **          ----------------------> nx
 **
+** The grid is split into rectangular blocks, one per rank, laid out
+** as a 2D Cartesian grid of processes which wraps around both ways,
+** as the grid does.  Its shape is chosen to give each rank the fewest
+** halo cells, or may be set as columns x rows of blocks with e.g.
+**
+**   LBM_PROCESS_GRID=8x4
+**
+** The rows, and the columns, are not shared out evenly but by their
+** cost.  A blocked cell only rebounds its densities, which costs a
+** fraction of the collision of an open one: LBM_OBSTACLE_COST of it,
+** 0.15 by default.  Every rank reads the obstacle file and counts the
+** blocked cells in each row and column, then finds the same split.
+** With LBM_REBALANCE_EVERY=n the ranks also time their sweeps, and
+** every n timesteps, if one row of blocks has been much slower than
+** the rest, move the boundaries between the rows of blocks to even
+** out the times, passing the rows that change hands between ranks.
+**
+** Each step a rank swaps the edges of its block with its neighbours:
+** the rows above and below, the columns either side and the four
+** corner cells.  Of each cell only the speeds crossing the edge are
+** sent, picked out by MPI derived datatypes: 3 of the 9 for a row or
+** column, 1 for a corner.  With a single column of blocks the grid is
+** split into strips of whole rows, and only the rows are swapped.
+**
+** Each rank holds only its own block of the grid, and of the map of
+** obstacles, so no rank needs memory for the whole grid.  The block is
+** surrounded by a ring of halo cells, one cell wide, which the halo
+** exchange fills with copies of the cells beyond its edges, wrapping
+** around the edges of the grid (except for the columns of a single
+** column of blocks, which refresh_ghosts() copies from the other end
+** of each row).  The sweep can then reach every neighbour directly.
+** The final state is written by all the ranks together with MPI-IO,
+** each writing its own block.
+**
+** Built with -DOVERLAP_HALO the halo exchange is hidden behind the
+** sweep: each step starts the exchange, sweeps the cells that need
+** no halo while the messages are in flight, and only waits for them
+** before sweeping the edges of this rank's block.
+**
+** Built with -fopenmp as well, e.g.
+**
+**   mpicc -fopenmp -O3 HPC-MPI.c -o d2q9-bgk.exe
+**
+** the program is a hybrid: each rank shares the rows of its block
+** among OMP_NUM_THREADS threads, while the halo exchange and all other
+** MPI calls are made by the main thread alone, between the threads'
+** sweeps (MPI_THREAD_FUNNELED).  Run one rank per socket, or per
+** node, with its threads pinned to the cores beside it, e.g.
+**
+**   OMP_NUM_THREADS=16 OMP_PROC_BIND=close OMP_PLACES=cores \
+**     mpirun -np 4 --map-by socket:PE=16 d2q9-bgk.exe ...
+**
+** Fewer, fatter ranks have fewer halo cells to swap, and fewer
+** messages and reductions to wait for, than one rank per core.  Each
+** thread first touches the rows it sweeps, so they are placed in the
+** memory nearest it.
+**
+** Built with -DSHARED_HALO the ranks on a node hold their grids in
+** MPI-3 shared memory windows, and a rank takes the halo from a
+** neighbour on the same node by copying the neighbour's edge straight
+** out of its grid.  The only message between them is an empty one
+** saying the grid is ready; only neighbours on other nodes send the
+** halos themselves.
+**
+** Built with -DPROFILE each phase of the run is timed, and a
+** profile giving the time, traffic and hardware counts of each
+** phase, and the lattice updates per second, is written as JSON to
+** profile.json.  The times are of the slowest rank, the traffic and
+** counts are summed over the ranks; the counts are of each rank's
+** main thread only, and need perf_event_open() to be permitted.
+**
+** The precision is chosen at compile time with one of
+**
+**   -DPRECISION_STORAGE single precision densities, with the collision
+**                       arithmetic and the velocity and density sums
+**                       in double, as the code always had it (the
+**                       default)
+**   -DPRECISION_MIXED   single precision densities and arithmetic,
+**                       with the velocity and density sums in double
+**   -DPRECISION_FLOAT   single precision throughout
+**   -DPRECISION_DOUBLE  double precision throughout
+**
+** Long runs can be checkpointed, and restarted after being stopped:
+**
+**   LBM_CHECKPOINT_EVERY=n  write a checkpoint every n timesteps
+**   LBM_CHECKPOINT=file     to this file, checkpoint.dat by default
+**   LBM_RESTART=file        carry on from a checkpoint
+**
+** A checkpoint is a binary copy of the grid and of the average
+** velocities so far, see t_checkpoint.  The ranks write their rows
+** into it together with MPI-IO, and on restart each maps the file and
+** reads back just its own rows.  A restart may use any no. of ranks.
+**
+** The average velocity of each timestep is summed over the ranks in
+** batches, LBM_REDUCE_EVERY=n timesteps at a time (64 by default),
+** each reduced while the next is swept.  The ranks then need not all
+** meet every step, so one slow rank only holds up its neighbours.
+**
+** With LBM_OUTPUT=binary the final state is written in binary, to
+** final_state.bin, which is much quicker than formatting it as text.
+** HPC-bin2text.c converts it to the text of final_state.dat.
+**
 ** Note the names of the input parameter and obstacle files
 ** are passed on the command line, e.g.:
 **
@@ -56,15 +158,107 @@
 
 #include<stdio.h>
 #include<stdlib.h>
-#include<math.h>
+#include<tgmath.h>        /* so sqrt() matches the precision */
 #include<time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include<string.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
 #include<mpi.h>
+#ifdef _OPENMP
+#include<omp.h>
+#endif
+#ifdef PROFILE
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
+#endif
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
+#define FIELDS_MAGIC    "LBMFLDS1"     /* first 8 bytes of a binary field file */
+#define LINE_MAX_LEN    128            /* longest line of final_state.dat, with room to spare */
 #define AVVELSFILE      "av_vels.dat"
+#define PROFILEFILE     "profile.json"
+#define CHECKPOINTFILE  "checkpoint.dat"
+#define CHECKPOINT_MAGIC "LBMCKPT1"     /* first 8 bytes of a checkpoint file */
+#define OBSTACLE_COST   0.15           /* the cost of sweeping a blocked cell, an open one costing 1 */
+#define BALANCE_TOLERANCE 1.05         /* how much slower than the mean a row of blocks may be */
+
+#if !defined(PRECISION_FLOAT) && !defined(PRECISION_MIXED) && \
+    !defined(PRECISION_STORAGE) && !defined(PRECISION_DOUBLE)
+#define PRECISION_STORAGE
+#endif
+#if defined(PRECISION_FLOAT) + defined(PRECISION_MIXED) + \
+    defined(PRECISION_STORAGE) + defined(PRECISION_DOUBLE) > 1
+#error "choose only one of PRECISION_FLOAT, PRECISION_MIXED, PRECISION_STORAGE and PRECISION_DOUBLE"
+#endif
+
+/* the types of the densities, of the collision arithmetic,
+** and of the sums over the grid */
+#if defined(PRECISION_FLOAT)
+typedef float  t_real;
+typedef float  t_calc;
+typedef float  t_acc;
+#define MPI_T_REAL MPI_FLOAT
+#elif defined(PRECISION_MIXED)
+typedef float  t_real;
+typedef float  t_calc;
+typedef double t_acc;
+#define MPI_T_REAL MPI_FLOAT
+#elif defined(PRECISION_STORAGE)
+typedef float  t_real;
+typedef double t_calc;
+typedef double t_acc;
+#define MPI_T_REAL MPI_FLOAT
+#else
+typedef double t_real;
+typedef double t_calc;
+typedef double t_acc;
+#define MPI_T_REAL MPI_DOUBLE
+#endif
+#define REAL(x)         ((t_real)(x))  /* keep literals from promoting floats */
+
+/* index of the first speed of cell (ii,jj) of the grid in this rank's
+** lattice, which holds its block and the ring of halo cells around it,
+** rows local_start-1 to local_end and columns local_col_start-1 to
+** local_col_end */
+#define CELL(ii,jj)     ((((ii) - local_start + 1)*(local_col_end - local_col_start + 2) \
+                          + (jj) - local_col_start + 1)*NSPEEDS)
+/* index of cell (ii,jj) of the grid in an array of one value for each
+** cell of this rank's block, such as its obstacles */
+#define BLOCK_CELL(ii,jj) (((ii) - local_start)*(local_col_end - local_col_start) \
+                           + (jj) - local_col_start)
+
+#ifdef PROFILE
+/* the phases of a run that are timed */
+enum phase {
+  PH_INITIALISE,      /* reading the input and setting up the grids */
+  PH_ACCELERATE,      /* accelerate_flow() */
+  PH_HALO_EXCHANGE,   /* halo_exchange() and refresh_ghosts() */
+  PH_STREAM_COLLIDE,  /* the fused propagate, collision and velocity sweeps */
+  PH_REDUCTION,       /* combining the ranks' velocities, and the final av_velocity() */
+  PH_IO,              /* write_values() and checkpoints */
+  PH_REBALANCE,       /* moving rows between the ranks */
+  NPHASES
+};
+static const char* phase_name[NPHASES] = {
+  "initialise", "accelerate", "halo_exchange", "stream_collide", "reduction", "io",
+  "rebalance"
+};
+#define PROFILE_INIT()              profile_init()
+#define PROFILE_BEGIN(phase)        profile_begin(phase)
+#define PROFILE_END(phase,bytes)    profile_end(phase,bytes)
+#define PROFILE_WRITE(params,steps,time) profile_write(params,steps,time)
+#else
+#define PROFILE_INIT()
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase,bytes)
+#define PROFILE_WRITE(params,steps,time)
+#endif
 
 /* struct to hold the parameter values */
 typedef struct {
@@ -77,6 +271,41 @@ typedef struct {
   double omega;         /* relaxation parameter */
 } t_param;
 
+/*
+** The header of a checkpoint file.  It is followed by the 9 planes of
+** the grid, each of ny*nx densities of real_size bytes in row major
+** order, then by the iters average velocities recorded so far, as
+** doubles.  This is the same format the OpenMP and OpenCL versions
+** write, so a run can be restarted by any of them.
+*/
+typedef struct {
+  char   magic[8];      /* CHECKPOINT_MAGIC */
+  int    real_size;     /* bytes per density */
+  int    nx;            /* the parameters of the run, which a restart must match */
+  int    ny;
+  int    reynolds_dim;
+  double density;
+  double accel;
+  double omega;
+  int    iters;         /* no. of timesteps made */
+  int    accelerated;   /* whether the last step also accelerated the flow */
+} t_checkpoint;
+
+/*
+** The header of final_state.bin, written instead of final_state.dat
+** with LBM_OUTPUT=binary.  It is followed by planes of ny*nx values in
+** row major order: the x and y components of the velocity, its norm
+** and the pressure of each cell, as doubles, then whether each cell is
+** blocked, as ints.  HPC-bin2text.c turns it back into text.
+*/
+typedef struct {
+  char   magic[8];      /* FIELDS_MAGIC */
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    iters;         /* no. of timesteps made */
+  int    pad;           /* keeps the planes aligned */
+} t_fields;
+
 enum boolean { FALSE, TRUE };
 
 /*
@@ -85,41 +314,194 @@ enum boolean { FALSE, TRUE };
 
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
-        t_param* params, float** cells_ptr, float** tmp_cells_ptr, 
+        t_param* params, t_real** cells_ptr, t_real** tmp_cells_ptr, 
          int** obstacles_ptr, double** av_vels_ptr);
 
 /* 
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** halo_exchange(), refresh_ghosts() for a single column of blocks, & stream_collide()
+** and swaps the grids, leaving the new state in cells.
+** stream_collide() makes a single 'pull' sweep over a block of
+** cells: each cell gathers its propagated densities, applies
+** rebound or collision and adds to the local velocity sums.
+**
+** The halo exchange is a set of persistent requests, set up by
+** halo_init() for each of the two grids, and released by halo_free().
+** halo_exchange() is halo_start(), which starts them, then
+** halo_finish(), which waits for them and, with SHARED_HALO, copies
+** the halos of the neighbours on the same node.
+**
+** grid_alloc() allocates the two grids of this rank's lattice, in a
+** window the other ranks on the node can see with SHARED_HALO, and
+** grid_free() frees them.
+**
+** accelerate_flow() is applied to the initial state only; after
+** that the next step's acceleration is folded into the sweep as
+** the densities of the 2nd row of the grid are written out.
+**
+** With OVERLAP_HALO, timestep() instead starts the halo exchange,
+** sweeps the inside of this rank's block, then completes the exchange
+** and sweeps the edges of the block.
+*/
+t_acc timestep(const t_param params, t_real** cells_ptr, t_real** tmp_cells_ptr,
+        int* obstacles, const int accel, int* tot_cells);
+int accelerate_flow(const t_param params, t_real* cells, int* obstacles);
+int halo_init(t_real* cells, t_real* tmp_cells);
+int halo_exchange(t_real* cells);
+int halo_start(t_real* cells);
+int halo_finish(t_real* cells);
+int halo_free(void);
+int grid_alloc(const size_t ncells, t_real** cells_ptr, t_real** tmp_cells_ptr);
+int grid_free(t_real** cells_ptr, t_real** tmp_cells_ptr);
+int refresh_ghosts(const t_param params, t_real* cells, const int start, const int end);
+t_acc stream_collide(const t_param params, t_real* cells, t_real* tmp_cells,
+        int* obstacles, const int accel, const int row_start, const int row_end,
+        const int col_start, const int col_end, int* tot_cells);
+int write_values(const t_param params, t_real* cells, int* obstacles, double* av_vels,
+        const int binary);
+
+/*
+** Checkpoints.  checkpoint_write() has every rank write its own rows
+** of the grid into the file at once, with MPI-IO, and rank 0 the
+** average velocities of the first iters timesteps; the file replaces
+** the last one only once it is complete.  checkpoint_read() maps a
+** checkpoint and copies this rank's rows back into the grid, and
+** returns the no. of timesteps it had made.
 */
-int timestep(const t_param params, float* cells, float* tmp_cells, int* obstacles);
-int accelerate_flow(const t_param params, float* cells, int* obstacles);
-int propagate(const t_param params, float* cells, float* tmp_cells);
-int collision(const t_param params, float* cells, float* tmp_cells, int* obstacles);
-int write_values(const t_param params, float* cells, int* obstacles, double* av_vels);
+int checkpoint_write(const char* name, const t_param params, t_real* cells,
+        double* av_vels, const int iters);
+int checkpoint_read(const char* name, const t_param params, t_real* cells,
+        double* av_vels, int* accelerated);
 
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, float** cells_ptr, float** tmp_cells_ptr,
+int finalise(const t_param* params, t_real** cells_ptr, t_real** tmp_cells_ptr,
        int** obstacles_ptr, double** av_vels_ptr);
 
-/* Sum all the densities in the grid.
-** The total should remain constant from one timestep to the next. */
-double total_density(const t_param params, float* cells);
+/* Sum all the densities in this rank's block.
+** The total over the ranks should remain constant from one timestep to the next. */
+t_acc total_density(t_real* cells);
 
 /* compute average velocity */
-double av_velocity(const t_param params, float* cells, int* obstacles);
+double av_velocity(t_real* cells, int* obstacles);
+
+/* combine each rank's velocity sums into the average velocity on rank 0 */
+double reduce_av_velocity(double tot_u, int tot_cells);
+
+/*
+** The same, a batch of timesteps at a time.  batch_add() records a
+** step's sums, and once a batch is full starts reducing it to rank 0
+** without waiting, so the ranks need not meet every step: the batch
+** is reduced while the next one is swept.  batch_flush() reduces what
+** is left and waits for it, after which av_vels holds every step so
+** far, as it must before a checkpoint and at the end of the run.
+*/
+int batch_init(const int every);
+int batch_add(const int step, const double tot_u, const int tot_cells, double* av_vels);
+int batch_flush(double* av_vels);
+int batch_free(void);
 
 /* calculate Reynolds number */
-double calc_reynolds(const t_param params, float* cells, int* obstacles);
+double calc_reynolds(const t_param params, t_real* cells, int* obstacles);
+
+#ifdef PROFILE
+/* time the phases of the run, and report them */
+void profile_init(void);
+void profile_begin(const int phase);
+void profile_end(const int phase, const double bytes);
+void profile_write(const t_param params, const int steps, const double elapsed);
+double profile_file_bytes(const char* name);
+#endif
+
+/*
+** The decomposition.  process_grid() chooses the shape of the grid
+** of processes, rows by columns of blocks, and rank_block() finds the
+** rows and columns of the grid that make up a rank's block.
+*/
+int process_grid(const t_param params, const int size, int dims[2]);
+int rank_block(const int rank, int* row_start, int* row_end,
+        int* col_start, int* col_end);
+
+/*
+** Where the blocks divide the grid.  balance_init() splits the rows,
+** and the columns, among the blocks by the cost of their cells, a
+** blocked cell costing less to sweep than an open one; balance_split()
+** makes each split.  rebalance() moves the boundaries between the rows
+** of blocks to even out the time each rank has spent sweeping, and
+** passes the rows that change hands to their new ranks.
+*/
+int balance_init(const t_param params, const int* row_blocked, const int* col_blocked);
+int balance_split(const double* cost, const int n, const int parts, int* starts);
+int rebalance(const t_param params, t_real** cells_ptr, t_real** tmp_cells_ptr,
+        int** obstacles_ptr);
+int balance_free(void);
 
 /* utility functions */
-int local_start_calc(int numberOfRows, int size, int rank);
 void die(const char* message, const int line, const char *file);
 void usage(const char* exe);
 
-int local_start;
+int local_start;        /* the rows of the grid this rank works on */
 int local_end;
+int local_col_start;    /* and its columns */
+int local_col_end;
+MPI_Comm cart;          /* the ranks as a grid of blocks, in the same order */
+int cart_dims[2];       /* the no. of rows and of columns of blocks */
+/* the no. of cells in this rank's block */
+#define LOCAL_CELLS ((double)(local_end-local_start)*(local_col_end-local_col_start))
+/* and of the inside of it, less the edge rows and, if split, columns */
+#define INSIDE_CELLS(split) \
+  ((local_end-local_start > 2 && local_col_end-local_col_start > 2*(split)) ? \
+   (double)(local_end-local_start-2)*(local_col_end-local_col_start-2*(split)) : 0.0)
+
+/* the persistent requests of the halo exchange, for each of the two
+** grids: a receive from and a send to each neighbouring block */
+struct {
+  t_real*      grid[2];
+  MPI_Request  requests[2][16];
+  int          count;           /* requests per grid, 0 if there is no exchange */
+  MPI_Datatype types[16];       /* the layout of each request's message */
+  double       bytes;           /* sent, received or copied each step */
+} halo;
+
+#ifdef SHARED_HALO
+/* the ranks on this node, whose grids lie in windows they all share,
+** and the halos copied from those of them that are neighbours */
+struct {
+  MPI_Comm     comm;            /* the ranks on this node */
+  MPI_Win      win[2];          /* the windows, two while rebalance() moves rows */
+  t_real*      base[2];         /* and this rank's part of each */
+  int          window;          /* the one the halo exchange uses */
+  int          count;           /* the no. of halos copied */
+  t_real*      from[2][8];      /* the first cell of each, in the neighbour's grids */
+  t_real*      to[2][8];        /* and where it goes in this rank's */
+  int          rows[8];         /* the no. of rows and of columns of cells */
+  int          cols[8];
+  int          stride[8];       /* the length of a row of the neighbour's lattice */
+} shared;
+#endif
+
+/* the rows and columns at which the blocks start, with the costs the
+** rows were last split by, and the time spent sweeping since */
+struct {
+  int*         rows;            /* the first row of each row of blocks, then ny */
+  int*         cols;            /* the first column of each column of blocks, then nx */
+  double*      row_cost;        /* the cost of sweeping each row of the grid */
+  double       time;            /* this rank's time in stream_collide() */
+  double       bytes;           /* sent and received by the last rebalance() */
+} balance;
+
+/* the velocity sums of two batches of timesteps: one being filled,
+** while the other may be being reduced */
+struct {
+  double*      sums[2];         /* each step's tot_u and tot_cells, in turn */
+  double*      totals[2];       /* and their sums over the ranks, on rank 0 */
+  int          first[2];        /* the first timestep of each batch */
+  int          count[2];        /* the no. of timesteps in each batch */
+  int          every;           /* the no. in a full batch */
+  int          filling;         /* the batch being filled */
+  int          pending;         /* the batch being reduced, or -1 */
+  MPI_Request  request;         /* its reduction */
+} batch;
 
 /*
 ** main program:
@@ -130,20 +512,30 @@ int main(int argc, char* argv[])
   char*    paramfile = NULL;    /* name of the input parameter file */
   char*    obstaclefile = NULL; /* name of a the input obstacle file */
   t_param  params;              /* struct to hold parameter values */
-  float* cells     = NULL;    /* grid containing fluid densities */
-  float* tmp_cells = NULL;    /* scratch space */
+  t_real* cells     = NULL;    /* grid containing fluid densities */
+  t_real* tmp_cells = NULL;    /* scratch space */
   int*     obstacles = NULL;    /* grid indicating which cells are blocked */
   double*  av_vels   = NULL;    /* a record of the av. velocity computed for each timestep */
   int      ii;                  /* generic counter */
+  int      first = 0;           /* the first timestep to make, after any restart */
+  int      accelerated = FALSE; /* whether a restart's flow is already accelerated */
+  char*    restartfile;         /* checkpoint to restart from, if any */
+  char*    checkpointfile;      /* where to write checkpoints */
+  int      checkpoint_every;    /* timesteps between checkpoints, 0 for none */
+  int      reduce_every;        /* timesteps in each batch of velocity sums */
+  int      rebalance_every;     /* timesteps between rebalances, 0 for none */
+  char*    format;              /* the format of the final state */
+  int      binary;              /* whether to write it in binary */
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
   double tic,toc;               /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;                /* floating point number to record elapsed user CPU time */
   double systim;                /* floating point number to record elapsed system CPU time */
   int flag,rank,size;
-  int numberOfRows,source,sourceStart,sourceEnd;
-  MPI_Status status;
+  int provided;                 /* the level of thread support MPI gives */
   double reynolds;
+  t_acc  tot_u;                 /* this rank's sum of velocity norms */
+  int tot_cells;                /* this rank's no. of unblocked cells */
 
   /* parse the command line */
   if(argc != 3) {
@@ -154,38 +546,94 @@ int main(int argc, char* argv[])
     obstaclefile = argv[2];
   }
 
-  /*Initialise*/
-  MPI_Init( &argc, &argv );
+  /*Initialise, asking for threads that leave MPI to the main one*/
+  MPI_Init_thread( &argc, &argv, MPI_THREAD_FUNNELED, &provided );
   /*Test initialisation was sucessful*/
   MPI_Initialized(&flag);
   if (!flag) {
     MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   }
+#ifdef _OPENMP
+  if (provided < MPI_THREAD_FUNNELED)
+    die("the MPI library does not support threads",__LINE__,__FILE__);
+#endif
 
   /* initialise our data structures and load values from file */
+  PROFILE_INIT();
+  PROFILE_BEGIN(PH_INITIALISE);
   initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+  PROFILE_END(PH_INITIALISE, (double)NSPEEDS*sizeof(t_real)*LOCAL_CELLS);
 
   /*Find rank and size*/
   MPI_Comm_rank(MPI_COMM_WORLD,&rank);
   MPI_Comm_size(MPI_COMM_WORLD,&size);
 
-  /*calculate start and end points for each rank*/
-  local_start = local_start_calc(params.ny,size,rank);
-  local_end = local_start_calc(params.ny,size,rank+1);
+  halo_init(cells,tmp_cells);
+
+  /* checkpoint every so many timesteps, and restart from a checkpoint */
+  checkpointfile   = getenv("LBM_CHECKPOINT") ? getenv("LBM_CHECKPOINT") : CHECKPOINTFILE;
+  checkpoint_every = getenv("LBM_CHECKPOINT_EVERY") ? atoi(getenv("LBM_CHECKPOINT_EVERY")) : 0;
+  restartfile      = getenv("LBM_RESTART");
+  if (checkpoint_every < 0)
+    die("LBM_CHECKPOINT_EVERY must not be negative",__LINE__,__FILE__);
+  reduce_every = getenv("LBM_REDUCE_EVERY") ? atoi(getenv("LBM_REDUCE_EVERY")) : 64;
+  if (reduce_every < 1)
+    die("LBM_REDUCE_EVERY must be at least 1",__LINE__,__FILE__);
+  /* no batch need be longer than the run */
+  if (reduce_every > params.maxIters && params.maxIters > 0) reduce_every = params.maxIters;
+  batch_init(reduce_every);
+  rebalance_every = getenv("LBM_REBALANCE_EVERY") ? atoi(getenv("LBM_REBALANCE_EVERY")) : 0;
+  if (rebalance_every < 0)
+    die("LBM_REBALANCE_EVERY must not be negative",__LINE__,__FILE__);
+  format = getenv("LBM_OUTPUT") ? getenv("LBM_OUTPUT") : "text";
+  if (strcmp(format,"text") != 0 && strcmp(format,"binary") != 0)
+    die("LBM_OUTPUT must be text or binary",__LINE__,__FILE__);
+  binary = strcmp(format,"binary") == 0;
+  if (restartfile != NULL) {
+    PROFILE_BEGIN(PH_IO);
+    first = checkpoint_read(restartfile,params,cells,av_vels,&accelerated);
+    PROFILE_END(PH_IO, (double)NSPEEDS*sizeof(t_real)*LOCAL_CELLS);
+  }
 
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr,NULL);
   tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
-  for (ii=0;ii<params.maxIters;ii++) {
-    timestep(params,cells,tmp_cells,obstacles);
-    av_vels[ii] = av_velocity(params,cells,obstacles);
+  if (!accelerated) {
+    PROFILE_BEGIN(PH_ACCELERATE);
+    accelerate_flow(params,cells,obstacles);
+    PROFILE_END(PH_ACCELERATE, 2.0*6*sizeof(t_real)*params.nx);
+  }
+  for (ii=first;ii<params.maxIters;ii++) {
+    /* no need to accelerate the flow after the final step */
+    tot_u = timestep(params,&cells,&tmp_cells,obstacles,ii < params.maxIters-1,&tot_cells);
+    PROFILE_BEGIN(PH_REDUCTION);
+    batch_add(ii,tot_u,tot_cells,av_vels);
+    PROFILE_END(PH_REDUCTION, 2.0*sizeof(double));
+    if (checkpoint_every > 0 && (ii + 1) % checkpoint_every == 0) {
+      /* the checkpoint needs every average velocity so far */
+      PROFILE_BEGIN(PH_REDUCTION);
+      batch_flush(av_vels);
+      PROFILE_END(PH_REDUCTION, 0.0);
+      PROFILE_BEGIN(PH_IO);
+      checkpoint_write(checkpointfile,params,cells,av_vels,ii + 1);
+      PROFILE_END(PH_IO, (double)NSPEEDS*sizeof(t_real)*LOCAL_CELLS);
+    }
+    if (rebalance_every > 0 && (ii + 1) % rebalance_every == 0 && ii + 1 < params.maxIters) {
+      PROFILE_BEGIN(PH_REBALANCE);
+      rebalance(params,&cells,&tmp_cells,&obstacles);
+      PROFILE_END(PH_REBALANCE, balance.bytes);
+    }
 #ifdef DEBUG
+    batch_flush(av_vels);
     printf("==timestep: %d==\n",ii);
     printf("av velocity: %.12E\n", av_vels[ii]);
-    printf("tot density: %.12E\n",total_density(params,cells));
+    printf("tot density: %.12E\n",total_density(cells));
 #endif
   }
+  PROFILE_BEGIN(PH_REDUCTION);
+  batch_flush(av_vels);
+  PROFILE_END(PH_REDUCTION, 0.0);
   gettimeofday(&timstr,NULL);
   toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
   getrusage(RUSAGE_SELF, &ru);
@@ -194,26 +642,9 @@ int main(int argc, char* argv[])
   timstr=ru.ru_stime;        
   systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
-  /*each process has carried out calculations for its own section 
-    need to collate the information in master process*/
-  if (rank != 0) {
-    numberOfRows = local_end-local_start;
-    /*send updated region*/
-    MPI_Send(&cells[local_start*params.nx*9],9*params.nx*numberOfRows,MPI_FLOAT,0,0,
-      MPI_COMM_WORLD);
-  }
-  else {
-    /*recieve from all ranks*/
-    for (source = 1; source < size; source++) {
-      sourceStart = local_start_calc(params.ny,size,source);
-      sourceEnd = local_start_calc(params.ny,size,source+1);
-      numberOfRows = sourceEnd - sourceStart;
-      MPI_Recv(&cells[sourceStart*params.nx*9],9*params.nx*numberOfRows,
-        MPI_FLOAT,source,MPI_ANY_TAG,MPI_COMM_WORLD,&status);
-    }
-  }
-
+  PROFILE_BEGIN(PH_REDUCTION);
   reynolds = calc_reynolds(params,cells,obstacles);
+  PROFILE_END(PH_REDUCTION, (double)NSPEEDS*sizeof(t_real)*LOCAL_CELLS);
 
   if (rank ==0) {
     /* write final values and free memory */
@@ -222,27 +653,99 @@ int main(int argc, char* argv[])
     printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
     printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
     printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-    write_values(params,cells,obstacles,av_vels); /*<- needs parallelising*/
   }
-
+  /* every rank writes its own block of the final state */
+  PROFILE_BEGIN(PH_IO);
+  write_values(params,cells,obstacles,av_vels,binary);
+  PROFILE_END(PH_IO, (rank == 0) ? profile_file_bytes(binary ? FINALSTATEBIN : FINALSTATEFILE)
+                                   + profile_file_bytes(AVVELSFILE) : 0.0);
+  PROFILE_WRITE(params,params.maxIters - first,toc-tic);
+
+  halo_free();
+  batch_free();
+  balance_free();
+  MPI_Comm_free(&cart);
   finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+#ifdef SHARED_HALO
+  MPI_Comm_free(&shared.comm);
+#endif
   
   MPI_Finalize();
   return EXIT_SUCCESS;
 }
 
-int timestep(const t_param params, float* cells, float* tmp_cells, int* obstacles)
+t_acc timestep(const t_param params, t_real** cells_ptr, t_real** tmp_cells_ptr,
+        int* obstacles, const int accel, int* tot_cells)
 {
-  accelerate_flow(params,cells,obstacles);
-  propagate(params,cells,tmp_cells);
-  collision(params,cells,tmp_cells,obstacles);
-  return EXIT_SUCCESS; 
+  t_acc tot_u;
+  t_real* swap;
+#ifdef OVERLAP_HALO
+  int edge_cells;               /* unblocked cells in an edge of the block */
+  int split = cart_dims[1] > 1; /* whether the columns have halos too */
+
+  PROFILE_BEGIN(PH_HALO_EXCHANGE);
+  halo_start(*cells_ptr);
+  /*the halo columns of this rank's own rows need no messages*/
+  if (!split) refresh_ghosts(params,*cells_ptr,local_start,local_end);
+  PROFILE_END(PH_HALO_EXCHANGE, 0.0);
+  /*the inside of the block needs no halo*/
+  PROFILE_BEGIN(PH_STREAM_COLLIDE);
+  tot_u = stream_collide(params,*cells_ptr,*tmp_cells_ptr,obstacles,accel,
+            local_start+1,local_end-1,local_col_start+split,local_col_end-split,tot_cells);
+  PROFILE_END(PH_STREAM_COLLIDE, 2.0*NSPEEDS*sizeof(t_real)*INSIDE_CELLS(split));
+  PROFILE_BEGIN(PH_HALO_EXCHANGE);
+  halo_finish(*cells_ptr);
+  if (!split) {
+    refresh_ghosts(params,*cells_ptr,local_start-1,local_start);
+    refresh_ghosts(params,*cells_ptr,local_end,local_end+1);
+  }
+  PROFILE_END(PH_HALO_EXCHANGE, halo.bytes);
+  /*now the edges: the first and last rows, which may be the same
+    one, and if the columns have halos the ends of the rows between*/
+  PROFILE_BEGIN(PH_STREAM_COLLIDE);
+  tot_u += stream_collide(params,*cells_ptr,*tmp_cells_ptr,obstacles,accel,
+             local_start,local_start+1,local_col_start,local_col_end,&edge_cells);
+  *tot_cells += edge_cells;
+  if (local_end-1 > local_start) {
+    tot_u += stream_collide(params,*cells_ptr,*tmp_cells_ptr,obstacles,accel,
+               local_end-1,local_end,local_col_start,local_col_end,&edge_cells);
+    *tot_cells += edge_cells;
+  }
+  if (split) {
+    tot_u += stream_collide(params,*cells_ptr,*tmp_cells_ptr,obstacles,accel,
+               local_start+1,local_end-1,local_col_start,local_col_start+1,&edge_cells);
+    *tot_cells += edge_cells;
+    if (local_col_end-1 > local_col_start) {
+      tot_u += stream_collide(params,*cells_ptr,*tmp_cells_ptr,obstacles,accel,
+                 local_start+1,local_end-1,local_col_end-1,local_col_end,&edge_cells);
+      *tot_cells += edge_cells;
+    }
+  }
+  PROFILE_END(PH_STREAM_COLLIDE, 2.0*NSPEEDS*sizeof(t_real)*(LOCAL_CELLS - INSIDE_CELLS(split)));
+#else
+  PROFILE_BEGIN(PH_HALO_EXCHANGE);
+  halo_exchange(*cells_ptr);
+  /*with a single column of blocks the columns are this rank's own*/
+  if (cart_dims[1] == 1) refresh_ghosts(params,*cells_ptr,local_start-1,local_end+1);
+  PROFILE_END(PH_HALO_EXCHANGE, halo.bytes);
+  PROFILE_BEGIN(PH_STREAM_COLLIDE);
+  tot_u = stream_collide(params,*cells_ptr,*tmp_cells_ptr,obstacles,accel,
+            local_start,local_end,local_col_start,local_col_end,tot_cells);
+  PROFILE_END(PH_STREAM_COLLIDE, 2.0*NSPEEDS*sizeof(t_real)*LOCAL_CELLS);
+#endif
+
+  /*new state is in the scratch space grid*/
+  swap = *cells_ptr;
+  *cells_ptr = *tmp_cells_ptr;
+  *tmp_cells_ptr = swap;
+
+  return tot_u;
 }
 
-int accelerate_flow(const t_param params, float* cells, int* obstacles)
+int accelerate_flow(const t_param params, t_real* cells, int* obstacles)
 {
   int ii,jj,pos;     /* generic counters */
-  double w1,w2;  /* weighting factors */
+  t_calc w1,w2;  /* weighting factors */
   int rank,size;
 
   /* compute weighting factors */
@@ -257,14 +760,14 @@ int accelerate_flow(const t_param params, float* cells, int* obstacles)
   ii=params.ny - 2;
   /*only one process needs to work here*/
   if ((local_start <= ii) && (ii < local_end)) {
-    for(jj=0;jj<params.nx;jj++) {
-      pos = (ii*params.nx + jj)*9;
+    for(jj=local_col_start;jj<local_col_end;jj++) {
+      pos = CELL(ii,jj);
       /* if the cell is not occupied and
       ** we don't send a density negative */
-      if( !obstacles[ii*params.nx + jj] && 
-        (cells[pos+3] - w1) > 0.0 &&
-        (cells[pos+6] - w2) > 0.0 &&
-        (cells[pos+7] - w2) > 0.0 ) {
+      if( !obstacles[BLOCK_CELL(ii,jj)] && 
+        (cells[pos+3] - w1) > 0 &&
+        (cells[pos+6] - w2) > 0 &&
+        (cells[pos+7] - w2) > 0 ) {
         /* increase 'east-side' densities */
         cells[pos+1] += w1;
         cells[pos+5] += w2;
@@ -280,123 +783,390 @@ int accelerate_flow(const t_param params, float* cells, int* obstacles)
   return EXIT_SUCCESS;
 }
 
-int propagate(const t_param params, float* cells, float* tmp_cells)
+int halo_exchange(t_real* cells)
 {
-  int ii,jj;            /* generic counters */
-  int x_e,x_w,y_n,y_s;  /* indices of neighbouring cells */
-  int pos; /*index of current cell */
-  int rank,size;
-  int upper,lower;
-  int upperHalo, upperRecv, lowerHalo, lowerRecv;
+  halo_start(cells);
+  halo_finish(cells);
 
-  MPI_Status status;
+  return EXIT_SUCCESS;
+}
 
-  /*Find rank and size*/
-  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
-  MPI_Comm_size(MPI_COMM_WORLD,&size);
- 
-  /*work out processes to communicate with*/
-  upper = (rank + 1) % size;
-  lower = (rank == 0) ? (rank + size - 1) : (rank - 1);
-
-  /*Send-recieve halos*/
-  /*Send upper halo*/
-  upperHalo = local_end - 1;
-  lowerRecv = (rank != 0) ? (local_start-1) : params.ny -1;
-  MPI_Sendrecv(&cells[upperHalo*params.nx*9],params.nx*9,MPI_FLOAT,upper,0,
-    &cells[lowerRecv*params.nx*9],params.nx*9,MPI_FLOAT,lower,0,MPI_COMM_WORLD,&status);
-    
-  /*send lower halo*/
-  lowerHalo = local_start;
-  upperRecv = local_start_calc(params.ny,size,upper);
-  MPI_Sendrecv(&cells[lowerHalo*params.nx*9],params.nx*9,MPI_FLOAT,lower,0,
-    &cells[upperRecv*params.nx*9],params.nx*9,MPI_FLOAT,upper,0,MPI_COMM_WORLD,&status);
-
-  /* loop over relevant cells */
-  for(ii=local_start;ii<local_end;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      pos = (ii*params.nx + jj)*9;
-      /* determine indices of axis-direction neighbossurs
-      ** respecting periodic boundary conditions (wrap around) */
-      y_n = (ii + 1) % params.ny;
-      x_e = (jj + 1) % params.nx;
-      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
-      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_cells[pos+0] = cells[pos+0]; /*no movement */
-      tmp_cells[pos+1] = cells[(ii*params.nx + x_w)*9+1]; /*west*/
-      tmp_cells[pos+2] = cells[(y_s*params.nx + jj)*9+2]; /*south*/
-      tmp_cells[pos+3] = cells[(ii*params.nx + x_e)*9+3]; /*east*/
-      tmp_cells[pos+4] = cells[(y_n*params.nx + jj)*9+4]; /*north*/
-      tmp_cells[pos+5] = cells[(y_s*params.nx + x_w)*9+5]; /*south-west*/
-      tmp_cells[pos+6] = cells[(y_s*params.nx + x_e)*9+6]; /*south-east*/
-      tmp_cells[pos+7] = cells[(y_n*params.nx + x_e)*9+7]; /*north-east*/
-      tmp_cells[pos+8] = cells[(y_n*params.nx + x_w)*9+8]; /*north-west*/    
+int halo_start(t_real* cells)
+{
+#ifdef SHARED_HALO
+  /* let the ranks on this node see the grid as it now is */
+  MPI_Win_sync(shared.win[shared.window]);
+#endif
+  MPI_Startall(halo.count,halo.requests[(cells == halo.grid[0]) ? 0 : 1]);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_finish(t_real* cells)
+{
+  const int kk = (cells == halo.grid[0]) ? 0 : 1;  /* which grid */
+#ifdef SHARED_HALO
+  const size_t width = (size_t)(local_col_end - local_col_start + 2)*NSPEEDS;
+  int ii,ll;     /* generic counters */
+#endif
+
+  MPI_Waitall(halo.count,halo.requests[kk],MPI_STATUSES_IGNORE);
+#ifdef SHARED_HALO
+  /* the neighbours on this node have said their grids are ready, and
+  ** will not write their edges until this rank says it is done */
+  MPI_Win_sync(shared.win[shared.window]);
+  for(ll=0;ll<shared.count;ll++) {
+    for(ii=0;ii<shared.rows[ll];ii++) {
+      memcpy(shared.to[kk][ll] + ii*width, shared.from[kk][ll] + ii*shared.stride[ll],
+             sizeof(t_real)*NSPEEDS*shared.cols[ll]);
     }
   }
+#endif
 
   return EXIT_SUCCESS;
 }
 
+int refresh_ghosts(const t_param params, t_real* cells, const int start, const int end)
+{
+  int ii,kk;     /* generic counters */
+  int west,east; /* the halo cells beyond either end of a row */
+
+  /*copy the cells at each end of rows start to end-1, which may
+    include the halo rows either side of this rank's, into the
+    halo cells beyond the other end*/
+  for(ii=start;ii<end;ii++) {
+    west = CELL(ii,-1);
+    east = CELL(ii,params.nx);
+    for(kk=0;kk<NSPEEDS;kk++) {
+      cells[west+kk] = cells[CELL(ii,params.nx-1)+kk];
+      cells[east+kk] = cells[CELL(ii,0)+kk];
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
 
-int collision(const t_param params, float* cells, float* tmp_cells, int* obstacles)
+/* the layout of a halo message: the row, column or corner cell at the
+** edge of this rank's block in direction (dy,dx), taking of each cell
+** only the speeds travelling in direction (ty,tx).  Those are all the
+** sweep on the far side pulls across the edge, e.g. the 3 northward
+** speeds of a row, or the one north-eastward speed of a corner */
+static MPI_Datatype halo_type(const int dy, const int dx,
+        const int ty, const int tx, double* bytes)
 {
-  int ii,jj,kk,pos;                 /* generic counters */
-  const double w0 = 4.0/9.0;    /* weighting factor */
-  const double w1 = 1.0/9.0;    /* weighting factor */
-  const double w2 = 1.0/36.0;   /* weighting factor */
-  double u_x,u_y;               /* av. velocities in x and y directions */
-  double u[NSPEEDS];            /* directional velocities */
-  double d_equ[NSPEEDS];        /* equilibrium densities */
-  double u_sq;                  /* squared velocity */
-  double local_density;         /* sum of densities in a particular cell */
-  double calc1;
-  int rank,size;
+  static const int speed_x[NSPEEDS] = { 0, 1, 0, -1,  0, 1, -1, -1,  1 };
+  static const int speed_y[NSPEEDS] = { 0, 0, 1,  0, -1, 1,  1, -1, -1 };
+  int kk;                     /* generic counter */
+  int nspeeds = 0;            /* the speeds sent of each cell */
+  int speeds[NSPEEDS];        /* and which they are */
+  int ncells;                 /* the cells sent */
+  MPI_Datatype cell,spaced,type;
+
+  for(kk=0;kk<NSPEEDS;kk++) {
+    if ((ty == 0 || speed_y[kk] == ty) && (tx == 0 || speed_x[kk] == tx))
+      speeds[nspeeds++] = kk;
+  }
+  /*those speeds of a cell, spaced out a cell apart*/
+  MPI_Type_create_indexed_block(nspeeds,1,speeds,MPI_T_REAL,&cell);
+  MPI_Type_create_resized(cell,0,NSPEEDS*sizeof(t_real),&spaced);
+  if (dx == 0) {
+    /*a row, its cells side by side*/
+    ncells = local_col_end - local_col_start;
+    MPI_Type_contiguous(ncells,spaced,&type);
+  }
+  else if (dy == 0) {
+    /*a column, its cells a row apart*/
+    ncells = local_end - local_start;
+    MPI_Type_create_hvector(ncells,1,NSPEEDS*(local_col_end - local_col_start + 2)*sizeof(t_real),spaced,&type);
+  }
+  else {
+    /*a corner*/
+    ncells = 1;
+    MPI_Type_dup(spaced,&type);
+  }
+  MPI_Type_commit(&type);
+  MPI_Type_free(&spaced);
+  MPI_Type_free(&cell);
+  *bytes += (double)ncells*nspeeds*sizeof(t_real);
 
-  /*At this point, propagate has updated tmp_cells, rebound has updated blocked
-    cells in cells array. Now want to split the work of collision between
-    processes*/
+  return type;
+}
 
-  /*Find rank and size*/
-  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
-  MPI_Comm_size(MPI_COMM_WORLD,&size);
+#ifdef SHARED_HALO
+/* set up the copy of the edge of a neighbour on this node facing
+** direction (dy,dx) into this rank's halo at recvRow, recvCol */
+static int halo_share(const int node_rank, const int neighbour,
+        const int dy, const int dx, const int recvRow, const int recvCol)
+{
+  int row_start,row_end,col_start,col_end;  /* the neighbour's block */
+  int fromRow,fromCol;  /* the first cell copied, of the neighbour's block */
+  size_t ncells;        /* the cells of the neighbour's lattice */
+  MPI_Aint size;
+  int disp_unit;
+  t_real* base;         /* the neighbour's grids */
+  const int ll = shared.count;
+  int kk;               /* generic counter */
+
+  rank_block(neighbour,&row_start,&row_end,&col_start,&col_end);
+  MPI_Win_shared_query(shared.win[shared.window],node_rank,&size,&disp_unit,&base);
+  ncells = (size_t)(row_end - row_start + 2)*(col_end - col_start + 2);
+  /* the edge nearest this block: above, its first row; below, its last */
+  fromRow = (dy < 0) ? row_end-1 : row_start;
+  fromCol = (dx < 0) ? col_end-1 : col_start;
+  shared.stride[ll] = (col_end - col_start + 2)*NSPEEDS;
+  shared.rows[ll] = (dy == 0) ? local_end - local_start : 1;
+  shared.cols[ll] = (dx == 0) ? local_col_end - local_col_start : 1;
+  for(kk=0;kk<2;kk++) {
+    shared.from[kk][ll] = base + kk*ncells*NSPEEDS
+      + (size_t)(fromRow - row_start + 1)*shared.stride[ll] + (fromCol - col_start + 1)*NSPEEDS;
+    shared.to[kk][ll] = &halo.grid[kk][CELL(recvRow,recvCol)];
+  }
+  halo.bytes += 2.0*NSPEEDS*sizeof(t_real)*shared.rows[ll]*shared.cols[ll];
+  shared.count++;
 
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
-  for(ii=local_start;ii<local_end;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      pos = (ii*params.nx + jj)*9;
-      if(obstacles[ii*params.nx + jj]) {
-        /* called after propagate, so taking values from scratch space
-        ** mirroring, and writing into main grid */
-        cells[pos+1] = tmp_cells[pos+3];
-        cells[pos+2] = tmp_cells[pos+4];
-        cells[pos+3] = tmp_cells[pos+1];
-        cells[pos+4] = tmp_cells[pos+2];
-        cells[pos+5] = tmp_cells[pos+7];
-        cells[pos+6] = tmp_cells[pos+8];
-        cells[pos+7] = tmp_cells[pos+5];
-        cells[pos+8] = tmp_cells[pos+6];
+  return EXIT_SUCCESS;
+}
+#endif
+
+int halo_init(t_real* cells, t_real* tmp_cells)
+{
+  int rank;
+  int coords[2];      /* this block's place in the grid of blocks */
+  int other[2];       /* and a diagonal neighbour's */
+  int dy,dx;          /* the direction of a neighbouring block */
+  int neighbour,source;
+  int sendRow,sendCol,recvRow,recvCol;  /* the first cells sent and received */
+  MPI_Datatype recvType,sendType;       /* and which parts of them */
+  int kk;             /* generic counter */
+#ifdef SHARED_HALO
+  MPI_Group cart_group,node_group;      /* all the ranks, and those on this node */
+  int node_rank;      /* a neighbour's rank on this node, if it is on it */
+#endif
+
+  MPI_Comm_rank(cart,&rank);
+  MPI_Cart_coords(cart,rank,2,coords);
+
+  halo.grid[0] = cells;
+  halo.grid[1] = tmp_cells;
+  halo.count = 0;
+  halo.bytes = 0.0;
+#ifdef SHARED_HALO
+  /* to tell which neighbours are on this node */
+  MPI_Comm_group(cart,&cart_group);
+  MPI_Comm_group(shared.comm,&node_group);
+  shared.window = (cells == shared.base[0] || tmp_cells == shared.base[0]) ? 0 : 1;
+  shared.count = 0;
+#endif
+  for(dy=-1;dy<=1;dy++) {
+    for(dx=-1;dx<=1;dx++) {
+      /*a single column of blocks copies its halo columns itself*/
+      if ((dy == 0 && dx == 0) || (dx != 0 && cart_dims[1] == 1)) continue;
+      /*the block in that direction, wrapping around the grid*/
+      if (dx == 0)
+        MPI_Cart_shift(cart,0,dy,&source,&neighbour);
+      else if (dy == 0)
+        MPI_Cart_shift(cart,1,dx,&source,&neighbour);
+      else {
+        other[0] = coords[0] + dy;
+        other[1] = coords[1] + dx;
+        MPI_Cart_rank(cart,other,&neighbour);
+      }
+      /*send the edge of this block facing the neighbour, and receive
+        its edge into the halo on that side; a single row of blocks is
+        its own neighbour above and below*/
+      sendRow = (dy > 0) ? local_end-1 : local_start;
+      sendCol = (dx > 0) ? local_col_end-1 : local_col_start;
+      recvRow = (dy > 0) ? local_end : (dy < 0) ? local_start-1 : local_start;
+      recvCol = (dx > 0) ? local_col_end : (dx < 0) ? local_col_start-1 : local_col_start;
+#ifdef SHARED_HALO
+      /*a neighbour on this node: copy its edge straight from its grid,
+        once an empty message says it is ready*/
+      MPI_Group_translate_ranks(cart_group,1,&neighbour,node_group,&node_rank);
+      if (node_rank != MPI_UNDEFINED) {
+        halo_share(node_rank,neighbour,dy,dx,recvRow,recvCol);
+        for(kk=0;kk<2;kk++) {
+          MPI_Recv_init(NULL,0,MPI_BYTE,neighbour,(1-dy)*3 + (1-dx),MPI_COMM_WORLD,
+            &halo.requests[kk][halo.count]);
+          MPI_Send_init(NULL,0,MPI_BYTE,neighbour,(dy+1)*3 + (dx+1),MPI_COMM_WORLD,
+            &halo.requests[kk][halo.count+1]);
+        }
+        halo.types[halo.count]   = MPI_DATATYPE_NULL;
+        halo.types[halo.count+1] = MPI_DATATYPE_NULL;
+        halo.count += 2;
+        continue;
+      }
+#endif
+      /*only the speeds travelling towards the neighbour go, and only
+        those travelling back towards this block come*/
+      sendType = halo_type(dy,dx,dy,dx,&halo.bytes);
+      recvType = halo_type(dy,dx,-dy,-dx,&halo.bytes);
+      /*each message is tagged with its direction, as with two blocks
+        either way the messages each way go between the same pair*/
+      for(kk=0;kk<2;kk++) {
+        MPI_Recv_init(&halo.grid[kk][CELL(recvRow,recvCol)],1,recvType,
+          neighbour,(1-dy)*3 + (1-dx),MPI_COMM_WORLD,&halo.requests[kk][halo.count]);
+        MPI_Send_init(&halo.grid[kk][CELL(sendRow,sendCol)],1,sendType,
+          neighbour,(dy+1)*3 + (dx+1),MPI_COMM_WORLD,&halo.requests[kk][halo.count+1]);
+      }
+      halo.types[halo.count]   = recvType;
+      halo.types[halo.count+1] = sendType;
+      halo.count += 2;
+    }
+  }
+#ifdef SHARED_HALO
+  MPI_Group_free(&cart_group);
+  MPI_Group_free(&node_group);
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+int halo_free(void)
+{
+  int kk,ll;     /* generic counters */
+
+  for(kk=0;kk<2;kk++) {
+    for(ll=0;ll<halo.count;ll++) {
+      MPI_Request_free(&halo.requests[kk][ll]);
+    }
+  }
+  for(ll=0;ll<halo.count;ll++) {
+    if (halo.types[ll] != MPI_DATATYPE_NULL) MPI_Type_free(&halo.types[ll]);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int grid_alloc(const size_t ncells, t_real** cells_ptr, t_real** tmp_cells_ptr)
+{
+#ifdef SHARED_HALO
+  MPI_Info info;
+  const int ww = (shared.base[0] == NULL) ? 0 : 1;  /* a free window */
+
+  /* both grids in one window, each rank's part of it placed near
+  ** the rank rather than all the parts together */
+  MPI_Info_create(&info);
+  MPI_Info_set(info,"alloc_shared_noncontig","true");
+  MPI_Win_allocate_shared((MPI_Aint)(2*ncells*NSPEEDS*sizeof(t_real)),sizeof(t_real),
+                          info,shared.comm,&shared.base[ww],&shared.win[ww]);
+  MPI_Info_free(&info);
+  if (shared.base[ww] == NULL)
+    die("cannot allocate memory for cells",__LINE__,__FILE__);
+  /* the ranks read it when they like, and MPI_Win_sync() when they must */
+  MPI_Win_lock_all(MPI_MODE_NOCHECK,shared.win[ww]);
+  *cells_ptr = shared.base[ww];
+  *tmp_cells_ptr = shared.base[ww] + ncells*NSPEEDS;
+#else
+  *cells_ptr = (t_real*)malloc(sizeof(t_real)*ncells*NSPEEDS);
+  if (*cells_ptr == NULL) 
+    die("cannot allocate memory for cells",__LINE__,__FILE__);
+  *tmp_cells_ptr = (t_real*)malloc(sizeof(t_real)*ncells*NSPEEDS);
+  if (*tmp_cells_ptr == NULL) 
+    die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+int grid_free(t_real** cells_ptr, t_real** tmp_cells_ptr)
+{
+#ifdef SHARED_HALO
+  /* the window the grids lie in, whichever way round they are */
+  const int ww = (*cells_ptr == shared.base[0] || *tmp_cells_ptr == shared.base[0]) ? 0 : 1;
+
+  MPI_Win_unlock_all(shared.win[ww]);
+  MPI_Win_free(&shared.win[ww]);
+  shared.base[ww] = NULL;
+#else
+  free(*cells_ptr);
+  free(*tmp_cells_ptr);
+#endif
+  *cells_ptr = NULL;
+  *tmp_cells_ptr = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+t_acc stream_collide(const t_param params, t_real* cells, t_real* tmp_cells,
+        int* obstacles, const int accel, const int row_start, const int row_end,
+        const int col_start, const int col_end, int* tot_cells)
+{
+  int ii,jj,kk,pos;             /* generic counters */
+  int x_e,x_w,y_n,y_s;          /* indices of neighbouring cells */
+  int row_accel;                /* whether to accelerate the current row */
+  /* the collision is worked out in t_calc, double by default, as it
+  ** always has been, and only the densities are stored as t_real */
+  const t_calc w0 = 4.0/9.0;    /* weighting factor */
+  const t_calc w1 = 1.0/9.0;    /* weighting factor */
+  const t_calc w2 = 1.0/36.0;   /* weighting factor */
+  const t_calc a1 = params.density * params.accel / 9.0;  /*acceleration weights*/
+  const t_calc a2 = params.density * params.accel / 36.0;
+  const t_calc omega = params.omega;  /* relaxation parameter */
+  t_real t[NSPEEDS];            /* propagated densities */
+  t_real n[NSPEEDS];            /* densities after collision */
+  t_calc u_x,u_y;               /* av. velocities in x and y directions */
+  t_calc u[NSPEEDS];            /* directional velocities */
+  t_calc d_equ[NSPEEDS];        /* equilibrium densities */
+  t_calc u_sq;                  /* squared velocity */
+  t_calc local_density;         /* sum of densities in a particular cell */
+  t_calc calc1;
+  t_acc  n_density,n_x,n_y;     /* the same for the new densities */
+  t_acc  tot_u = 0.0;           /* accumulated magnitudes of velocity */
+  int    swept = 0;             /* unblocked cells swept */
+  const double start = MPI_Wtime();  /* to time the sweep, for rebalance() */
+
+  /* loop over the block of rows row_start to row_end-1
+  ** and columns col_start to col_end-1, sharing the rows among
+  ** the threads, if any, as initialise() first touched them */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:tot_u,swept) \
+  private(jj,kk,pos,x_e,x_w,y_n,y_s,row_accel,t,n,u_x,u_y,u,d_equ,u_sq, \
+          local_density,calc1,n_density,n_x,n_y)
+#endif
+  for(ii=row_start;ii<row_end;ii++) {
+    /* determine indices of axis-direction neighbours, the halo
+    ** having already wrapped the edges of the grid around */
+    y_n = ii + 1;
+    y_s = ii - 1;
+    row_accel = accel && ii == params.ny - 2;
+    for(jj=col_start;jj<col_end;jj++) {
+      pos = CELL(ii,jj);
+      x_e = jj + 1;
+      x_w = jj - 1;
+      /* pull in the densities travelling towards this cell,
+      ** following appropriate directions of travel */
+      t[0] = cells[pos+0]; /*no movement */
+      t[1] = cells[CELL(ii,x_w)+1]; /*west*/
+      t[2] = cells[CELL(y_s,jj)+2]; /*south*/
+      t[3] = cells[CELL(ii,x_e)+3]; /*east*/
+      t[4] = cells[CELL(y_n,jj)+4]; /*north*/
+      t[5] = cells[CELL(y_s,x_w)+5]; /*south-west*/
+      t[6] = cells[CELL(y_s,x_e)+6]; /*south-east*/
+      t[7] = cells[CELL(y_n,x_e)+7]; /*north-east*/
+      t[8] = cells[CELL(y_n,x_w)+8]; /*north-west*/
+      if(obstacles[BLOCK_CELL(ii,jj)]) {
+        /* mirror the propagated values */
+        n[0] = t[0];
+        n[1] = t[3];
+        n[2] = t[4];
+        n[3] = t[1];
+        n[4] = t[2];
+        n[5] = t[7];
+        n[6] = t[8];
+        n[7] = t[5];
+        n[8] = t[6];
       }
       /* don't consider occupied cells */
       else {
         /* compute local density total */
         local_density = 0.0;
         for(kk=0;kk<NSPEEDS;kk++) {
-          local_density += tmp_cells[pos+kk];
+          local_density += t[kk];
         }
         /* compute x velocity component */
-        u_x = (tmp_cells[pos+1] + tmp_cells[pos+5] + 
-          tmp_cells[pos+8] - (tmp_cells[pos+3] + 
-          tmp_cells[pos+6] + tmp_cells[pos+7])) / local_density;
+        u_x = (t[1] + t[5] + t[8] - (t[3] + t[6] + t[7])) / local_density;
         /* compute y velocity component */
-        u_y = (tmp_cells[pos+2] + tmp_cells[pos+5] + 
-          tmp_cells[pos+6] - (tmp_cells[pos+4] + 
-          tmp_cells[pos+7] + tmp_cells[pos+8])) / local_density;
+        u_y = (t[2] + t[5] + t[6] - (t[4] + t[7] + t[8])) / local_density;
         /* velocity squared */ 
         u_sq = u_x * u_x + u_y * u_y;
         /* directional velocity components */
@@ -409,51 +1179,83 @@ int collision(const t_param params, float* cells, float* tmp_cells, int* obstacl
         u[7] = - u_x - u_y;  /* south-west */
         u[8] =   u_x - u_y;  /* south-east */
         /* equilibrium densities */
-        calc1 = u_sq * 1.5;
+        calc1 = u_sq * REAL(1.5);
         /* zero velocity density: weight w0 */
-        d_equ[0] = w0 * local_density * (1.0 - u_sq * 1.5);
+        d_equ[0] = w0 * local_density * (REAL(1.0) - u_sq * REAL(1.5));
         /* axis speeds: weight w1 */
-        d_equ[1] = w1 * local_density * (1.0 + u[1] * 3
-           + (u[1] * u[1]) * 4.5 - calc1);
-        d_equ[2] = w1 * local_density * (1.0 + u[2] * 3
-           + (u[2] * u[2]) * 4.5 - calc1);
-        d_equ[3] = w1 * local_density * (1.0 + u[3] * 3
-           + (u[3] * u[3]) * 4.5 - calc1);
-        d_equ[4] = w1 * local_density * (1.0 + u[4] * 3
-           + (u[4] * u[4]) * 4.5 - calc1);
+        d_equ[1] = w1 * local_density * (REAL(1.0) + u[1] * 3
+           + (u[1] * u[1]) * REAL(4.5) - calc1);
+        d_equ[2] = w1 * local_density * (REAL(1.0) + u[2] * 3
+           + (u[2] * u[2]) * REAL(4.5) - calc1);
+        d_equ[3] = w1 * local_density * (REAL(1.0) + u[3] * 3
+           + (u[3] * u[3]) * REAL(4.5) - calc1);
+        d_equ[4] = w1 * local_density * (REAL(1.0) + u[4] * 3
+           + (u[4] * u[4]) * REAL(4.5) - calc1);
         /* diagonal speeds: weight w2 */
-        d_equ[5] = w2 * local_density * (1.0 + u[5] * 3
-           + (u[5] * u[5]) * 4.5 - calc1);
-        d_equ[6] = w2 * local_density * (1.0 + u[6] * 3
-           + (u[6] * u[6]) * 4.5 - calc1);
-        d_equ[7] = w2 * local_density * (1.0 + u[7] * 3
-           + (u[7] * u[7]) * 4.5 - calc1);
-        d_equ[8] = w2 * local_density * (1.0 + u[8] * 3
-           + (u[8] * u[8]) * 4.5 - calc1);
+        d_equ[5] = w2 * local_density * (REAL(1.0) + u[5] * 3
+           + (u[5] * u[5]) * REAL(4.5) - calc1);
+        d_equ[6] = w2 * local_density * (REAL(1.0) + u[6] * 3
+           + (u[6] * u[6]) * REAL(4.5) - calc1);
+        d_equ[7] = w2 * local_density * (REAL(1.0) + u[7] * 3
+           + (u[7] * u[7]) * REAL(4.5) - calc1);
+        d_equ[8] = w2 * local_density * (REAL(1.0) + u[8] * 3
+           + (u[8] * u[8]) * REAL(4.5) - calc1);
         /* relaxation step */
         for(kk=0;kk<NSPEEDS;kk++) {
-          cells[pos+kk] = (tmp_cells[pos+kk]
-             + params.omega * 
-             (d_equ[kk] - tmp_cells[pos+kk]));
+          n[kk] = (t[kk] + omega * (d_equ[kk] - t[kk]));
+        }
+        /* accumulate the norm of the new velocity, computed from
+        ** the stored densities to match av_velocity() */
+        n_density = 0.0;
+        for(kk=0;kk<NSPEEDS;kk++) {
+          n_density += n[kk];
         }
+        n_x = (n[1] + n[5] + n[8] - (n[3] + n[6] + n[7])) / n_density;
+        n_y = (n[2] + n[5] + n[6] - (n[4] + n[7] + n[8])) / n_density;
+        tot_u += sqrt((n_x * n_x) + (n_y * n_y));
+        ++swept;
+        /* accelerate the 2nd row of the grid for the next step,
+        ** if we don't send a density negative */
+        if (row_accel &&
+          (n[3] - a1) > 0 && (n[6] - a2) > 0 && (n[7] - a2) > 0) {
+          /* increase 'east-side' densities */
+          n[1] += a1;
+          n[5] += a2;
+          n[8] += a2;
+          /* decrease 'west-side' densities */
+          n[3] -= a1;
+          n[6] -= a2;
+          n[7] -= a2;
+        }
+      }
+      for(kk=0;kk<NSPEEDS;kk++) {
+        tmp_cells[pos+kk] = n[kk];
       }
     }
   }
 
-  return EXIT_SUCCESS; 
+  *tot_cells = swept;
+  balance.time += MPI_Wtime() - start;
+  return tot_u;
 }
 
 int initialise(const char* paramfile, const char* obstaclefile,
-         t_param* params, float** cells_ptr, float** tmp_cells_ptr, 
+         t_param* params, t_real** cells_ptr, t_real** tmp_cells_ptr, 
          int** obstacles_ptr, double** av_vels_ptr)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
-  int    ii,jj;       /* generic counters */
+  int    ii,jj,kk;       /* generic counters */
   int    xx,yy;          /* generic array indices */
   int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
   int    retval;         /* to hold return value for checking */
   double w0,w1,w2;       /* weighting factors */
+  t_real density[NSPEEDS];  /* the densities of each cell at the start */
+  int    rank,size;
+  int    periods[2] = { TRUE, TRUE };  /* the grid wraps around both ways */
+  size_t ncells;         /* cells in this rank's lattice, with its halo */
+  int*   row_blocked;    /* the no. of blocked cells in each row of the grid */
+  int*   col_blocked;    /* and in each column */
 
   /* open the parameter file */
   fp = fopen(paramfile,"r");
@@ -481,6 +1283,49 @@ int initialise(const char* paramfile, const char* obstaclefile,
   /* and close up the file */
   fclose(fp);
 
+  /* arrange the ranks as a grid of blocks, keeping their order */
+  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+  MPI_Comm_size(MPI_COMM_WORLD,&size);
+  process_grid(*params,size,cart_dims);
+  MPI_Cart_create(MPI_COMM_WORLD,2,cart_dims,periods,FALSE,&cart);
+#ifdef SHARED_HALO
+  /* and find those on this node */
+  MPI_Comm_split_type(cart,MPI_COMM_TYPE_SHARED,rank,MPI_INFO_NULL,&shared.comm);
+#endif
+
+  /* open the obstacle data file */
+  fp = fopen(obstaclefile,"r");
+  if (fp == NULL) {
+    sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+    die(message,__LINE__,__FILE__);
+  }
+
+  /* read-in the blocked cells list, counting those in each row and
+  ** column, by which the grid is split among the blocks */
+  row_blocked = (int*)calloc(params->ny,sizeof(int));
+  col_blocked = (int*)calloc(params->nx,sizeof(int));
+  if (row_blocked == NULL || col_blocked == NULL)
+    die("cannot allocate memory for the obstacle counts",__LINE__,__FILE__);
+  while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
+    /* some checks */
+    if ( retval != 3)
+      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
+    if ( xx<0 || xx>params->nx-1 )
+      die("obstacle x-coord out of range",__LINE__,__FILE__);
+    if ( yy<0 || yy>params->ny-1 )
+      die("obstacle y-coord out of range",__LINE__,__FILE__);
+    if ( blocked != 1 ) 
+      die("obstacle blocked value should be 1",__LINE__,__FILE__);
+    row_blocked[yy]++;
+    col_blocked[xx]++;
+  }
+  balance_init(*params,row_blocked,col_blocked);
+  free(row_blocked);
+  free(col_blocked);
+
+  /* find the rows and columns of this rank's block */
+  rank_block(rank,&local_start,&local_end,&local_col_start,&local_col_end);
+
   /* 
   ** Allocate memory.
   **
@@ -497,73 +1342,67 @@ int initialise(const char* paramfile, const char* obstaclefile,
   **
   ** Note also that we are using a structure to
   ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
+  ** a 1D array of these structs, with room for
+  ** just this rank's block and the ring of halo
+  ** cells around it.
   */
+  ncells = (size_t)(local_end - local_start + 2)*(local_col_end - local_col_start + 2);
 
-  /* main grid */
-  *cells_ptr = (float*)malloc(sizeof(float)*(params->ny*params->nx)*NSPEEDS);
-  if (*cells_ptr == NULL) 
-    die("cannot allocate memory for cells",__LINE__,__FILE__);
-
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (float*)malloc(sizeof(float)*(params->ny*params->nx)*NSPEEDS);
-  if (*tmp_cells_ptr == NULL) 
-    die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
+  /* main grid, and 'helper' grid, used as scratch space */
+  grid_alloc(ncells,cells_ptr,tmp_cells_ptr);
   
-  /* the map of obstacles */
-  *obstacles_ptr = (int*)malloc(sizeof(int)*(params->ny*params->nx));
+  /* the map of obstacles, of this rank's block */
+  *obstacles_ptr = (int*)malloc(sizeof(int)*
+    (local_end - local_start)*(local_col_end - local_col_start));
   if (*obstacles_ptr == NULL) 
     die("cannot allocate column memory for obstacles",__LINE__,__FILE__);
 
-  /* initialise densities */
+  /* initialise densities, of the halo too, until the first exchange */
   w0 = params->density * 4.0/9.0;
   w1 = params->density      /9.0;
   w2 = params->density      /36.0;
-
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      /* centre */
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS] = w0;
-      /* axis directions */
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+1] = w1;
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+2] = w1;
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+3] = w1;
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+4] = w1;
-      /* diagonals */
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+5] = w2;
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+6] = w2;
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+7] = w2;
-      (*cells_ptr)[(ii*params->nx + jj)*NSPEEDS+8] = w2;
+  density[0] = w0;                      /* centre */
+  for(kk=1;kk<5;kk++) density[kk] = w1; /* axis directions */
+  for(kk=5;kk<9;kk++) density[kk] = w2; /* diagonals */
+
+  /* the rows of the block are shared among the threads, if any, as
+  ** stream_collide() shares them, so that each thread first touches,
+  ** and so places in memory near it, the rows of both grids it sweeps */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) private(jj,kk)
+#endif
+  for(ii=local_start;ii<local_end;ii++) {
+    for(jj=local_col_start-1;jj<=local_col_end;jj++) {
+      for(kk=0;kk<NSPEEDS;kk++) {
+        (*cells_ptr)[CELL(ii,jj)+kk] = density[kk];
+        (*tmp_cells_ptr)[CELL(ii,jj)+kk] = density[kk];
+      }
     }
   }
-
-  /* first set all cells in obstacle array to zero */ 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (*obstacles_ptr)[ii*params->nx + jj] = 0;
+  /* and the halo rows either side */
+  for(ii=local_start-1;ii<=local_end;ii+=local_end-local_start+1) {
+    for(jj=local_col_start-1;jj<=local_col_end;jj++) {
+      for(kk=0;kk<NSPEEDS;kk++) {
+        (*cells_ptr)[CELL(ii,jj)+kk] = density[kk];
+        (*tmp_cells_ptr)[CELL(ii,jj)+kk] = density[kk];
+      }
     }
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile,"r");
-  if (fp == NULL) {
-    sprintf(message,"could not open input obstacles file: %s", obstaclefile);
-    die(message,__LINE__,__FILE__);
+  /* first set all cells in obstacle array to zero */ 
+  for(ii=local_start;ii<local_end;ii++) {
+    for(jj=local_col_start;jj<local_col_end;jj++) {
+      (*obstacles_ptr)[BLOCK_CELL(ii,jj)] = 0;
+    }
   }
 
-  /* read-in the blocked cells list */
+  /* read the list again, already checked, keeping the blocked cells
+  ** of this rank's block */
+  rewind(fp);
   while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if ( retval != 3)
-      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-    if ( xx<0 || xx>params->nx-1 )
-      die("obstacle x-coord out of range",__LINE__,__FILE__);
-    if ( yy<0 || yy>params->ny-1 )
-      die("obstacle y-coord out of range",__LINE__,__FILE__);
-    if ( blocked != 1 ) 
-      die("obstacle blocked value should be 1",__LINE__,__FILE__);
-    /* assign to array */
-    (*obstacles_ptr)[yy*params->nx + xx] = blocked;
+    /* assign to array, if it is in this rank's block */
+    if (local_start <= yy && yy < local_end && local_col_start <= xx && xx < local_col_end)
+      (*obstacles_ptr)[BLOCK_CELL(yy,xx)] = blocked;
   }
   
   /* and close the file */
@@ -578,17 +1417,13 @@ int initialise(const char* paramfile, const char* obstaclefile,
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param* params, float** cells_ptr, float** tmp_cells_ptr,
+int finalise(const t_param* params, t_real** cells_ptr, t_real** tmp_cells_ptr,
        int** obstacles_ptr, double** av_vels_ptr)
 {
   /* 
   ** free up allocated memory
   */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
-
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+  grid_free(cells_ptr,tmp_cells_ptr);
 
   free(*obstacles_ptr);
   *obstacles_ptr = NULL;
@@ -599,32 +1434,28 @@ int finalise(const t_param* params, float** cells_ptr, float** tmp_cells_ptr,
   return EXIT_SUCCESS;
 }
 
-double av_velocity(const t_param params, float* cells, int* obstacles)
+double av_velocity(t_real* cells, int* obstacles)
 {
   int    ii,jj,kk,pos;       /* generic counters */
   int    tot_cells = 0;  /* no. of cells used in calculation */
-  double local_density;  /* total density in cell */
-  double u_x;            /* x-component of velocity for current cell */
-  double u_y;            /* y-component of velocity for current cell */
-  double tot_u;          /* accumulated magnitudes of velocity for each cell */
-  double global_tot_u;
-  int global_tot_cells = 0;
-  int rank,size;
+  t_acc  local_density;  /* total density in cell */
+  t_acc  u_x;            /* x-component of velocity for current cell */
+  t_acc  u_y;            /* y-component of velocity for current cell */
+  t_acc  tot_u;          /* accumulated magnitudes of velocity for each cell */
 
   /* initialise */
   tot_u = 0.0;
-  global_tot_u = 0.0;
-
-  /*Find rank and size*/
-  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
-  MPI_Comm_size(MPI_COMM_WORLD,&size);
 
   /* loop over all non-blocked cells */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:tot_u,tot_cells) \
+  private(jj,kk,pos,local_density,u_x,u_y)
+#endif
   for(ii=local_start;ii<local_end;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      pos = (ii*params.nx + jj)*9;
+    for(jj=local_col_start;jj<local_col_end;jj++) {
+      pos = CELL(ii,jj);
       /* ignore occupied cells */
-      if(!obstacles[ii*params.nx + jj]) {
+      if(!obstacles[BLOCK_CELL(ii,jj)]) {
         /* local density total */
         local_density = 0.0;
         for(kk=0;kk<NSPEEDS;kk++) {
@@ -645,6 +1476,18 @@ double av_velocity(const t_param params, float* cells, int* obstacles)
       }
     }
   }
+
+  return reduce_av_velocity(tot_u,tot_cells);
+}
+
+double reduce_av_velocity(double tot_u, int tot_cells)
+{
+  double global_tot_u = 0.0;
+  int global_tot_cells = 0;
+  int rank;
+
+  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+
   /*collect individual sums in master process*/
   MPI_Reduce(&tot_u,&global_tot_u,1,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
   MPI_Reduce(&tot_cells,&global_tot_cells,1,MPI_INT,MPI_SUM,0,MPI_COMM_WORLD);
@@ -657,22 +1500,124 @@ double av_velocity(const t_param params, float* cells, int* obstacles)
   return tot_u / (double)tot_cells;
 }
 
-double calc_reynolds(const t_param params, float* cells, int* obstacles)
+int batch_init(const int every)
+{
+  int kk;     /* generic counter */
+
+  batch.every = every;
+  for(kk=0;kk<2;kk++) {
+    batch.sums[kk] = (double*)malloc(sizeof(double)*2*every);
+    batch.totals[kk] = (double*)malloc(sizeof(double)*2*every);
+    if (batch.sums[kk] == NULL || batch.totals[kk] == NULL)
+      die("cannot allocate memory for the velocity sums",__LINE__,__FILE__);
+    batch.count[kk] = 0;
+  }
+  batch.filling = 0;
+  batch.pending = -1;
+  batch.request = MPI_REQUEST_NULL;
+
+  return EXIT_SUCCESS;
+}
+
+/* wait for the batch being reduced, if any, and record its average
+** velocities, of the whole grid on rank 0 and of this rank's block
+** on the others */
+static int batch_wait(double* av_vels)
+{
+  const int bb = batch.pending;
+  const double* sums;
+  int rank;
+  int kk;     /* generic counter */
+
+  if (bb < 0) return EXIT_SUCCESS;
+  MPI_Wait(&batch.request,MPI_STATUS_IGNORE);
+  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+  sums = (rank == 0) ? batch.totals[bb] : batch.sums[bb];
+  for(kk=0;kk<batch.count[bb];kk++) {
+    av_vels[batch.first[bb] + kk] = sums[2*kk] / sums[2*kk + 1];
+  }
+  batch.count[bb] = 0;
+  batch.pending = -1;
+
+  return EXIT_SUCCESS;
+}
+
+/* start reducing the batch being filled, once the last one is done,
+** and fill the other meanwhile */
+static int batch_start(double* av_vels)
+{
+  const int bb = batch.filling;
+
+  batch_wait(av_vels);
+  MPI_Ireduce(batch.sums[bb],batch.totals[bb],2*batch.count[bb],MPI_DOUBLE,MPI_SUM,
+              0,MPI_COMM_WORLD,&batch.request);
+  batch.pending = bb;
+  batch.filling = 1 - bb;
+
+  return EXIT_SUCCESS;
+}
+
+int batch_add(const int step, const double tot_u, const int tot_cells, double* av_vels)
+{
+  const int bb = batch.filling;
+  int done;   /* whether the last batch's reduction is complete */
+
+  if (batch.count[bb] == 0) batch.first[bb] = step;
+  /* the no. of cells is exact as a double */
+  batch.sums[bb][2*batch.count[bb]] = tot_u;
+  batch.sums[bb][2*batch.count[bb] + 1] = tot_cells;
+  batch.count[bb]++;
+
+  if (batch.count[bb] == batch.every) {
+    batch_start(av_vels);
+  }
+  else if (batch.pending >= 0) {
+    /* let MPI get on with the last batch, and record it if done */
+    MPI_Test(&batch.request,&done,MPI_STATUS_IGNORE);
+    if (done) batch_wait(av_vels);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int batch_flush(double* av_vels)
+{
+  if (batch.count[batch.filling] > 0) batch_start(av_vels);
+  batch_wait(av_vels);
+
+  return EXIT_SUCCESS;
+}
+
+int batch_free(void)
+{
+  int kk;     /* generic counter */
+
+  for(kk=0;kk<2;kk++) {
+    free(batch.sums[kk]);
+    batch.sums[kk] = NULL;
+    free(batch.totals[kk]);
+    batch.totals[kk] = NULL;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+double calc_reynolds(const t_param params, t_real* cells, int* obstacles)
 {
   const double viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
   
-  return av_velocity(params,cells,obstacles) * params.reynolds_dim / viscosity;
+  return av_velocity(cells,obstacles) * params.reynolds_dim / viscosity;
 }
 
-double total_density(const t_param params, float* cells)
+t_acc total_density(t_real* cells)
 {
   int ii,jj,kk;        /* generic counters */
-  double total = 0.0;  /* accumulator */
+  t_acc total = 0.0;   /* accumulator */
 
-  for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
+  for(ii=local_start;ii<local_end;ii++) {
+    for(jj=local_col_start;jj<local_col_end;jj++) {
       for(kk=0;kk<NSPEEDS;kk++) {
-  total += cells[(ii*params.nx + jj)*9+kk];
+  total += cells[CELL(ii,jj)+kk];
       }
     }
   }
@@ -680,9 +1625,11 @@ double total_density(const t_param params, float* cells)
   return total;
 }
 
-int write_values(const t_param params, float* cells, int* obstacles, double* av_vels)
+int write_values(const t_param params, t_real* cells, int* obstacles, double* av_vels,
+        const int binary)
 {
   FILE* fp;                     /* file pointer */
+  MPI_File fh;                  /* the final state, shared by all the ranks */
   int ii,jj,kk, pos;            /* generic counters */
   const double c_sq = 1.0/3.0;  /* sq. of speed of sound */
   double local_density;         /* per grid cell sum of densities */
@@ -690,17 +1637,46 @@ int write_values(const t_param params, float* cells, int* obstacles, double* av_
   double u_x;                   /* x-component of velocity in grid cell */
   double u_y;                   /* y-component of velocity in grid cell */
   double u;                     /* norm--root of summed squares--of u_x and u_y */
+  int    rank;
+  int    nrows = local_end - local_start;
+  int    ncols = local_col_end - local_col_start;
+  size_t ncells = (size_t)nrows*ncols;         /* cells in this rank's block */
+  MPI_Offset plane = (MPI_Offset)params.nx*params.ny;  /* values per field */
+  int    sizes[2],subsizes[2],starts[2];  /* where the block is in a field */
+  MPI_Datatype block;           /* and the part of the field it fills */
+  double* fields = NULL;        /* the planes of this rank's block, in binary */
+  t_fields head;                /* and the header of the file */
+  char*  text = NULL;           /* or its lines of text */
+  size_t used = 0;              /* bytes of text so far */
+  int    remain[2] = { FALSE, TRUE };  /* keep the columns of blocks apart */
+  MPI_Comm row_comm;            /* the ranks whose blocks share this one's rows */
+  long long* lengths = NULL;    /* the bytes of this rank's part of each of its rows */
+  long long* before = NULL;     /* and of the parts of those rows before it */
+  long long* totals = NULL;     /* the bytes of every row of the file */
+  long long  offset;            /* where a part of a row goes in the file */
+  int*       counts = NULL;     /* the same, in the form a file view takes */
+  MPI_Aint*  displs = NULL;
 
-  fp = fopen(FINALSTATEFILE,"w");
-  if (fp == NULL) {
-    die("could not open file output file",__LINE__,__FILE__);
+  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+
+  if (binary) {
+    fields = malloc(4*ncells*sizeof(double));
+    if (fields == NULL)
+      die("cannot allocate memory for the output fields",__LINE__,__FILE__);
+  }
+  else {
+    /* room for the longest line of each cell */
+    text    = malloc(ncells*LINE_MAX_LEN);
+    lengths = calloc(nrows, sizeof(long long));
+    if (text == NULL || lengths == NULL)
+      die("cannot allocate memory for the output text",__LINE__,__FILE__);
   }
 
-  for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      pos = (ii*params.nx + jj)*9;
+  for(ii=local_start;ii<local_end;ii++) {
+    for(jj=local_col_start;jj<local_col_end;jj++) {
+      pos = CELL(ii,jj);
       /* an occupied cell */
-      if(obstacles[ii*params.nx + jj]) {
+      if(obstacles[BLOCK_CELL(ii,jj)]) {
         u_x = u_y = u = 0.0;
         pressure = params.density * c_sq;
       }
@@ -723,13 +1699,104 @@ int write_values(const t_param params, float* cells, int* obstacles, double* av_
         /* compute pressure */
         pressure = local_density * c_sq;
       }
-      /* write to file */
-      fprintf(fp,"%d %d %.12E %.12E %.12E %.12E %d\n",jj,ii,u_x,u_y,u,pressure,obstacles[ii*params.nx + jj]);
+      if (binary) {
+        fields[BLOCK_CELL(ii,jj)]            = u_x;
+        fields[ncells + BLOCK_CELL(ii,jj)]   = u_y;
+        fields[2*ncells + BLOCK_CELL(ii,jj)] = u;
+        fields[3*ncells + BLOCK_CELL(ii,jj)] = pressure;
+      }
+      else {
+        /* format the line, to be written with the rest */
+        kk = snprintf(text + used, LINE_MAX_LEN, "%d %d %.12E %.12E %.12E %.12E %d\n",
+                      jj,ii,u_x,u_y,u,pressure,obstacles[BLOCK_CELL(ii,jj)]);
+        used += kk;
+        lengths[ii-local_start] += kk;
+      }
     }
   }
 
-  fclose(fp);
+  if (MPI_File_open(MPI_COMM_WORLD, binary ? FINALSTATEBIN : FINALSTATEFILE,
+                    MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    die("could not open file output file",__LINE__,__FILE__);
+
+  if (binary) {
+    /* the header, then each field, each rank writing its block of it
+    ** through a view of the file that picks the block out */
+    MPI_File_set_size(fh, sizeof(head) + plane*(4*sizeof(double) + sizeof(int)));
+    if (rank == 0) {
+      memset(&head, 0, sizeof(head));
+      memcpy(head.magic, FIELDS_MAGIC, sizeof(head.magic));
+      head.nx    = params.nx;
+      head.ny    = params.ny;
+      head.iters = params.maxIters;
+      MPI_File_write_at(fh, 0, &head, sizeof(head), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    sizes[0]    = params.ny;   sizes[1]    = params.nx;
+    subsizes[0] = nrows;       subsizes[1] = ncols;
+    starts[0]   = local_start; starts[1]   = local_col_start;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &block);
+    MPI_Type_commit(&block);
+    for(kk=0;kk<4;kk++) {
+      MPI_File_set_view(fh, sizeof(head) + kk*plane*sizeof(double), MPI_DOUBLE, block,
+                        "native", MPI_INFO_NULL);
+      MPI_File_write_all(fh, fields + kk*ncells, ncells, MPI_DOUBLE, MPI_STATUS_IGNORE);
+    }
+    MPI_Type_free(&block);
+    /* the obstacles are already laid out as the block */
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_INT, &block);
+    MPI_Type_commit(&block);
+    MPI_File_set_view(fh, sizeof(head) + 4*plane*sizeof(double), MPI_INT, block,
+                      "native", MPI_INFO_NULL);
+    MPI_File_write_all(fh, obstacles, ncells, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_Type_free(&block);
+    free(fields);
+  }
+  else {
+    /* the lines vary in length, so each part of a row goes after all
+    ** the rows before it, and the parts of the same row of the blocks
+    ** to its left.  The lengths of the rows are summed over all the
+    ** ranks, and of the parts to the left over this row of blocks */
+    totals = calloc(params.ny, sizeof(long long));
+    before = calloc(nrows, sizeof(long long));
+    counts = malloc(sizeof(int)*nrows);
+    displs = malloc(sizeof(MPI_Aint)*nrows);
+    if (totals == NULL || before == NULL || counts == NULL || displs == NULL)
+      die("cannot allocate memory for the output text",__LINE__,__FILE__);
+    for(ii=local_start;ii<local_end;ii++) totals[ii] = lengths[ii-local_start];
+    MPI_Allreduce(MPI_IN_PLACE, totals, params.ny, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Cart_sub(cart, remain, &row_comm);
+    MPI_Exscan(lengths, before, nrows, MPI_LONG_LONG, MPI_SUM, row_comm);
+    MPI_Comm_rank(row_comm, &kk);
+    if (kk == 0) memset(before, 0, sizeof(long long)*nrows);
+    MPI_Comm_free(&row_comm);
+    offset = 0;
+    for(ii=0;ii<local_end;ii++) {
+      if (ii >= local_start) {
+        counts[ii-local_start] = lengths[ii-local_start];
+        displs[ii-local_start] = offset + before[ii-local_start];
+      }
+      offset += totals[ii];
+    }
+    for(;ii<params.ny;ii++) offset += totals[ii];
+    /* offset is now the size of the whole file */
+    MPI_File_set_size(fh, offset);
+    MPI_Type_create_hindexed(nrows, counts, displs, MPI_CHAR, &block);
+    MPI_Type_commit(&block);
+    MPI_File_set_view(fh, 0, MPI_CHAR, block, "native", MPI_INFO_NULL);
+    MPI_File_write_all(fh, text, used, MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_Type_free(&block);
+    free(displs);
+    free(counts);
+    free(before);
+    free(totals);
+    free(lengths);
+    free(text);
+  }
+
+  MPI_File_close(&fh);
 
+  /* the average velocities, which only rank 0 holds */
+  if (rank != 0) return EXIT_SUCCESS;
   fp = fopen(AVVELSFILE,"w");
   if (fp == NULL) {
     die("could not open file output file",__LINE__,__FILE__);
@@ -743,31 +1810,589 @@ int write_values(const t_param params, float* cells, int* obstacles, double* av_
   return EXIT_SUCCESS;
 }
 
-int local_start_calc(int numberOfRows, int size, int rank)
+static void checkpoint_header(const t_param params, const int iters, t_checkpoint* head)
+{
+  memset(head, 0, sizeof(t_checkpoint));
+  memcpy(head->magic, CHECKPOINT_MAGIC, sizeof(head->magic));
+  head->real_size    = sizeof(t_real);
+  head->nx           = params.nx;
+  head->ny           = params.ny;
+  head->reynolds_dim = params.reynolds_dim;
+  head->density      = params.density;
+  head->accel        = params.accel;
+  head->omega        = params.omega;
+  head->iters        = iters;
+  /* only the final step leaves the flow unaccelerated */
+  head->accelerated  = iters < params.maxIters;
+}
+
+int checkpoint_write(const char* name, const t_param params, t_real* cells,
+        double* av_vels, const int iters)
 {
-  int base,count=0;
-  int n = numberOfRows;
-  int s = size;
+  char   message[1024];      /* message buffer */
+  char   tmpname[1024];      /* the new checkpoint, until it is complete */
+  MPI_File fh;               /* the file, shared by all the ranks */
+  MPI_Offset plane;          /* bytes per speed in the file */
+  t_checkpoint head;         /* the header of the file */
+  t_real* rows;              /* this rank's block of one speed */
+  int    nrows = local_end - local_start;
+  int    ncols = local_col_end - local_col_start;
+  int    sizes[2],subsizes[2],starts[2];  /* where the block is in a plane */
+  MPI_Datatype block;        /* and the part of the plane it fills */
+  int    ii,jj,kk;           /* generic counters */
+  int    rank;
 
-  if (rank >= size) return numberOfRows;
-  /*calculate 'base' group size, as numberOfRows/size*/
-  base = numberOfRows/size;
-  /*subtract base until group size changes*/
-  while((n/s)==base && s>1) {
-    n = n - base;
-    s--;
-    count++;
+  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+  checkpoint_header(params, iters, &head);
+  plane = (MPI_Offset)params.nx*params.ny*sizeof(t_real);
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  if (MPI_File_open(MPI_COMM_WORLD, tmpname, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    sprintf(message,"could not open checkpoint file: %s", name);
+    die(message,__LINE__,__FILE__);
   }
-  /*At this point, numberOfRows = (count*base) + ((size-count)*(base+1))
-    so first count ranks (0->count-1) should work on base rows, rest on (base+1)*/
-  if (rank < (count+1)) {
-    return (rank*base);
+  /* drop anything left from a longer file */
+  MPI_File_set_size(fh, sizeof(head) + NSPEEDS*plane + (MPI_Offset)iters*sizeof(double));
+
+  /* the header and the average velocities, which only rank 0 holds */
+  if (rank == 0) {
+    MPI_File_write_at(fh, 0, &head, sizeof(head), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, sizeof(head) + NSPEEDS*plane, av_vels, iters, MPI_DOUBLE,
+                      MPI_STATUS_IGNORE);
   }
-  else {
-    return (count*base) + ((rank-count)*(base+1));
+
+  /* each speed of this rank's block, picked out of the cells, goes
+  ** into its own part of that speed's plane, which a view of the file
+  ** picks out in turn.  The ranks write together, so the MPI library
+  ** can combine them into large writes */
+  sizes[0]    = params.ny;   sizes[1]    = params.nx;
+  subsizes[0] = nrows;       subsizes[1] = ncols;
+  starts[0]   = local_start; starts[1]   = local_col_start;
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_T_REAL, &block);
+  MPI_Type_commit(&block);
+  rows = malloc(sizeof(t_real)*nrows*ncols);
+  if (rows == NULL)
+    die("cannot allocate memory for checkpoint rows",__LINE__,__FILE__);
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(ii=local_start;ii<local_end;ii++) {
+      for(jj=local_col_start;jj<local_col_end;jj++) {
+        rows[(ii-local_start)*ncols + jj-local_col_start] = cells[CELL(ii,jj)+kk];
+      }
+    }
+    MPI_File_set_view(fh, sizeof(head) + kk*plane, MPI_T_REAL, block, "native", MPI_INFO_NULL);
+    MPI_File_write_all(fh, rows, nrows*ncols, MPI_T_REAL, MPI_STATUS_IGNORE);
+  }
+  free(rows);
+  MPI_Type_free(&block);
+
+  /* make sure it is on disk before it replaces the last one, so
+  ** a run stopped at any point leaves a complete checkpoint */
+  MPI_File_sync(fh);
+  MPI_File_close(&fh);
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (rank == 0 && rename(tmpname, name) != 0) {
+    sprintf(message,"could not rename checkpoint file to: %s", name);
+    die(message,__LINE__,__FILE__);
   }
+
+  return EXIT_SUCCESS;
 }
 
+int checkpoint_read(const char* name, const t_param params, t_real* cells,
+        double* av_vels, int* accelerated)
+{
+  char   message[1024];      /* message buffer */
+  int    fd;                 /* file descriptor */
+  struct stat st;            /* to find the size of the file */
+  const char* map;           /* the mapped file */
+  t_checkpoint head;         /* the header of the file */
+  size_t plane;              /* bytes per speed in the file */
+  const char* row;           /* a row of the file */
+  int    ii,jj,kk;           /* generic counters */
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    sprintf(message,"could not open checkpoint file: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
+  if ((size_t)st.st_size < sizeof(head))
+    die("checkpoint file is too short",__LINE__,__FILE__);
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    die("could not map checkpoint file",__LINE__,__FILE__);
+  close(fd);
+
+  /* the header, and the sizes it gives, must match this run.  The
+  ** densities may be of either precision, and the parameters are
+  ** compared in single precision, which is all the OpenCL version keeps */
+  memcpy(&head, map, sizeof(head));
+  if (memcmp(head.magic, CHECKPOINT_MAGIC, sizeof(head.magic)) != 0)
+    die("not a checkpoint file",__LINE__,__FILE__);
+  if (head.real_size != sizeof(float) && head.real_size != sizeof(double))
+    die("checkpoint densities are of unknown precision",__LINE__,__FILE__);
+  if (head.nx != params.nx || head.ny != params.ny ||
+      head.reynolds_dim != params.reynolds_dim ||
+      (float)head.density != (float)params.density ||
+      (float)head.accel != (float)params.accel || (float)head.omega != (float)params.omega)
+    die("checkpoint parameters do not match the parameter file",__LINE__,__FILE__);
+  if (head.iters < 0 || head.iters > params.maxIters)
+    die("checkpoint has more timesteps than maxIters",__LINE__,__FILE__);
+  plane = (size_t)params.nx*params.ny*head.real_size;
+  if ((size_t)st.st_size != sizeof(head) + NSPEEDS*plane + head.iters*sizeof(double))
+    die("checkpoint file is the wrong size",__LINE__,__FILE__);
+
+  /* only this rank's block is needed, the halo exchange fills in the rest */
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(ii=local_start;ii<local_end;ii++) {
+      row = map + sizeof(head) + kk*plane + (size_t)ii*params.nx*head.real_size;
+      for(jj=local_col_start;jj<local_col_end;jj++) {
+        if (head.real_size == sizeof(float))
+          cells[CELL(ii,jj)+kk] = ((const float*)row)[jj];
+        else
+          cells[CELL(ii,jj)+kk] = ((const double*)row)[jj];
+      }
+    }
+  }
+  /* which need not be aligned */
+  memcpy(av_vels, map + sizeof(head) + NSPEEDS*plane, head.iters*sizeof(double));
+
+  munmap((void*)map, st.st_size);
+
+  /* a finished run needs no more acceleration */
+  *accelerated = head.accelerated || head.iters == params.maxIters;
+
+  return head.iters;
+}
+
+int process_grid(const t_param params, const int size, int dims[2])
+{
+  char*  shape = getenv("LBM_PROCESS_GRID");  /* columns x rows of blocks, if set */
+  int    cols,rows;          /* a shape of the grid of blocks */
+  int    width,height;       /* the size of the largest block */
+  int    cells,best = -1;    /* the halo cells of each rank, and the fewest */
+
+  if (shape != NULL) {
+    if (sscanf(shape, "%dx%d", &cols, &rows) != 2 || cols < 1 || rows < 1 ||
+        cols*rows != size)
+      die("LBM_PROCESS_GRID must be columns x rows of blocks, one per rank",__LINE__,__FILE__);
+    if (cols > params.nx || rows > params.ny)
+      die("LBM_PROCESS_GRID has more blocks than cells across the grid",__LINE__,__FILE__);
+    dims[0] = rows;
+    dims[1] = cols;
+    return EXIT_SUCCESS;
+  }
+
+  /* of the ways to arrange the ranks, the one with the fewest halo
+  ** cells to swap, counting the corners; fewer columns of blocks win
+  ** a tie, as the rows are contiguous and the columns not */
+  for(cols=1;cols<=size;cols++) {
+    if (size % cols != 0) continue;
+    rows = size / cols;
+    if (cols > params.nx || rows > params.ny) continue;
+    width  = (params.nx + cols - 1) / cols;
+    height = (params.ny + rows - 1) / rows;
+    cells  = ((rows > 1) ? 2*width : 0) + ((cols > 1) ? 2*height : 0)
+           + ((rows > 1 && cols > 1) ? 4 : 0);
+    if (best < 0 || cells < best) {
+      best = cells;
+      dims[0] = rows;
+      dims[1] = cols;
+    }
+  }
+  if (best < 0)
+    die("more ranks than cells across the grid",__LINE__,__FILE__);
+
+  return EXIT_SUCCESS;
+}
+
+int rank_block(const int rank, int* row_start, int* row_end,
+        int* col_start, int* col_end)
+{
+  int coords[2];     /* the rank's place in the grid of blocks */
+
+  MPI_Cart_coords(cart,rank,2,coords);
+  *row_start = balance.rows[coords[0]];
+  *row_end   = balance.rows[coords[0]+1];
+  *col_start = balance.cols[coords[1]];
+  *col_end   = balance.cols[coords[1]+1];
+
+  return EXIT_SUCCESS;
+}
+
+int balance_init(const t_param params, const int* row_blocked, const int* col_blocked)
+{
+  char*  env = getenv("LBM_OBSTACLE_COST");
+  double blocked_cost;   /* the cost of a blocked cell, an open one costing 1 */
+  double* col_cost;      /* the cost of each column of the grid */
+  int    ii,jj;          /* generic counters */
+
+  blocked_cost = env ? atof(env) : OBSTACLE_COST;
+  if (blocked_cost < 0.0)
+    die("LBM_OBSTACLE_COST must not be negative",__LINE__,__FILE__);
+
+  balance.rows = (int*)malloc(sizeof(int)*(cart_dims[0] + 1));
+  balance.cols = (int*)malloc(sizeof(int)*(cart_dims[1] + 1));
+  balance.row_cost = (double*)malloc(sizeof(double)*params.ny);
+  col_cost = (double*)malloc(sizeof(double)*params.nx);
+  if (balance.rows == NULL || balance.cols == NULL ||
+      balance.row_cost == NULL || col_cost == NULL)
+    die("cannot allocate memory for the partition",__LINE__,__FILE__);
+
+  for(ii=0;ii<params.ny;ii++) {
+    balance.row_cost[ii] = (params.nx - row_blocked[ii]) + blocked_cost*row_blocked[ii];
+  }
+  for(jj=0;jj<params.nx;jj++) {
+    col_cost[jj] = (params.ny - col_blocked[jj]) + blocked_cost*col_blocked[jj];
+  }
+  balance_split(balance.row_cost,params.ny,cart_dims[0],balance.rows);
+  balance_split(col_cost,params.nx,cart_dims[1],balance.cols);
+  balance.time = 0.0;
+  balance.bytes = 0.0;
+
+  free(col_cost);
+
+  return EXIT_SUCCESS;
+}
+
+int balance_split(const double* cost, const int n, const int parts, int* starts)
+{
+  double total = 0.0;    /* the cost of all n */
+  double sum = 0.0;      /* of those before the next boundary */
+  int    ii = 0,pp;      /* generic counters */
+
+  for(ii=0;ii<n;ii++) {
+    total += cost[ii];
+  }
+
+  /* put each boundary as near as may be to its share of the total,
+  ** taking a row if at least half its cost falls below the share,
+  ** but leaving every part at least one */
+  starts[0] = 0;
+  ii = 0;
+  for(pp=1;pp<parts;pp++) {
+    while (ii < n - (parts - pp) &&
+           (ii == starts[pp-1] || sum + 0.5*cost[ii] <= total*pp/parts)) {
+      sum += cost[ii];
+      ii++;
+    }
+    starts[pp] = ii;
+  }
+  starts[parts] = n;
+
+  return EXIT_SUCCESS;
+}
+
+int rebalance(const t_param params, t_real** cells_ptr, t_real** tmp_cells_ptr,
+        int** obstacles_ptr)
+{
+  int    size,rank,rr;      /* the ranks */
+  int    coords[2];         /* a rank's place in the grid of blocks */
+  double* times;            /* the time each rank has spent sweeping */
+  double* bands;            /* and each row of blocks, over its columns */
+  double model;             /* the cost of a row of blocks' rows */
+  double slowest,mean;      /* the slowest row of blocks' time, and the mean */
+  int*   old_rows;          /* the rows of blocks as they were */
+  int    start,end;         /* this rank's new rows */
+  int    row_start,row_end,col_start,col_end;  /* another rank's block */
+  int    lo,hi;             /* the rows passed between two ranks */
+  int    width = local_col_end - local_col_start;  /* the columns of this block */
+  int    *sendcounts,*senddispls,*recvcounts,*recvdispls;
+  int    *cellcounts,*celldispls,*gridcounts,*griddispls;
+  t_real *cells,*tmp_cells; /* this rank's new grids */
+  int*   obstacles;         /* and obstacles */
+  size_t ncells;            /* cells in the new lattice, with its halo */
+  int    ii,jj,bb;          /* generic counters */
+
+  if (cart_dims[0] == 1) return EXIT_SUCCESS;
+
+  MPI_Comm_size(cart,&size);
+  MPI_Comm_rank(cart,&rank);
+  times = (double*)malloc(sizeof(double)*size);
+  bands = (double*)calloc(cart_dims[0],sizeof(double));
+  old_rows = (int*)malloc(sizeof(int)*(cart_dims[0] + 1));
+  if (times == NULL || bands == NULL || old_rows == NULL)
+    die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+  MPI_Allgather(&balance.time,1,MPI_DOUBLE,times,1,MPI_DOUBLE,cart);
+  balance.time = 0.0;
+  balance.bytes = 0.0;
+
+  /* the time each row of blocks took, over all its columns; unless one
+  ** took much longer than the mean the rows are left where they are */
+  for(rr=0;rr<size;rr++) {
+    MPI_Cart_coords(cart,rr,2,coords);
+    bands[coords[0]] += times[rr];
+  }
+  free(times);
+  slowest = mean = 0.0;
+  for(bb=0;bb<cart_dims[0];bb++) {
+    if (bands[bb] > slowest) slowest = bands[bb];
+    mean += bands[bb] / cart_dims[0];
+  }
+  if (slowest <= BALANCE_TOLERANCE*mean) {
+    free(bands);
+    free(old_rows);
+    return EXIT_SUCCESS;
+  }
+
+  /* scale the costs of each row of blocks' rows to add up to the time
+  ** it took, and split the grid afresh; every rank has the same times
+  ** so comes to the same split */
+  for(bb=0;bb<cart_dims[0];bb++) {
+    model = 0.0;
+    for(ii=balance.rows[bb];ii<balance.rows[bb+1];ii++) {
+      model += balance.row_cost[ii];
+    }
+    if (bands[bb] > 0.0 && model > 0.0) {
+      for(ii=balance.rows[bb];ii<balance.rows[bb+1];ii++) {
+        balance.row_cost[ii] *= bands[bb] / model;
+      }
+    }
+  }
+  free(bands);
+  memcpy(old_rows,balance.rows,sizeof(int)*(cart_dims[0] + 1));
+  balance_split(balance.row_cost,params.ny,cart_dims[0],balance.rows);
+  if (memcmp(old_rows,balance.rows,sizeof(int)*(cart_dims[0] + 1)) == 0) {
+    free(old_rows);
+    return EXIT_SUCCESS;
+  }
+
+  /* this rank's new block keeps its columns, so whole rows of the
+  ** lattice, halo columns and all, which are contiguous, go between
+  ** ranks in the same column of blocks */
+  rank_block(rank,&start,&end,&col_start,&col_end);
+  ncells = (size_t)(end - start + 2)*(width + 2);
+  grid_alloc(ncells,&cells,&tmp_cells);
+  obstacles = (int*)malloc(sizeof(int)*(end - start)*width);
+  if (obstacles == NULL)
+    die("cannot allocate memory for the rebalanced block",__LINE__,__FILE__);
+  /* the threads, if any, first touch the rows they will sweep */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) private(jj)
+#endif
+  for(ii=start;ii<end;ii++) {
+    for(jj=0;jj<(width + 2)*NSPEEDS;jj++) {
+      cells[(size_t)(ii - start + 1)*(width + 2)*NSPEEDS + jj] = 0.0;
+      tmp_cells[(size_t)(ii - start + 1)*(width + 2)*NSPEEDS + jj] = 0.0;
+    }
+  }
+
+  sendcounts = (int*)calloc(8*size,sizeof(int));
+  if (sendcounts == NULL)
+    die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+  senddispls = sendcounts + size;
+  recvcounts = sendcounts + 2*size;
+  recvdispls = sendcounts + 3*size;
+  cellcounts = sendcounts + 4*size;
+  celldispls = sendcounts + 5*size;
+  gridcounts = sendcounts + 6*size;
+  griddispls = sendcounts + 7*size;
+  for(rr=0;rr<size;rr++) {
+    rank_block(rr,&row_start,&row_end,&col_start,&col_end);
+    if (col_start != local_col_start) continue;
+    /* this rank's old rows that are now the other's */
+    lo = (local_start > row_start) ? local_start : row_start;
+    hi = (local_end < row_end) ? local_end : row_end;
+    if (hi > lo) {
+      sendcounts[rr] = (hi - lo)*width;
+      senddispls[rr] = (lo - local_start)*width;
+      cellcounts[rr] = (hi - lo)*(width + 2)*NSPEEDS;
+      celldispls[rr] = (lo - local_start + 1)*(width + 2)*NSPEEDS;
+    }
+    /* and the other's old rows that are now this rank's */
+    MPI_Cart_coords(cart,rr,2,coords);
+    lo = (start > old_rows[coords[0]]) ? start : old_rows[coords[0]];
+    hi = (end < old_rows[coords[0]+1]) ? end : old_rows[coords[0]+1];
+    if (hi > lo) {
+      recvcounts[rr] = (hi - lo)*width;
+      recvdispls[rr] = (lo - start)*width;
+      gridcounts[rr] = (hi - lo)*(width + 2)*NSPEEDS;
+      griddispls[rr] = (lo - start + 1)*(width + 2)*NSPEEDS;
+      if (rr != rank) balance.bytes += 2.0*gridcounts[rr]*sizeof(t_real);
+    }
+  }
+  MPI_Alltoallv(*cells_ptr,cellcounts,celldispls,MPI_T_REAL,
+                cells,gridcounts,griddispls,MPI_T_REAL,cart);
+  MPI_Alltoallv(*obstacles_ptr,sendcounts,senddispls,MPI_INT,
+                obstacles,recvcounts,recvdispls,MPI_INT,cart);
+  free(sendcounts);
+  free(old_rows);
+
+  /* swap in the new block, and set its halo exchange up afresh */
+  halo_free();
+  grid_free(cells_ptr,tmp_cells_ptr);
+  free(*obstacles_ptr);
+  *cells_ptr = cells;
+  *tmp_cells_ptr = tmp_cells;
+  *obstacles_ptr = obstacles;
+  local_start = start;
+  local_end = end;
+  halo_init(cells,tmp_cells);
+
+  return EXIT_SUCCESS;
+}
+
+int balance_free(void)
+{
+  free(balance.rows);
+  balance.rows = NULL;
+  free(balance.cols);
+  balance.cols = NULL;
+  free(balance.row_cost);
+  balance.row_cost = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef PROFILE
+/*
+** Instrumentation.  Each phase is timed with PROFILE_BEGIN() and
+** PROFILE_END(), which also take the hardware counts of the calling
+** rank, if perf_event_open() is allowed, and the bytes the phase is
+** expected to move.  profile_write() reports it all as JSON.
+*/
+#define NCOUNTERS       2       /* cycles and last level cache misses */
+
+static const char* counter_name[NCOUNTERS] = { "cycles", "llc_misses" };
+
+/* what has been measured of each phase */
+static struct {
+  double    seconds[NPHASES];            /* wallclock time in the phase */
+  double    bytes[NPHASES];              /* traffic of the phase */
+  long      calls[NPHASES];              /* no. of times it ran */
+  long long counts[NPHASES][NCOUNTERS];  /* hardware counts in the phase */
+  double    tic[NPHASES];                /* when the current call began */
+  long long start[NPHASES][NCOUNTERS];   /* the counts when it began */
+  int       fd[NCOUNTERS];               /* the counters, -1 if unavailable */
+} profile;
+
+static double profile_time(void)
+{
+  struct timeval timstr;  /* structure to hold elapsed time */
+
+  gettimeofday(&timstr,NULL);
+  return timstr.tv_sec+(timstr.tv_usec/1000000.0);
+}
+
+static long long profile_count(const int counter)
+{
+  long long count = 0;    /* value of the counter */
+
+  if (profile.fd[counter] < 0 || read(profile.fd[counter],&count,sizeof(count)) != sizeof(count))
+    return 0;
+  return count;
+}
+
+/* size of a file that has been written, for the I/O traffic */
+double profile_file_bytes(const char* name)
+{
+  struct stat st;         /* the file's status */
+
+  return (stat(name,&st) == 0) ? (double)st.st_size : 0.0;
+}
+
+void profile_init(void)
+{
+  const unsigned long long config[NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;  /* what to count */
+  int    kk;                    /* generic counter */
+
+  memset(&profile,0,sizeof(profile));
+  for(kk=0;kk<NCOUNTERS;kk++) {
+    memset(&attr,0,sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[kk];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* the counters are often refused, e.g. by perf_event_paranoid or
+    ** in a container, in which case they are reported as null */
+    profile.fd[kk] = syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+  }
+}
+
+void profile_begin(const int phase)
+{
+  int kk;                 /* generic counter */
+
+  for(kk=0;kk<NCOUNTERS;kk++) profile.start[phase][kk] = profile_count(kk);
+  profile.tic[phase] = profile_time();
+}
+
+void profile_end(const int phase, const double bytes)
+{
+  int kk;                 /* generic counter */
+
+  profile.seconds[phase] += profile_time() - profile.tic[phase];
+  for(kk=0;kk<NCOUNTERS;kk++) {
+    profile.counts[phase][kk] += profile_count(kk) - profile.start[phase][kk];
+  }
+  profile.bytes[phase] += bytes;
+  profile.calls[phase]++;
+}
+
+void profile_write(const t_param params, const int steps, const double elapsed)
+{
+  FILE*  fp;              /* file pointer */
+  int    ii,kk;           /* generic counters */
+  int    rank,size;
+  int    counted;         /* whether every rank has the hardware counters */
+
+  MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+  MPI_Comm_size(MPI_COMM_WORLD,&size);
+
+  /*the slowest rank's times, and the sums of the rest, on rank 0*/
+  counted = (profile.fd[0] >= 0 && profile.fd[1] >= 0);
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : profile.seconds,profile.seconds,NPHASES,
+    MPI_DOUBLE,MPI_MAX,0,MPI_COMM_WORLD);
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : profile.calls,profile.calls,NPHASES,
+    MPI_LONG,MPI_MAX,0,MPI_COMM_WORLD);
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : profile.bytes,profile.bytes,NPHASES,
+    MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : profile.counts,profile.counts,NPHASES*NCOUNTERS,
+    MPI_LONG_LONG,MPI_SUM,0,MPI_COMM_WORLD);
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : &counted,&counted,1,
+    MPI_INT,MPI_MIN,0,MPI_COMM_WORLD);
+  if (rank != 0) return;
+
+  fp = fopen(PROFILEFILE,"w");
+  if (fp == NULL) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+
+  fprintf(fp,"{\n");
+  fprintf(fp,"  \"driver\": \"mpi\",\n");
+  fprintf(fp,"  \"nx\": %d,\n  \"ny\": %d,\n  \"iterations\": %d,\n  \"steps\": %d,\n",
+          params.nx,params.ny,params.maxIters,steps);
+  fprintf(fp,"  \"ranks\": %d,\n",size);
+  fprintf(fp,"  \"process_grid\": [%d, %d],\n",cart_dims[1],cart_dims[0]);
+#ifdef _OPENMP
+  fprintf(fp,"  \"threads\": %d,\n",omp_get_max_threads());
+#else
+  fprintf(fp,"  \"threads\": 1,\n");
+#endif
+  fprintf(fp,"  \"elapsed\": %.6f,\n",elapsed);
+  fprintf(fp,"  \"mlups\": %.3f,\n",
+          (elapsed > 0.0) ? (double)params.nx*params.ny*steps/elapsed/1.0E6 : 0.0);
+  fprintf(fp,"  \"phases\": {\n");
+  for(ii=0;ii<NPHASES;ii++) {
+    fprintf(fp,"    \"%s\": { \"calls\": %ld, \"seconds\": %.6f, \"bytes\": %.0f, \"gbytes_per_s\": %.3f",
+            phase_name[ii],profile.calls[ii],profile.seconds[ii],profile.bytes[ii],
+            (profile.seconds[ii] > 0.0) ? profile.bytes[ii]/profile.seconds[ii]/1.0E9 : 0.0);
+    for(kk=0;kk<NCOUNTERS;kk++) {
+      if (!counted) fprintf(fp,", \"%s\": null",counter_name[kk]);
+      else fprintf(fp,", \"%s\": %lld",counter_name[kk],profile.counts[ii][kk]);
+    }
+    fprintf(fp," }%s\n",(ii < NPHASES-1) ? "," : "");
+  }
+  fprintf(fp,"  }\n}\n");
+
+  fclose(fp);
+}
+#endif
+
 void die(const char* message, const int line, const char *file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
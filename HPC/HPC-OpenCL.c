@@ -11,6 +11,18 @@
 #include <time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef PROFILE
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#endif
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
 #include <unistd.h>
@@ -22,7 +34,495 @@
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
+#define FIELDS_MAGIC    "LBMFLDS1"     /* first 8 bytes of a binary field file */
 #define AVVELSFILE      "av_vels.dat"
+#define PROFILEFILE     "profile.json"
+#define CHECKPOINTFILE  "checkpoint.dat"
+#define CHECKPOINT_MAGIC "LBMCKPT1"     /* first 8 bytes of a checkpoint file */
+#define PROGRAM_CACHE   "d2q9-bgk.cache" /* directory of cached program binaries */
+#define PROGRAM_MAGIC   "LBMCLBN1"     /* first 8 bytes of a cached binary */
+#define MAX_DEVICES     64             /* most devices looked at, over all platforms */
+#define SYNC_EVERY      256            /* timesteps between reading back av_vels */
+
+/*
+** The precision is chosen at compile time with one of
+**
+**   -DPRECISION_MIXED   single precision densities and arithmetic,
+**                       with the velocity sums in double (the default)
+**   -DPRECISION_FLOAT   single precision throughout
+**   -DPRECISION_DOUBLE  double precision throughout
+**
+** and passed on to the kernels, which see the same t_real and
+** t_acc types.  Double precision needs a device with cl_khr_fp64.
+** The density, accel and omega parameters are t_real too, so the
+** t_param of d2q9-bgk.cl must declare them t_real to match.
+*/
+#if !defined(PRECISION_FLOAT) && !defined(PRECISION_MIXED) && !defined(PRECISION_DOUBLE)
+#define PRECISION_MIXED
+#endif
+#if defined(PRECISION_FLOAT) + defined(PRECISION_MIXED) + defined(PRECISION_DOUBLE) > 1
+#error "choose only one of PRECISION_FLOAT, PRECISION_MIXED and PRECISION_DOUBLE"
+#endif
+
+/* the types of the densities and of the sums over the grid, the
+** scanf() format of a t_real, and the options giving the kernels the same */
+#if defined(PRECISION_FLOAT)
+typedef float  t_real;
+typedef float  t_acc;
+#define SCAN_REAL "%f"
+#define PRECISION_OPTIONS "-DPRECISION_FLOAT -Dt_real=float -Dt_acc=float -cl-single-precision-constant"
+#elif defined(PRECISION_MIXED)
+typedef float  t_real;
+typedef double t_acc;
+#define SCAN_REAL "%f"
+#define PRECISION_OPTIONS "-DPRECISION_MIXED -Dt_real=float -Dt_acc=double -cl-single-precision-constant"
+#else
+typedef double t_real;
+typedef double t_acc;
+#define SCAN_REAL "%lf"
+#define PRECISION_OPTIONS "-DPRECISION_DOUBLE -Dt_real=double -Dt_acc=double"
+#endif
+
+/*
+** Built with -DGHOST_CELLS each plane of the lattice is surrounded by
+** a ring of ghost cells, one cell wide.  Every step the refresh_ghosts
+** kernel copies the cells at each edge of the grid into the ghosts at
+** the opposite edge, so that propagate can reach every neighbour
+** directly, without wrapping its indices around the edges.  The
+** separate kernels are then built in, from ghost_source below.
+*/
+#ifdef GHOST_CELLS
+#define GHOST           1       /* width of the ring of ghost cells */
+#define GHOST_OPTIONS   " -DGHOST_CELLS"
+#else
+#define GHOST           0
+#define GHOST_OPTIONS   ""
+#endif
+#define PADDED(n)       ((n) + 2*GHOST)  /* rows or columns including the ghosts */
+
+/*
+** The average velocity is reduced on the device in two stages, by
+** kernels built in with the program.  reduce_av_velocity finds
+** the speed of each cell, and each work-group sums its tile of the
+** grid in local memory, writing one partial sum of the speeds and one
+** of the cells that are not blocked.  record_av_velocity, run as a
+** single work-group, sums the partial sums in the same way and records
+** the step's average velocity in av_vels, indexed by the timestep.
+**
+** The sums are of type t_sum, chosen at run time with
+**
+**   LBM_CL_ACCUMULATOR=float|double  double by default if t_acc is,
+**                                    double needing cl_khr_fp64
+*/
+static const char* reduce_source =
+  "#if defined(SUM_DOUBLE) || defined(PRECISION_DOUBLE)\n"
+  "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+  "#endif\n"
+  "#ifdef GHOST_CELLS\n"
+  "#define REDUCE_GHOST 1\n"
+  "#else\n"
+  "#define REDUCE_GHOST 0\n"
+  "#endif\n"
+  "\n"
+  "/* sum the first n values of a and b into a[0] and b[0] */\n"
+  "void reduce_local(local t_sum* a, local t_sum* b, const int lid, int n)\n"
+  "{\n"
+  "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+  "  while (n > 1) {\n"
+  "    const int kept = (n + 1)/2;\n"
+  "    if (lid < n - kept) {\n"
+  "      a[lid] += a[lid + kept];\n"
+  "      b[lid] += b[lid + kept];\n"
+  "    }\n"
+  "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+  "    n = kept;\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "kernel void reduce_av_velocity(const int nx, const int ny,\n"
+  "        global const t_real* cells, global const int* obstacles,\n"
+  "        local t_sum* local_u, local t_sum* local_cells,\n"
+  "        global t_sum* partial_u, global t_sum* partial_cells)\n"
+  "{\n"
+  "  const int jj = get_global_id(0);\n"
+  "  const int ii = get_global_id(1);\n"
+  "  const int lid = get_local_id(1)*get_local_size(0) + get_local_id(0);\n"
+  "  const int stride = (nx + 2*REDUCE_GHOST)*(ny + 2*REDUCE_GHOST);\n"
+  "  t_sum u = 0;\n"
+  "  t_sum count = 0;\n"
+  "\n"
+  "  if (jj < nx && ii < ny && !obstacles[ii*nx + jj]) {\n"
+  "    global const t_real* c = &cells[(ii + REDUCE_GHOST)*(nx + 2*REDUCE_GHOST) + jj + REDUCE_GHOST];\n"
+  "    t_real density = 0;\n"
+  "    for (int kk = 0; kk < 9; kk++) density += c[kk*stride];\n"
+  "    const t_real u_x = (c[1*stride] + c[5*stride] + c[8*stride]\n"
+  "                        - (c[3*stride] + c[6*stride] + c[7*stride]))/density;\n"
+  "    const t_real u_y = (c[2*stride] + c[5*stride] + c[6*stride]\n"
+  "                        - (c[4*stride] + c[7*stride] + c[8*stride]))/density;\n"
+  "    u = sqrt(u_x*u_x + u_y*u_y);\n"
+  "    count = 1;\n"
+  "  }\n"
+  "  local_u[lid] = u;\n"
+  "  local_cells[lid] = count;\n"
+  "  reduce_local(local_u, local_cells, lid, get_local_size(0)*get_local_size(1));\n"
+  "  if (lid == 0) {\n"
+  "    const int group = get_group_id(1)*get_num_groups(0) + get_group_id(0);\n"
+  "    partial_u[group] = local_u[0];\n"
+  "    partial_cells[group] = local_cells[0];\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "kernel void record_av_velocity(global const t_sum* partial_u,\n"
+  "        global const t_sum* partial_cells, local t_sum* local_u,\n"
+  "        local t_sum* local_cells, global t_sum* av_vels,\n"
+  "        const int n, const int iter)\n"
+  "{\n"
+  "  const int lid = get_local_id(0);\n"
+  "  t_sum u = 0;\n"
+  "  t_sum count = 0;\n"
+  "\n"
+  "  for (int jj = lid; jj < n; jj += get_local_size(0)) {\n"
+  "    u += partial_u[jj];\n"
+  "    count += partial_cells[jj];\n"
+  "  }\n"
+  "  local_u[lid] = u;\n"
+  "  local_cells[lid] = count;\n"
+  "  reduce_local(local_u, local_cells, lid, get_local_size(0));\n"
+  "  if (lid == 0) av_vels[iter] = local_u[0]/local_cells[0];\n"
+  "}\n";
+
+/*
+** Rather than accelerate_flow, propagate, collision and the first
+** stage of the reduction in turn, each step can be a single kernel,
+** chosen at run time with
+**
+**   LBM_CL_KERNELS=separate|fused|tiled  separate by default
+**
+** fused_step pulls in the densities travelling towards each cell,
+** collides them and writes the cell to the other grid, which then
+** becomes the current one, while its work-group sums the speeds into
+** the same partial sums as reduce_av_velocity.  Like the OpenMP sweep
+** it also accelerates row ny-2 ready for the next step, so the flow is
+** accelerated once before the first step and never on its own again.
+** fused_step_tiled first stages the densities of its tile, and of the
+** ring of cells around it, in local memory, so each density is read
+** from the grid once per work-group rather than by each neighbour.
+** Both wrap their indices around the edges themselves, so the ghost
+** cells of -DGHOST_CELLS are left alone.  step_source has its own
+** accelerate_flow for that first step, so the fused steps are built
+** from the embedded sources alone, and d2q9-bgk.cl is read only for
+** the separate kernels.
+*/
+static const char* step_source =
+  "typedef struct {\n"
+  "  int   nx, ny, maxIters, reynolds_dim;\n"
+  "  t_real density, accel, omega;\n"
+  "} t_param;\n"
+  "\n"
+  "/* the index of cell (x,y) of the grid, wrapping around its edges */\n"
+  "int wrap_index(const int nx, const int ny, int x, int y)\n"
+  "{\n"
+  "  x = (x < 0) ? x + nx : (x >= nx) ? x - nx : x;\n"
+  "  y = (y < 0) ? y + ny : (y >= ny) ? y - ny : y;\n"
+  "  return (y + REDUCE_GHOST)*(nx + 2*REDUCE_GHOST) + x + REDUCE_GHOST;\n"
+  "}\n"
+  "\n"
+  "kernel void accelerate_flow(const t_param params, global t_real* cells,\n"
+  "        global const int* obstacles)\n"
+  "{\n"
+  "  const int jj = get_global_id(0);\n"
+  "  const int ii = params.ny - 2;\n"
+  "  const int stride = (params.nx + 2*REDUCE_GHOST)*(params.ny + 2*REDUCE_GHOST);\n"
+  "  const t_real a1 = params.density*params.accel/9.0;\n"
+  "  const t_real a2 = params.density*params.accel/36.0;\n"
+  "\n"
+  "  if (jj < params.nx && !obstacles[ii*params.nx + jj]) {\n"
+  "    global t_real* c = &cells[wrap_index(params.nx, params.ny, jj, ii)];\n"
+  "    if (c[3*stride] - a1 > 0 && c[6*stride] - a2 > 0 && c[7*stride] - a2 > 0) {\n"
+  "      c[1*stride] += a1; c[5*stride] += a2; c[8*stride] += a2;\n"
+  "      c[3*stride] -= a1; c[6*stride] -= a2; c[7*stride] -= a2;\n"
+  "    }\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "/* collide the densities t streamed into a cell, and accelerate the\n"
+  "** flow for the next step if asked; returns the norm of the velocity */\n"
+  "t_sum collide_cell(t_real* t, const int blocked, const int accelerate,\n"
+  "        const t_real density, const t_real accel, const t_real omega)\n"
+  "{\n"
+  "  const t_real w0 = 4.0/9.0;    /* weighting factors */\n"
+  "  const t_real w1 = 1.0/9.0;\n"
+  "  const t_real w2 = 1.0/36.0;\n"
+  "  const t_real a1 = density*accel/9.0;  /* acceleration weights */\n"
+  "  const t_real a2 = density*accel/36.0;\n"
+  "  t_real n[9];                    /* densities after collision */\n"
+  "  t_real u[9];                    /* directional velocities */\n"
+  "  t_sum  norm = 0;\n"
+  "\n"
+  "  if (blocked) {\n"
+  "    /* occupied cells mirror the propagated values */\n"
+  "    n[0] = t[0]; n[1] = t[3]; n[2] = t[4]; n[3] = t[1]; n[4] = t[2];\n"
+  "    n[5] = t[7]; n[6] = t[8]; n[7] = t[5]; n[8] = t[6];\n"
+  "  }\n"
+  "  else {\n"
+  "    const t_real local_density = t[0] + t[1] + t[2] + t[3] + t[4]\n"
+  "                               + t[5] + t[6] + t[7] + t[8];\n"
+  "    const t_real u_x = (t[1] + t[5] + t[8] - (t[3] + t[6] + t[7]))/local_density;\n"
+  "    const t_real u_y = (t[2] + t[5] + t[6] - (t[4] + t[7] + t[8]))/local_density;\n"
+  "    const t_real u_sq = u_x*u_x + u_y*u_y;\n"
+  "\n"
+  "    u[1] =   u_x;       u[2] =   u_y;\n"
+  "    u[3] = - u_x;       u[4] = - u_y;\n"
+  "    u[5] =   u_x + u_y; u[6] = - u_x + u_y;\n"
+  "    u[7] = - u_x - u_y; u[8] =   u_x - u_y;\n"
+  "    n[0] = t[0] + omega*(w0*local_density*(1.0 - u_sq*1.5) - t[0]);\n"
+  "    for (int kk = 1; kk < 9; kk++) {\n"
+  "      const t_real w = (kk < 5) ? w1 : w2;\n"
+  "      n[kk] = t[kk] + omega*(w*local_density*(1.0 + u[kk]*3.0 + (u[kk]*u[kk])*4.5\n"
+  "                                              - u_sq*1.5) - t[kk]);\n"
+  "    }\n"
+  "    /* the speed of the cell after collision, as reduce_av_velocity finds it */\n"
+  "    const t_real n_density = n[0] + n[1] + n[2] + n[3] + n[4] + n[5] + n[6] + n[7] + n[8];\n"
+  "    const t_real n_x = (n[1] + n[5] + n[8] - (n[3] + n[6] + n[7]))/n_density;\n"
+  "    const t_real n_y = (n[2] + n[5] + n[6] - (n[4] + n[7] + n[8]))/n_density;\n"
+  "    norm = sqrt(n_x*n_x + n_y*n_y);\n"
+  "    /* accelerate the flow for the next step, if that sends no density negative */\n"
+  "    if (accelerate && n[3] - a1 > 0 && n[6] - a2 > 0 && n[7] - a2 > 0) {\n"
+  "      n[1] += a1; n[5] += a2; n[8] += a2;\n"
+  "      n[3] -= a1; n[6] -= a2; n[7] -= a2;\n"
+  "    }\n"
+  "  }\n"
+  "  for (int kk = 0; kk < 9; kk++) t[kk] = n[kk];\n"
+  "  return norm;\n"
+  "}\n"
+  "\n"
+  "/* write a cell's new densities and sum the work-group's velocities */\n"
+  "void finish_step(const int nx, const int ny, const int jj, const int ii, const t_real* t,\n"
+  "        const t_sum norm, const int open, global t_real* tmp_cells,\n"
+  "        local t_sum* local_u, local t_sum* local_cells,\n"
+  "        global t_sum* partial_u, global t_sum* partial_cells)\n"
+  "{\n"
+  "  const int lid = get_local_id(1)*get_local_size(0) + get_local_id(0);\n"
+  "  const int stride = (nx + 2*REDUCE_GHOST)*(ny + 2*REDUCE_GHOST);\n"
+  "\n"
+  "  if (jj < nx && ii < ny) {\n"
+  "    const int pos = (ii + REDUCE_GHOST)*(nx + 2*REDUCE_GHOST) + jj + REDUCE_GHOST;\n"
+  "    for (int kk = 0; kk < 9; kk++) tmp_cells[kk*stride + pos] = t[kk];\n"
+  "  }\n"
+  "  local_u[lid] = norm;\n"
+  "  local_cells[lid] = open;\n"
+  "  reduce_local(local_u, local_cells, lid, get_local_size(0)*get_local_size(1));\n"
+  "  if (lid == 0) {\n"
+  "    const int group = get_group_id(1)*get_num_groups(0) + get_group_id(0);\n"
+  "    partial_u[group] = local_u[0];\n"
+  "    partial_cells[group] = local_cells[0];\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "kernel void fused_step(const int nx, const int ny, const t_real density,\n"
+  "        const t_real accel, const t_real omega, const int accelerate,\n"
+  "        global const t_real* cells, global t_real* tmp_cells, global const int* obstacles,\n"
+  "        local t_sum* local_u, local t_sum* local_cells,\n"
+  "        global t_sum* partial_u, global t_sum* partial_cells)\n"
+  "{\n"
+  "  const int jj = get_global_id(0);\n"
+  "  const int ii = get_global_id(1);\n"
+  "  const int stride = (nx + 2*REDUCE_GHOST)*(ny + 2*REDUCE_GHOST);\n"
+  "  t_real t[9];\n"
+  "  t_sum  norm = 0;\n"
+  "  int    open = 0;\n"
+  "\n"
+  "  if (jj < nx && ii < ny) {\n"
+  "    const int blocked = obstacles[ii*nx + jj];\n"
+  "\n"
+  "    /* pull in the densities travelling towards this cell */\n"
+  "    t[0] = cells[0*stride + wrap_index(nx, ny, jj,     ii    )];\n"
+  "    t[1] = cells[1*stride + wrap_index(nx, ny, jj - 1, ii    )];\n"
+  "    t[2] = cells[2*stride + wrap_index(nx, ny, jj,     ii - 1)];\n"
+  "    t[3] = cells[3*stride + wrap_index(nx, ny, jj + 1, ii    )];\n"
+  "    t[4] = cells[4*stride + wrap_index(nx, ny, jj,     ii + 1)];\n"
+  "    t[5] = cells[5*stride + wrap_index(nx, ny, jj - 1, ii - 1)];\n"
+  "    t[6] = cells[6*stride + wrap_index(nx, ny, jj + 1, ii - 1)];\n"
+  "    t[7] = cells[7*stride + wrap_index(nx, ny, jj + 1, ii + 1)];\n"
+  "    t[8] = cells[8*stride + wrap_index(nx, ny, jj - 1, ii + 1)];\n"
+  "    norm = collide_cell(t, blocked, accelerate && ii == ny - 2, density, accel, omega);\n"
+  "    open = !blocked;\n"
+  "  }\n"
+  "  finish_step(nx, ny, jj, ii, t, norm, open, tmp_cells,\n"
+  "              local_u, local_cells, partial_u, partial_cells);\n"
+  "}\n"
+  "\n"
+  "kernel void fused_step_tiled(const int nx, const int ny, const t_real density,\n"
+  "        const t_real accel, const t_real omega, const int accelerate,\n"
+  "        global const t_real* cells, global t_real* tmp_cells, global const int* obstacles,\n"
+  "        local t_sum* local_u, local t_sum* local_cells,\n"
+  "        global t_sum* partial_u, global t_sum* partial_cells, local t_real* tile)\n"
+  "{\n"
+  "  const int jj = get_global_id(0);\n"
+  "  const int ii = get_global_id(1);\n"
+  "  const int lx = get_local_id(0);\n"
+  "  const int ly = get_local_id(1);\n"
+  "  const int width = get_local_size(0) + 2;     /* the tile and its ring of neighbours */\n"
+  "  const int height = get_local_size(1) + 2;\n"
+  "  const int area = width*height;\n"
+  "  const int stride = (nx + 2*REDUCE_GHOST)*(ny + 2*REDUCE_GHOST);\n"
+  "  const int x0 = get_group_id(0)*get_local_size(0) - 1;\n"
+  "  const int y0 = get_group_id(1)*get_local_size(1) - 1;\n"
+  "  t_real t[9];\n"
+  "  t_sum  norm = 0;\n"
+  "  int    open = 0;\n"
+  "\n"
+  "  /* stage all the densities of the tile and its neighbours */\n"
+  "  for (int idx = ly*get_local_size(0) + lx; idx < area;\n"
+  "       idx += get_local_size(0)*get_local_size(1)) {\n"
+  "    const int pos = wrap_index(nx, ny, (x0 + idx%width) % nx, (y0 + idx/width) % ny);\n"
+  "    for (int kk = 0; kk < 9; kk++) tile[kk*area + idx] = cells[kk*stride + pos];\n"
+  "  }\n"
+  "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+  "\n"
+  "  if (jj < nx && ii < ny) {\n"
+  "    const int blocked = obstacles[ii*nx + jj];\n"
+  "    const int c = (ly + 1)*width + lx + 1;      /* this cell in the tile */\n"
+  "\n"
+  "    t[0] = tile[0*area + c];\n"
+  "    t[1] = tile[1*area + c - 1];\n"
+  "    t[2] = tile[2*area + c - width];\n"
+  "    t[3] = tile[3*area + c + 1];\n"
+  "    t[4] = tile[4*area + c + width];\n"
+  "    t[5] = tile[5*area + c - width - 1];\n"
+  "    t[6] = tile[6*area + c - width + 1];\n"
+  "    t[7] = tile[7*area + c + width + 1];\n"
+  "    t[8] = tile[8*area + c + width - 1];\n"
+  "    norm = collide_cell(t, blocked, accelerate && ii == ny - 2, density, accel, omega);\n"
+  "    open = !blocked;\n"
+  "  }\n"
+  "  finish_step(nx, ny, jj, ii, t, norm, open, tmp_cells,\n"
+  "              local_u, local_cells, partial_u, partial_cells);\n"
+  "}\n";
+
+#ifdef GHOST_CELLS
+/*
+** The separate kernels of d2q9-bgk.cl wrap their indices around the
+** edges of a grid without ghosts, so with -DGHOST_CELLS they are built
+** from ghost_source instead, with accelerate_flow and collide_cell from
+** step_source.  refresh_ghosts, one work-item per padded row and
+** column, copies the cells at each edge of the grid into the ghosts
+** beyond the opposite edge, the corners with the ghost rows, and reads
+** only cells of the grid itself.  propagate then pulls in each density
+** straight from the neighbouring cell or ghost, and collision collides
+** each cell with collide_cell, as the fused steps do.
+*/
+static const char* ghost_source =
+  "/* the index of cell (x,y) of a padded plane, x and y from -1 to n */\n"
+  "int ghost_index(const int nx, const int x, const int y)\n"
+  "{\n"
+  "  return (y + 1)*(nx + 2) + x + 1;\n"
+  "}\n"
+  "\n"
+  "kernel void refresh_ghosts(const t_param params, global t_real* cells)\n"
+  "{\n"
+  "  const int nx = params.nx;\n"
+  "  const int ny = params.ny;\n"
+  "  const int stride = (nx + 2)*(ny + 2);\n"
+  "  const int g = get_global_id(0);        /* a padded column, and a padded row */\n"
+  "\n"
+  "  if (g < nx + 2) {\n"
+  "    const int x = (g + nx - 1) % nx;     /* the column the ghosts copy */\n"
+  "    for (int kk = 0; kk < 9; kk++) {\n"
+  "      cells[kk*stride + ghost_index(nx, g - 1, -1)] = cells[kk*stride + ghost_index(nx, x, ny - 1)];\n"
+  "      cells[kk*stride + ghost_index(nx, g - 1, ny)] = cells[kk*stride + ghost_index(nx, x, 0)];\n"
+  "    }\n"
+  "  }\n"
+  "  if (g >= 1 && g <= ny) {\n"
+  "    for (int kk = 0; kk < 9; kk++) {\n"
+  "      cells[kk*stride + ghost_index(nx, -1, g - 1)] = cells[kk*stride + ghost_index(nx, nx - 1, g - 1)];\n"
+  "      cells[kk*stride + ghost_index(nx, nx, g - 1)] = cells[kk*stride + ghost_index(nx, 0, g - 1)];\n"
+  "    }\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "kernel void propagate(const t_param params, global const t_real* cells,\n"
+  "        global t_real* tmp_cells)\n"
+  "{\n"
+  "  const int jj = get_global_id(0);\n"
+  "  const int ii = get_global_id(1);\n"
+  "  const int row = params.nx + 2;\n"
+  "  const int stride = row*(params.ny + 2);\n"
+  "\n"
+  "  if (jj < params.nx && ii < params.ny) {\n"
+  "    const int pos = ghost_index(params.nx, jj, ii);\n"
+  "    tmp_cells[0*stride + pos] = cells[0*stride + pos];\n"
+  "    tmp_cells[1*stride + pos] = cells[1*stride + pos - 1];\n"
+  "    tmp_cells[2*stride + pos] = cells[2*stride + pos - row];\n"
+  "    tmp_cells[3*stride + pos] = cells[3*stride + pos + 1];\n"
+  "    tmp_cells[4*stride + pos] = cells[4*stride + pos + row];\n"
+  "    tmp_cells[5*stride + pos] = cells[5*stride + pos - row - 1];\n"
+  "    tmp_cells[6*stride + pos] = cells[6*stride + pos - row + 1];\n"
+  "    tmp_cells[7*stride + pos] = cells[7*stride + pos + row + 1];\n"
+  "    tmp_cells[8*stride + pos] = cells[8*stride + pos + row - 1];\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "kernel void collision(const t_param params, global t_real* cells,\n"
+  "        global const t_real* tmp_cells, global const int* obstacles)\n"
+  "{\n"
+  "  const int jj = get_global_id(0);\n"
+  "  const int ii = get_global_id(1);\n"
+  "  const int stride = (params.nx + 2)*(params.ny + 2);\n"
+  "  t_real t[9];\n"
+  "\n"
+  "  if (jj < params.nx && ii < params.ny) {\n"
+  "    const int pos = ghost_index(params.nx, jj, ii);\n"
+  "    for (int kk = 0; kk < 9; kk++) t[kk] = tmp_cells[kk*stride + pos];\n"
+  "    collide_cell(t, obstacles[ii*params.nx + jj], 0, params.density, params.accel, params.omega);\n"
+  "    for (int kk = 0; kk < 9; kk++) cells[kk*stride + pos] = t[kk];\n"
+  "  }\n"
+  "}\n";
+#endif
+
+/*
+** Built with -DPROFILE each phase of the run is timed, the kernels
+** by the device itself, and a profile giving the time, memory traffic
+** and, on the host, hardware counts of each phase, and the lattice
+** updates per second, is written as JSON to profile.json.
+*/
+#ifdef PROFILE
+/* the phases of a run that are timed */
+enum phase {
+  PH_INITIALISE,      /* reading the input and setting up the grids */
+  PH_SETUP,           /* creating the context, buffers and kernels */
+  PH_ACCELERATE,      /* the accelerate_flow kernel */
+  PH_REFRESH_GHOSTS,  /* the refresh_ghosts kernel, with GHOST_CELLS */
+  PH_PROPAGATE,       /* the propagate kernel */
+  PH_COLLISION,       /* the collision kernel */
+  PH_REDUCTION,       /* the reduce_av_velocity and record_av_velocity kernels */
+  PH_FUSED,           /* the fused_step or fused_step_tiled kernel */
+  PH_IO,              /* reading back the grid, write_values() and checkpoints */
+  NPHASES
+};
+static const char* phase_name[NPHASES] = {
+  "initialise", "setup", "accelerate", "refresh_ghosts", "propagate", "collision",
+  "reduction", "fused", "io"
+};
+/* the phases timed by the device, which has no hardware counts */
+static const int phase_on_device[NPHASES] = { 0, 0, 1, 1, 1, 1, 1, 1, 0 };
+#define PROFILE_INIT()              profile_init()
+#define PROFILE_BEGIN(phase)        profile_begin(phase)
+#define PROFILE_END(phase,bytes)    profile_end(phase,bytes)
+#define PROFILE_EVENT(phase)        (&events[phase])
+#define PROFILE_COLLECT(wait)       profile_collect(wait)
+#define PROFILE_WRITE(params,steps,time) profile_write(params,steps,time)
+#define QUEUE_PROPERTIES            CL_QUEUE_PROFILING_ENABLE
+#else
+#define PROFILE_INIT()
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase,bytes)
+#define PROFILE_EVENT(phase)        NULL
+#define PROFILE_COLLECT(wait)
+#define PROFILE_WRITE(params,steps,time)
+#define QUEUE_PROPERTIES            0
+#endif
 
 /* struct to hold the parameter values */
 typedef struct {
@@ -30,33 +530,130 @@ typedef struct {
   int    ny;            /* no. of cells in y-direction */
   int    maxIters;      /* no. of iterations */
   int    reynolds_dim;  /* dimension for Reynolds number */
-  float density;       /* density per link */
-  float accel;         /* density redistribution */
-  float omega;         /* relaxation parameter */
+  t_real density;       /* density per link */
+  t_real accel;         /* density redistribution */
+  t_real omega;         /* relaxation parameter */
 } t_param;
 
+/*
+** Long runs can be checkpointed, and restarted after being stopped:
+**
+**   LBM_CHECKPOINT_EVERY=n  write a checkpoint every n timesteps
+**   LBM_CHECKPOINT=file     to this file, checkpoint.dat by default
+**   LBM_RESTART=file        carry on from a checkpoint
+**
+** The checkpoint file starts with this header.  It is followed by the
+** 9 planes of the grid, each of ny*nx densities of real_size bytes in
+** row major order, without the ghost cells, then by the iters average
+** velocities recorded so far, as doubles.  This is the same format the
+** OpenMP and MPI versions write, so a run can be restarted by any of
+** them.  The grid is read back from the device for each checkpoint.
+*/
+typedef struct {
+  char   magic[8];      /* CHECKPOINT_MAGIC */
+  int    real_size;     /* bytes per density */
+  int    nx;            /* the parameters of the run, which a restart must match */
+  int    ny;
+  int    reynolds_dim;
+  double density;
+  double accel;
+  double omega;
+  int    iters;         /* no. of timesteps made */
+  int    accelerated;   /* whether the last step also accelerated the flow */
+} t_checkpoint;
+
+/*
+** The header of final_state.bin, written instead of final_state.dat
+** with LBM_OUTPUT=binary.  It is followed by planes of ny*nx values in
+** row major order: the x and y components of the velocity, its norm
+** and the pressure of each cell, as doubles, then whether each cell is
+** blocked, as ints.  HPC-bin2text.c turns it back into text.
+*/
+typedef struct {
+  char   magic[8];      /* FIELDS_MAGIC */
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    iters;         /* no. of timesteps made */
+  int    pad;           /* keeps the planes aligned */
+} t_fields;
+
 enum boolean { FALSE, TRUE };
 
+/* the kernels that make each step, chosen with LBM_CL_KERNELS */
+enum kernels { KERNELS_SEPARATE, KERNELS_FUSED, KERNELS_TILED };
+
 /*
 ** function prototypes
 */
 
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
-        t_param* h_params, float** h_cells_ptr, float** h_tmp_cells_ptr, 
+        t_param* h_params, t_real** h_cells_ptr, t_real** h_tmp_cells_ptr, 
          int** h_obstacles_ptr, double** h_av_vels_ptr);
 
-/*Host program functions*/
-void init_context_bcp3(cl_context* context, cl_device_id* device);
+/*
+** Host program functions.  init_context() finds the device to run on
+** and creates a context for it.  The device is chosen with
+**
+**   LBM_CL_DEVICE_TYPE=type  gpu, cpu, accelerator or all; by default a
+**                            GPU, or any device if there is no GPU, so
+**                            CPU-only nodes run on a CPU runtime such
+**                            as PoCL
+**   LBM_CL_DEVICE=n          the n'th device of that type, counted over
+**                            all the platforms, 0 by default
+**
+** On BlueCrystal the queue gives each job a GPU, named in the file
+** PBS_GPUFILE, which is used unless LBM_CL_DEVICE is set.
+**
+** choose_work_group() picks the work-group of a kernel over the grid
+** from the limits the device and kernel report, or from
+** LBM_CL_WORK_GROUP=XxY.
+**
+** build_program() builds the program from its sources, keeping the
+** binary in a cache so later runs can skip the compiler.  A binary is
+** found by a hash of the device, its driver, the build options and
+** the sources, which is checked in full against the file, and any
+** binary that is missing or that the driver rejects is rebuilt from
+** source.  It sets cached if the binary came from the cache.
+**
+**   LBM_CL_CACHE=dir         the directory of the cache, d2q9-bgk.cache
+**                            by default, or off to always build from
+**                            source
+*/
+void init_context(cl_context* context, cl_device_id* device);
+void choose_work_group(cl_kernel kernel, cl_device_id device, const size_t size,
+        size_t local[2]);
+cl_program build_program(cl_context context, cl_device_id device, const cl_uint count,
+        const char** sources, const char* options, int* cached);
 char* getKernelSource(char* filename);
 
 /*main functions*/
-int write_values(const t_param params, float* h_cells, int* h_obstacles, double* h_av_vels);
+int write_values(const t_param params, t_real* h_cells, int* h_obstacles, double* h_av_vels,
+        const int binary);
+
+/* save the grid and the first iters average velocities to a checkpoint,
+** noting whether the grid is already accelerated for the next step,
+** and load them back, returning the no. of timesteps it had made */
+int checkpoint_write(const char* name, const t_param params, t_real* h_cells,
+        double* h_av_vels, const int iters, const int accelerated);
+int checkpoint_read(const char* name, const t_param params, t_real* h_cells,
+        double* h_av_vels, int* accelerated);
 
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* h_params, float** h_cells_ptr, float** h_tmp_cells_ptr,
+int finalise(const t_param* h_params, t_real** h_cells_ptr, t_real** h_tmp_cells_ptr,
        int** h_obstacles_ptr, double** h_av_vels_ptr);
 
+#ifdef PROFILE
+/* time the phases of the run, and report them */
+void profile_init(void);
+void profile_begin(const int phase);
+void profile_end(const int phase, const double bytes);
+void profile_event(const int phase, cl_event event, const double bytes);
+void profile_collect(const int wait);
+void profile_write(const t_param params, const int steps, const double elapsed);
+double profile_file_bytes(const char* name);
+#endif
+
 /*Utility functions*/
 void usage(const char* exe);
 void die(const char* message, const int line, const char *file);
@@ -68,17 +665,38 @@ int main(int argc, char*argv[])
   char*    paramfile = NULL;      /* name of the input parameter file */
   char*    obstaclefile = NULL;   /* name of a the input obstacle file */
   t_param  h_params;              /* struct to hold parameter values */
-  float* h_cells     = NULL;      /* grid containing fluid densities */
-  float* h_tmp_cells = NULL;      /* scratch space */
-  double* h_partial_u = NULL;      /* array to hold partial sums for reduction */
-  double* h_partial_cells = NULL;  
+  t_real* h_cells     = NULL;      /* grid containing fluid densities */
+  t_real* h_tmp_cells = NULL;      /* scratch space */
+  char*   h_av_sums = NULL;        /* av_vels as read back from the device, as t_sum */
   int*     h_obstacles = NULL;    /* grid indicating which cells are blocked */
   double*  h_av_vels   = NULL;    /* a record of the av. velocity computed for each timestep */
   int size;                       /* size of grid to work over (should be multiple of 32? power of 2?) */
-  size_t n_work_groups,work_group_size;
-  double tmp;
+  size_t local_prop[2],local_coll[2];  /* the work-groups of propagate and collision */
+  size_t local_av[2];             /* the work-group of reduce_av_velocity, or of the fused step */
+  size_t local_rec;               /* and of record_av_velocity */
+  size_t max_rec;                 /* the largest it may be */
+  int n_groups;                   /* no. of partial sums, one per work-group */
+  int sum_double;                 /* whether the sums are in double */
+  size_t sum_size;                /* and their size */
+  cl_ulong local_mem;             /* local memory of the device, in bytes */
+  size_t tile_bytes = 0;          /* local memory of the tile of fused_step_tiled */
+  int kernels;                    /* the kernels that make each step */
+  const char* kernels_name;       /* and their name */
+  char options[1024];             /* the options the kernels are built with */
+  char device_name[256];          /* the device the kernels run on */
+  char message[1024];             /* message buffer */
+  int sync_every;                 /* timesteps between reading back av_vels */
+  int chunk;                      /* the first timestep not yet being read back */
+  int first = 0;                  /* the first timestep to make, after any restart */
+  int accelerated = FALSE;        /* whether a restart's flow is already accelerated */
+  char* restartfile;              /* checkpoint to restart from, if any */
+  char* checkpointfile;           /* where to write checkpoints */
+  int checkpoint_every;           /* timesteps between checkpoints, 0 for none */
+  char* format;                   /* the format of the final state */
+  int binary;                     /* whether to write it in binary */
 
   char* kernelsource;             /*Kernel source*/
+  int cached;                     /* whether the program binary came from the cache */
 
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
@@ -87,13 +705,23 @@ int main(int argc, char*argv[])
   double systim;                /* floating point number to record elapsed system CPU time */
 
   cl_mem d_params, d_cells, d_tmp_cells, d_obstacles;
-  cl_mem d_partial_u, d_partial_cells;
+  cl_mem d_partial_u, d_partial_cells, d_av_vels;
   cl_int err;
   cl_context context;
   cl_device_id device;
   cl_command_queue commands1, commands2;
   cl_program program;
-  cl_kernel kernel_acc, kernel_prop, kernel_coll, kernel_av;
+  cl_kernel kernel_acc, kernel_av, kernel_rec;
+  cl_kernel kernel_prop = NULL, kernel_coll = NULL;  /* the separate kernels, if chosen */
+  cl_kernel kernel_step = NULL;   /* fused_step or fused_step_tiled, if chosen */
+  cl_event recorded = NULL;       /* the end of the last chunk of timesteps */
+  cl_event previous = NULL;       /* and of the one before */
+#ifdef PROFILE
+  cl_event events[NPHASES];      /* the last command of each phase on the device */
+#endif
+#ifdef GHOST_CELLS
+  cl_kernel kernel_ghost = NULL;
+#endif
 
 //-----------------------------------------------------------------
 // Standard LBM set up
@@ -109,11 +737,39 @@ int main(int argc, char*argv[])
   }
 
   /* initialise our data structures and load values from file */
+  PROFILE_INIT();
+  PROFILE_BEGIN(PH_INITIALISE);
   initialise(paramfile, obstaclefile, &h_params, &h_cells, &h_tmp_cells, &h_obstacles, &h_av_vels);
+  PROFILE_END(PH_INITIALISE, (double)NSPEEDS*sizeof(t_real)*PADDED(h_params.nx)*PADDED(h_params.ny));
 
   size = fmax(h_params.nx,h_params.ny);
   while ((size % 32) != 0) size++ ;
 
+  /* checkpoint every so many timesteps, and restart from a checkpoint,
+  ** which is loaded before the grid is copied to the device */
+  checkpointfile   = getenv("LBM_CHECKPOINT") ? getenv("LBM_CHECKPOINT") : CHECKPOINTFILE;
+  checkpoint_every = getenv("LBM_CHECKPOINT_EVERY") ? atoi(getenv("LBM_CHECKPOINT_EVERY")) : 0;
+  restartfile      = getenv("LBM_RESTART");
+  if (checkpoint_every < 0)
+    die("LBM_CHECKPOINT_EVERY must not be negative",__LINE__,__FILE__);
+  format = getenv("LBM_OUTPUT") ? getenv("LBM_OUTPUT") : "text";
+  if (strcmp(format,"text") != 0 && strcmp(format,"binary") != 0)
+    die("LBM_OUTPUT must be text or binary",__LINE__,__FILE__);
+  binary = strcmp(format,"binary") == 0;
+  sync_every = getenv("LBM_CL_SYNC_EVERY") ? atoi(getenv("LBM_CL_SYNC_EVERY")) : SYNC_EVERY;
+  if (sync_every < 1)
+    die("LBM_CL_SYNC_EVERY must be positive",__LINE__,__FILE__);
+  kernels_name = getenv("LBM_CL_KERNELS") ? getenv("LBM_CL_KERNELS") : "separate";
+  if (strcmp(kernels_name,"separate") == 0) kernels = KERNELS_SEPARATE;
+  else if (strcmp(kernels_name,"fused") == 0) kernels = KERNELS_FUSED;
+  else if (strcmp(kernels_name,"tiled") == 0) kernels = KERNELS_TILED;
+  else die("LBM_CL_KERNELS must be separate, fused or tiled",__LINE__,__FILE__);
+  if (restartfile != NULL) {
+    PROFILE_BEGIN(PH_IO);
+    first = checkpoint_read(restartfile,h_params,h_cells,h_av_vels,&accelerated);
+    PROFILE_END(PH_IO, profile_file_bytes(restartfile));
+  }
+
 //----------------------------------------------------------------
 // Start timer
 //----------------------------------------------------------------
@@ -126,9 +782,28 @@ int main(int argc, char*argv[])
 //-----------------------------------------------------------------
 
   //find devices and create context
-  init_context_bcp3(&context,&device);
-  //create a command queue
-  commands1 = clCreateCommandQueue(context,device,0,&err);
+  PROFILE_BEGIN(PH_SETUP);
+  init_context(&context,&device);
+  clGetDeviceInfo(device,CL_DEVICE_NAME,sizeof(device_name),device_name,NULL);
+  //choose the type the average velocity is summed in
+  sum_double = sizeof(t_acc) == sizeof(double);
+  if (getenv("LBM_CL_ACCUMULATOR") != NULL) {
+    if (strcmp(getenv("LBM_CL_ACCUMULATOR"),"float") == 0) sum_double = FALSE;
+    else if (strcmp(getenv("LBM_CL_ACCUMULATOR"),"double") == 0) sum_double = TRUE;
+    else die("LBM_CL_ACCUMULATOR must be float or double",__LINE__,__FILE__);
+  }
+  if (sum_double) {
+    char extensions[4096] = "";   /* what the device supports */
+
+    clGetDeviceInfo(device,CL_DEVICE_EXTENSIONS,sizeof(extensions),extensions,NULL);
+    if (strstr(extensions,"cl_khr_fp64") == NULL) {
+      sprintf(message,"%s has no double precision, so set LBM_CL_ACCUMULATOR=float",device_name);
+      die(message,__LINE__,__FILE__);
+    }
+  }
+  sum_size = sum_double ? sizeof(double) : sizeof(float);
+  //create a command queue, timing its commands if profiling
+  commands1 = clCreateCommandQueue(context,device,QUEUE_PROPERTIES,&err);
   //checkError(err,"Creating Command Queue 1");
   commands2 = clCreateCommandQueue(context,device,0, &err);
   //checkError(err,"Creating Command Queue 2");
@@ -138,10 +813,10 @@ int main(int argc, char*argv[])
 //----------------------------------------------------------------
 
   d_cells = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-              sizeof(float)*NSPEEDS*h_params.nx*h_params.ny, h_cells, &err);
+              sizeof(t_real)*NSPEEDS*PADDED(h_params.nx)*PADDED(h_params.ny), h_cells, &err);
   //checkError(err,"Creating buffer d_cells");
   d_tmp_cells = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-                  sizeof(float)*NSPEEDS*h_params.nx*h_params.ny, h_tmp_cells, &err);
+                  sizeof(t_real)*NSPEEDS*PADDED(h_params.nx)*PADDED(h_params.ny), h_tmp_cells, &err);
   //checkError(err,"Creating buffer d_tmp_cells");
   d_obstacles = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
                   sizeof(int)*h_params.nx*h_params.ny, h_obstacles, &err);
@@ -151,58 +826,96 @@ int main(int argc, char*argv[])
 // Create program and kernels
 //----------------------------------------------------------------
 
-  kernelsource = getKernelSource("d2q9-bgk.cl");
-  // Create the compute program from the source buffer
-  program = clCreateProgramWithSource(context, 1, (const char **) &kernelsource, NULL, &err);
-  //checkError(err, "Creating program");
+  // Build the compute program from the reduction and the fused steps, with
+  // the separate kernels from the source buffer or, with ghost cells, from
+  // ghost_source, or load it from the cache of binaries
+  kernelsource = NULL;
+  const char* sources[3] = {reduce_source, step_source, NULL};
+  cl_uint n_sources = 2;
+  if (kernels == KERNELS_SEPARATE) {
+#ifdef GHOST_CELLS
+    sources[n_sources++] = ghost_source;
+#else
+    kernelsource = getKernelSource("d2q9-bgk.cl");
+    sources[0] = kernelsource;
+    sources[1] = reduce_source;
+#endif
+  }
+  sprintf(options,"-cl-mad-enable -cl-fast-relaxed-math " PRECISION_OPTIONS GHOST_OPTIONS "%s",
+          sum_double ? " -DSUM_DOUBLE -Dt_sum=double" : " -Dt_sum=float");
+  program = build_program(context, device, n_sources, sources, options, &cached);
   free(kernelsource);
-  // Build the program  
-  err = clBuildProgram(program, 0, NULL,
-    "-cl-mad-enable -cl-single-precision-constant -cl-fast-relaxed-math", NULL, NULL);
-  /*if (err != CL_SUCCESS)
-  {
-      size_t len;
-      char buffer[2048];
-
-      printf("Error: Failed to build program executable!\n%s\n", err_code(err));
-      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-      printf("%s\n", buffer);
-      return EXIT_FAILURE;
-  }*/
   // Create the compute kernel from the program 
   kernel_acc = clCreateKernel(program, "accelerate_flow", &err);
-  kernel_prop = clCreateKernel(program, "propagate", &err);
-  kernel_coll = clCreateKernel(program, "collision", &err);
-  kernel_av = clCreateKernel(program, "av_velocity", &err);
+  kernel_av = clCreateKernel(program, "reduce_av_velocity", &err);
+  kernel_rec = clCreateKernel(program, "record_av_velocity", &err);
+  if (kernels == KERNELS_SEPARATE) {
+    kernel_prop = clCreateKernel(program, "propagate", &err);
+    kernel_coll = clCreateKernel(program, "collision", &err);
+#ifdef GHOST_CELLS
+    kernel_ghost = clCreateKernel(program, "refresh_ghosts", &err);
+#endif
+  }
+  else
+    kernel_step = clCreateKernel(program, kernels == KERNELS_TILED ? "fused_step_tiled"
+                                                                   : "fused_step", &err);
   //checkError(err, "Creating kernel");
 
 //---------------------------------------------------------------
 // Find work group sizes and set up reduction
 //---------------------------------------------------------------
 
-  // Find kernel work-group size
-  err = clGetKernelWorkGroupInfo (kernel_av, device, CL_KERNEL_WORK_GROUP_SIZE,
-          sizeof(size_t), &work_group_size, NULL);
-  //checkError(err, "Getting kernel work group info");
-  // Now that we know the size of the work-groups, we can set the number of
-  // work-groups, the actual number of steps, and the step size
-  while ((size % work_group_size) != 0) work_group_size-- ;
-  work_group_size = fmin(32,work_group_size);
-  n_work_groups = size/work_group_size;
-
-  d_partial_u = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-                sizeof(double)*size, NULL, &err);
+  // Fit the work-groups of propagate and collision to the device
+  if (kernel_step == NULL) {
+    choose_work_group(kernel_prop,device,size,local_prop);
+    choose_work_group(kernel_coll,device,size,local_coll);
+  }
+  // Each work-group of reduce_av_velocity, or of the fused step, sums its
+  // tile of the grid in local memory, and record_av_velocity sums the
+  // tiles in one work-group
+  choose_work_group(kernel_step != NULL ? kernel_step : kernel_av,device,size,local_av);
+  if (clGetDeviceInfo(device,CL_DEVICE_LOCAL_MEM_SIZE,sizeof(local_mem),&local_mem,NULL) != CL_SUCCESS)
+    local_mem = 16384;
+  if (kernels == KERNELS_TILED) {
+    // fused_step_tiled also stages its tile and the ring of cells around
+    // it, so halve the longer side of a chosen work-group until both fit
+    tile_bytes = NSPEEDS*sizeof(t_real)*(local_av[0] + 2)*(local_av[1] + 2);
+    while (getenv("LBM_CL_WORK_GROUP") == NULL &&
+           tile_bytes + 2*sum_size*local_av[0]*local_av[1] > local_mem &&
+           local_av[0]*local_av[1] > 1) {
+      if (local_av[0] >= local_av[1]) local_av[0] /= 2;
+      else local_av[1] /= 2;
+      tile_bytes = NSPEEDS*sizeof(t_real)*(local_av[0] + 2)*(local_av[1] + 2);
+    }
+  }
+  if (tile_bytes + 2*sum_size*local_av[0]*local_av[1] > local_mem) {
+    sprintf(message,"work-groups of %zux%zu need more local memory than %s has, "
+            "so set a smaller LBM_CL_WORK_GROUP",local_av[0],local_av[1],device_name);
+    die(message,__LINE__,__FILE__);
+  }
+  n_groups = (size/local_av[0])*(size/local_av[1]);
+  err = clGetKernelWorkGroupInfo(kernel_rec, device, CL_KERNEL_WORK_GROUP_SIZE,
+          sizeof(size_t), &max_rec, NULL);
+  if (err != CL_SUCCESS || max_rec < 1) max_rec = 1;
+  local_rec = 1;
+  while (2*local_rec <= max_rec && 2*local_rec <= (size_t)n_groups &&
+         2*2*local_rec*sum_size <= local_mem)
+    local_rec *= 2;
+
+  d_partial_u = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                sum_size*n_groups, NULL, &err);
   //checkError(err, "Creating buffer for d_partial_u");
-  d_partial_cells = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-                    sizeof(double)*size, NULL, &err);
+  d_partial_cells = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                    sum_size*n_groups, NULL, &err);
   //checkError(err, "Creating buffer for d_partial_cells");
-
-  h_partial_u = (double*)clEnqueueMapBuffer(commands2, d_partial_u, CL_FALSE,
-    CL_MAP_READ, 0, sizeof(double)*size, 0, NULL, NULL, &err);
-  //checkError(err, "Mapping to h_partial_u");
-  h_partial_cells = (double*)clEnqueueMapBuffer(commands2, d_partial_cells, CL_FALSE,
-    CL_MAP_READ, 0, sizeof(double)*size, 0, NULL, NULL, &err);
-  //checkError(err, "Mapping to h_partial_cells");
+  d_av_vels = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                sum_size*h_params.maxIters, NULL, &err);
+  //checkError(err, "Creating buffer for d_av_vels");
+  h_av_sums = malloc(sum_size*h_params.maxIters);
+  if (h_av_sums == NULL)
+    die("cannot allocate memory for av_vels",__LINE__,__FILE__);
+  PROFILE_END(PH_SETUP, 2.0*NSPEEDS*sizeof(t_real)*PADDED(h_params.nx)*PADDED(h_params.ny)
+                        + sizeof(int)*h_params.nx*h_params.ny);
 
 //---------------------------------------------------------------
 // Set arguments and run kernels
@@ -211,96 +924,222 @@ int main(int argc, char*argv[])
   //set constant arguments
   err = clSetKernelArg(kernel_acc,0,sizeof(t_param),&h_params);
   err = clSetKernelArg(kernel_acc,2,sizeof(cl_mem),&d_obstacles);
-  err = clSetKernelArg(kernel_prop,0,sizeof(t_param),&h_params);
-  err = clSetKernelArg(kernel_coll,0,sizeof(t_param),&h_params);
-  err = clSetKernelArg(kernel_coll,3,sizeof(cl_mem),&d_obstacles);
-  err = clSetKernelArg(kernel_av,0,sizeof(t_param),&h_params);
-  err = clSetKernelArg(kernel_av,2,sizeof(cl_mem),&d_obstacles);
-  //checkError(err,"Setting Constant Kernel Args");
-
-  // Run maxIters times
-  for(int ii = 0; ii < h_params.maxIters; ii++) {
-
-    //set kernel arguments
-    err = clSetKernelArg(kernel_acc,1,sizeof(cl_mem),&d_cells);
+  err = clSetKernelArg(kernel_av,0,sizeof(int),&h_params.nx);
+  err = clSetKernelArg(kernel_av,1,sizeof(int),&h_params.ny);
+  err = clSetKernelArg(kernel_av,3,sizeof(cl_mem),&d_obstacles);
+  err = clSetKernelArg(kernel_acc,1,sizeof(cl_mem),&d_cells);
+  err = clSetKernelArg(kernel_av,2,sizeof(cl_mem),&d_cells);
+  err = clSetKernelArg(kernel_av,4,sum_size*local_av[0]*local_av[1],NULL);
+  err = clSetKernelArg(kernel_av,5,sum_size*local_av[0]*local_av[1],NULL);
+  err = clSetKernelArg(kernel_av,6,sizeof(cl_mem),&d_partial_u);
+  err = clSetKernelArg(kernel_av,7,sizeof(cl_mem),&d_partial_cells);
+  err = clSetKernelArg(kernel_rec,0,sizeof(cl_mem),&d_partial_u);
+  err = clSetKernelArg(kernel_rec,1,sizeof(cl_mem),&d_partial_cells);
+  err = clSetKernelArg(kernel_rec,2,sum_size*local_rec,NULL);
+  err = clSetKernelArg(kernel_rec,3,sum_size*local_rec,NULL);
+  err = clSetKernelArg(kernel_rec,4,sizeof(cl_mem),&d_av_vels);
+  err = clSetKernelArg(kernel_rec,5,sizeof(int),&n_groups);
+  if (kernel_step == NULL) {
+    err = clSetKernelArg(kernel_prop,0,sizeof(t_param),&h_params);
     err = clSetKernelArg(kernel_prop,1,sizeof(cl_mem),&d_cells);
     err = clSetKernelArg(kernel_prop,2,sizeof(cl_mem),&d_tmp_cells);
+    err = clSetKernelArg(kernel_coll,0,sizeof(t_param),&h_params);
     err = clSetKernelArg(kernel_coll,1,sizeof(cl_mem),&d_cells);
     err = clSetKernelArg(kernel_coll,2,sizeof(cl_mem),&d_tmp_cells);
-    err = clSetKernelArg(kernel_av,1,sizeof(cl_mem),&d_cells);
-    err = clSetKernelArg(kernel_av,3,sizeof(double)*size,
-          NULL);
-    err = clSetKernelArg(kernel_av,4,sizeof(double)*size,
-          NULL);
-    err = clSetKernelArg(kernel_av,5,sizeof(cl_mem),&d_partial_u);
-    err = clSetKernelArg(kernel_av,6,sizeof(cl_mem),&d_partial_cells);
-    //checkError(err,"Setting Kernel Args");
+    err = clSetKernelArg(kernel_coll,3,sizeof(cl_mem),&d_obstacles);
+#ifdef GHOST_CELLS
+    err = clSetKernelArg(kernel_ghost,0,sizeof(t_param),&h_params);
+    err = clSetKernelArg(kernel_ghost,1,sizeof(cl_mem),&d_cells);
+#endif
+  }
+  else {
+    err = clSetKernelArg(kernel_step,0,sizeof(int),&h_params.nx);
+    err = clSetKernelArg(kernel_step,1,sizeof(int),&h_params.ny);
+    err = clSetKernelArg(kernel_step,2,sizeof(t_real),&h_params.density);
+    err = clSetKernelArg(kernel_step,3,sizeof(t_real),&h_params.accel);
+    err = clSetKernelArg(kernel_step,4,sizeof(t_real),&h_params.omega);
+    err = clSetKernelArg(kernel_step,8,sizeof(cl_mem),&d_obstacles);
+    err = clSetKernelArg(kernel_step,9,sum_size*local_av[0]*local_av[1],NULL);
+    err = clSetKernelArg(kernel_step,10,sum_size*local_av[0]*local_av[1],NULL);
+    err = clSetKernelArg(kernel_step,11,sizeof(cl_mem),&d_partial_u);
+    err = clSetKernelArg(kernel_step,12,sizeof(cl_mem),&d_partial_cells);
+    if (kernels == KERNELS_TILED)
+      err = clSetKernelArg(kernel_step,13,tile_bytes,NULL);
+  }
+  //checkError(err,"Setting Constant Kernel Args");
 
-    const size_t global[2] = {size, size};
-    size_t local[2] = {work_group_size, work_group_size};
-    //run accelerate_flow
-    err = clEnqueueNDRangeKernel(commands1,kernel_acc,1,NULL,&global[1],NULL,0,
-            NULL,NULL);
+  /*
+  ** The host never waits for a timestep.  Every sync_every steps
+  ** (LBM_CL_SYNC_EVERY, 256 by default), and before a checkpoint or at
+  ** the end, it marks the end of the chunk of steps on the device,
+  ** flushes the queue and starts reading that chunk of av_vels back
+  ** on the second queue once the mark is passed.  It then waits only
+  ** for the chunk before, so the device always has a chunk queued.
+  */
+  chunk = first;
+
+  //the fused step accelerates the flow for the step after it, so the
+  //flow is accelerated on its own only before the first step, unless
+  //a restart's last step already did
+  if (kernel_step != NULL && first < h_params.maxIters && !accelerated) {
+    const size_t rows = size;
+    err = clEnqueueNDRangeKernel(commands1,kernel_acc,1,NULL,&rows,NULL,0,
+            NULL,PROFILE_EVENT(PH_ACCELERATE));
     //checkError(err,"Enqueuing Kernel");
+#ifdef PROFILE
+    profile_event(PH_ACCELERATE,events[PH_ACCELERATE],2.0*6*sizeof(t_real)*h_params.nx);
+#endif
+  }
 
-    /*err = clFinish(commands1);
-    checkError(err, "Waiting for kernel to finish");*/
+  // Run maxIters times
+  for(int ii = first; ii < h_params.maxIters; ii++) {
+    const int checkpoint = checkpoint_every > 0 && (ii + 1) % checkpoint_every == 0;
 
-    //run propagate
-    err = clEnqueueNDRangeKernel(commands1,kernel_prop,2,NULL,global,local,0,
-            NULL,NULL);
-    //checkError(err,"Enqueuing Kernel");
+    const size_t global[2] = {size, size};
+    if (kernel_step != NULL) {
+      //make the whole step from d_cells into d_tmp_cells, accelerating
+      //the flow ready for the next step unless this is the last
+      const int accelerate = ii + 1 < h_params.maxIters;
+      cl_mem swap;
+
+      err = clSetKernelArg(kernel_step,5,sizeof(int),&accelerate);
+      err = clSetKernelArg(kernel_step,6,sizeof(cl_mem),&d_cells);
+      err = clSetKernelArg(kernel_step,7,sizeof(cl_mem),&d_tmp_cells);
+      err = clEnqueueNDRangeKernel(commands1,kernel_step,2,NULL,global,local_av,0,
+              NULL,PROFILE_EVENT(PH_FUSED));
+      //checkError(err,"Enqueuing Kernel");
+#ifdef PROFILE
+      profile_event(PH_FUSED,events[PH_FUSED],
+                    2.0*NSPEEDS*sizeof(t_real)*h_params.nx*h_params.ny
+                    + sizeof(int)*h_params.nx*h_params.ny);
+#endif
+      //the new grid is now the current one
+      swap = d_cells;
+      d_cells = d_tmp_cells;
+      d_tmp_cells = swap;
+    }
+    else {
+      //run accelerate_flow, unless a restart's last step already did
+      if (ii > first || !accelerated) {
+        err = clEnqueueNDRangeKernel(commands1,kernel_acc,1,NULL,&global[1],NULL,0,
+                NULL,PROFILE_EVENT(PH_ACCELERATE));
+        //checkError(err,"Enqueuing Kernel");
+      }
 
-    /*err = clFinish(commands1);
-    checkError(err, "Waiting for kernel to finish");*/
+      /*err = clFinish(commands1);
+      checkError(err, "Waiting for kernel to finish");*/
 
-    //run collision
-    err = clEnqueueNDRangeKernel(commands1,kernel_coll,2,NULL,global,local,0,
-            NULL,NULL);
-    //checkError(err,"Enqueuing Kernel");
+#ifdef GHOST_CELLS
+      //refresh the ghost cells, one work item per ghost row and column
+      const size_t ghosts = PADDED(size);
+      err = clEnqueueNDRangeKernel(commands1,kernel_ghost,1,NULL,&ghosts,NULL,0,
+              NULL,PROFILE_EVENT(PH_REFRESH_GHOSTS));
+      //checkError(err,"Enqueuing Kernel");
+#endif
+
+      //run propagate
+      err = clEnqueueNDRangeKernel(commands1,kernel_prop,2,NULL,global,local_prop,0,
+              NULL,PROFILE_EVENT(PH_PROPAGATE));
+      //checkError(err,"Enqueuing Kernel");
+
+      /*err = clFinish(commands1);
+      checkError(err, "Waiting for kernel to finish");*/
+
+      //run collision
+      err = clEnqueueNDRangeKernel(commands1,kernel_coll,2,NULL,global,local_coll,0,
+              NULL,PROFILE_EVENT(PH_COLLISION));
+      //checkError(err,"Enqueuing Kernel");
+
+      /*err = clFinish(commands1);
+      checkError(err, "Waiting for kernel to finish");*/
+
+      //sum the speeds of each tile of the grid
+      err = clEnqueueNDRangeKernel(commands1,kernel_av,2,NULL,global,local_av,
+              0,NULL,PROFILE_EVENT(PH_REDUCTION));
+      //checkError(err,"Enqueueing av_vels Kernel");
+#ifdef PROFILE
+      if (ii > first || !accelerated)
+        profile_event(PH_ACCELERATE,events[PH_ACCELERATE],2.0*6*sizeof(t_real)*h_params.nx);
+#ifdef GHOST_CELLS
+      profile_event(PH_REFRESH_GHOSTS,events[PH_REFRESH_GHOSTS],
+                    4.0*NSPEEDS*sizeof(t_real)*(h_params.nx + h_params.ny));
+#endif
+      profile_event(PH_PROPAGATE,events[PH_PROPAGATE],
+                    2.0*NSPEEDS*sizeof(t_real)*h_params.nx*h_params.ny);
+      profile_event(PH_COLLISION,events[PH_COLLISION],
+                    2.0*NSPEEDS*sizeof(t_real)*h_params.nx*h_params.ny
+                    + sizeof(int)*h_params.nx*h_params.ny);
+      profile_event(PH_REDUCTION,events[PH_REDUCTION],
+                    (double)NSPEEDS*sizeof(t_real)*h_params.nx*h_params.ny
+                    + sizeof(int)*h_params.nx*h_params.ny);
+#endif
+    }
+
+    //sum the tiles and record the step's average velocity on the device
+    err = clSetKernelArg(kernel_rec,6,sizeof(int),&ii);
+    err = clEnqueueNDRangeKernel(commands1,kernel_rec,1,NULL,&local_rec,&local_rec,0,
+            NULL,PROFILE_EVENT(PH_REDUCTION));
+    //checkError(err,"Enqueueing record_av_velocity Kernel");
+#ifdef PROFILE
+    profile_event(PH_REDUCTION,events[PH_REDUCTION],(2.0*n_groups + 1)*sum_size);
+#endif
 
-    /*err = clFinish(commands1);
-    checkError(err, "Waiting for kernel to finish");*/
-
-    //run av_vels
-    local[0] = size;
-    local[1] = 1;
-    /*const size_t local[2] = {size, 1};*/
-    err = clEnqueueNDRangeKernel(commands1,kernel_av,2,NULL,global,local,
-            0,NULL,NULL);
-    //checkError(err,"Enqueueing av_vels Kernel");
-
-    err = clFinish(commands1);
-    //checkError(err, "Waiting for kernel to finish");
-
-    //retrieve h_partial_u
-    err = clEnqueueReadBuffer(commands2, d_partial_u, CL_FALSE, 0,
-            sizeof(double)*size, h_partial_u, 0, NULL, NULL);
-    //checkError(err, "Reading back d_partial_u");
-
-    //retrieve h_partial_cells
-    err = clEnqueueReadBuffer(commands2, d_partial_cells, CL_FALSE, 0,
-            sizeof(double)*size, h_partial_cells, 0, NULL, NULL);
-    //checkError(err, "Reading back d_partial_cells");
-
-    err = clFinish(commands2);
-    //checkError(err, "Waiting for asynchronous reads to finish");
-
-    tmp = 0.0;
-    h_av_vels[ii] = 0.0;
-    for (int jj = 0; jj<(size); jj++) {
-      h_av_vels[ii] += h_partial_u[jj];
-      tmp += h_partial_cells[jj];
+    //start reading back a finished chunk of av_vels
+    if (ii + 1 == h_params.maxIters || ii + 1 - chunk == sync_every || checkpoint) {
+      if (previous != NULL) clReleaseEvent(previous);
+      previous = recorded;
+      err = clEnqueueMarker(commands1,&recorded);
+      if (err == CL_SUCCESS) err = clFlush(commands1);
+      if (err == CL_SUCCESS)
+        err = clEnqueueReadBuffer(commands2, d_av_vels, CL_FALSE, sum_size*chunk,
+                sum_size*(ii + 1 - chunk), &h_av_sums[sum_size*chunk], 1, &recorded, NULL);
+      if (err == CL_SUCCESS) err = clFlush(commands2);
+      //the steps of the chunk before, and their reading back, have now run
+      if (err == CL_SUCCESS && previous != NULL) err = clWaitForEvents(1,&previous);
+      if (err != CL_SUCCESS) {
+        sprintf(message,"could not read back av_vels of timesteps %d to %d: %d", chunk, ii, err);
+        die(message,__LINE__,__FILE__);
+      }
+      chunk = ii + 1;
+      PROFILE_COLLECT(FALSE);
+    }
+
+    //retrieve h_cells for a checkpoint
+    if (checkpoint) {
+      PROFILE_BEGIN(PH_IO);
+      err = clEnqueueReadBuffer(commands2, d_cells, CL_TRUE, 0,
+              sizeof(t_real)*NSPEEDS*PADDED(h_params.nx)*PADDED(h_params.ny), h_cells,
+              1, &recorded, NULL);
+      if (err != CL_SUCCESS) {
+        sprintf(message,"could not read back the grid after timestep %d: %d", ii + 1, err);
+        die(message,__LINE__,__FILE__);
+      }
+      for (int jj = first; jj < chunk; jj++)
+        h_av_vels[jj] = sum_double ? ((double*)h_av_sums)[jj] : ((float*)h_av_sums)[jj];
+      checkpoint_write(checkpointfile,h_params,h_cells,h_av_vels,ii + 1,
+                       kernel_step != NULL && ii + 1 < h_params.maxIters);
+      PROFILE_END(PH_IO, (double)NSPEEDS*sizeof(t_real)*PADDED(h_params.nx)*PADDED(h_params.ny)
+                         + profile_file_bytes(checkpointfile));
     }
-    h_av_vels[ii] = h_av_vels[ii]/(double)tmp;
   }
 
-  //retrieve h_cells
+  //retrieve h_cells, after the last chunk of av_vels
+  PROFILE_BEGIN(PH_IO);
   err = clEnqueueReadBuffer(commands2, d_cells, CL_TRUE, 0,
-            sizeof(float)*NSPEEDS*h_params.nx*h_params.ny, h_cells, 0, NULL, NULL);
-  //checkError(err, "Reading back d_cells");
+            sizeof(t_real)*NSPEEDS*PADDED(h_params.nx)*PADDED(h_params.ny), h_cells,
+            recorded != NULL, recorded != NULL ? &recorded : NULL, NULL);
+  if (err != CL_SUCCESS) {
+    sprintf(message,"could not read back the final grid: %d", err);
+    die(message,__LINE__,__FILE__);
+  }
+  for (int jj = first; jj < h_params.maxIters; jj++)
+    h_av_vels[jj] = sum_double ? ((double*)h_av_sums)[jj] : ((float*)h_av_sums)[jj];
+  PROFILE_COLLECT(TRUE);
 
-  write_values(h_params,h_cells,h_obstacles,h_av_vels);
+  write_values(h_params,h_cells,h_obstacles,h_av_vels,binary);
+  PROFILE_END(PH_IO, (double)NSPEEDS*sizeof(t_real)*PADDED(h_params.nx)*PADDED(h_params.ny)
+                     + profile_file_bytes(binary ? FINALSTATEBIN : FINALSTATEFILE)
+                     + profile_file_bytes(AVVELSFILE));
 
 //---------------------------------------------------------------
 // End Timers
@@ -316,23 +1155,43 @@ int main(int argc, char*argv[])
 
   /* write final values and free memory */
   printf("==done==\n");
+  printf("Device:\t\t\t\t%s\n", device_name);
+  printf("Kernels:\t\t\t%s\n", kernels_name);
+  printf("Program:\t\t\t%s\n", cached ? "loaded from cache" : "built from source");
+  if (kernel_step != NULL)
+    printf("Work-groups:\t\t\t%zux%zu (%s step)\n",local_av[0],local_av[1],kernels_name);
+  else
+    printf("Work-groups:\t\t\t%zux%zu (propagate), %zux%zu (collision), %zux%zu (reduction)\n",
+           local_prop[0],local_prop[1],local_coll[0],local_coll[1],local_av[0],local_av[1]);
   printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
   printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
   printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+  PROFILE_WRITE(h_params,h_params.maxIters - first,toc-tic);
 
 //----------------------------------------------------------------
 // Clean up
 //----------------------------------------------------------------
 
   finalise(&h_params, &h_cells, &h_tmp_cells, &h_obstacles, &h_av_vels);
+  free(h_av_sums);
+  if (previous != NULL) clReleaseEvent(previous);
+  if (recorded != NULL) clReleaseEvent(recorded);
+  clReleaseMemObject(d_partial_u);
+  clReleaseMemObject(d_partial_cells);
+  clReleaseMemObject(d_av_vels);
   clReleaseMemObject(d_cells);
   clReleaseMemObject(d_tmp_cells);
   clReleaseMemObject(d_obstacles);  
   clReleaseProgram(program);
   clReleaseKernel(kernel_acc);
-  clReleaseKernel(kernel_prop);
-  clReleaseKernel(kernel_coll);
   clReleaseKernel(kernel_av);
+  clReleaseKernel(kernel_rec);
+  if (kernel_prop != NULL) clReleaseKernel(kernel_prop);
+  if (kernel_coll != NULL) clReleaseKernel(kernel_coll);
+  if (kernel_step != NULL) clReleaseKernel(kernel_step);
+#ifdef GHOST_CELLS
+  if (kernel_ghost != NULL) clReleaseKernel(kernel_ghost);
+#endif
   clReleaseCommandQueue(commands1);
   clReleaseCommandQueue(commands2);
   clReleaseContext(context);
@@ -342,7 +1201,7 @@ int main(int argc, char*argv[])
 
 
 int initialise(const char* paramfile, const char* obstaclefile,
-         t_param* params, float** cells_ptr, float** tmp_cells_ptr, 
+         t_param* params, t_real** cells_ptr, t_real** tmp_cells_ptr, 
          int** obstacles_ptr, double** av_vels_ptr)
 {
   char   message[1024];  /* message buffer */
@@ -370,11 +1229,11 @@ int initialise(const char* paramfile, const char* obstaclefile,
   if(retval != 1) die ("could not read param file: maxIters",__LINE__,__FILE__);
   retval = fscanf(fp,"%d\n",&(params->reynolds_dim));
   if(retval != 1) die ("could not read param file: reynolds_dim",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->density));
+  retval = fscanf(fp,SCAN_REAL "\n",&(params->density));
   if(retval != 1) die ("could not read param file: density",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->accel));
+  retval = fscanf(fp,SCAN_REAL "\n",&(params->accel));
   if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->omega));
+  retval = fscanf(fp,SCAN_REAL "\n",&(params->omega));
   if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
 
   /* and close up the file */
@@ -400,12 +1259,12 @@ int initialise(const char* paramfile, const char* obstaclefile,
   */
 
   /* main grid */
-  *cells_ptr = (float*)malloc(sizeof(float)*(params->ny*params->nx)*NSPEEDS);
+  *cells_ptr = (t_real*)malloc(sizeof(t_real)*(PADDED(params->ny)*PADDED(params->nx))*NSPEEDS);
   if (*cells_ptr == NULL) 
     die("cannot allocate memory for cells",__LINE__,__FILE__);
 
   /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (float*)malloc(sizeof(float)*(params->ny*params->nx)*NSPEEDS);
+  *tmp_cells_ptr = (t_real*)malloc(sizeof(t_real)*(PADDED(params->ny)*PADDED(params->nx))*NSPEEDS);
   if (*tmp_cells_ptr == NULL) 
     die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
   
@@ -421,8 +1280,8 @@ int initialise(const char* paramfile, const char* obstaclefile,
 
   for(ii=0;ii<params->ny;ii++) {
     for(jj=0;jj<params->nx;jj++) {
-      pos = ii*params->nx + jj;
-      stride = params->nx * params->ny;
+      pos = (ii + GHOST)*PADDED(params->nx) + jj + GHOST;
+      stride = PADDED(params->nx) * PADDED(params->ny);
       /* centre */
       (*cells_ptr)[pos] = w0;
       /* axis directions */
@@ -481,7 +1340,8 @@ int initialise(const char* paramfile, const char* obstaclefile,
 
 
 
-int write_values(const t_param params, float* cells, int* obstacles, double* av_vels)
+int write_values(const t_param params, t_real* cells, int* obstacles, double* av_vels,
+        const int binary)
 {
   FILE* fp;                     /* file pointer */
   int ii,jj,kk, pos, stride;    /* generic counters */
@@ -491,17 +1351,25 @@ int write_values(const t_param params, float* cells, int* obstacles, double* av_
   double u_x;                   /* x-component of velocity in grid cell */
   double u_y;                   /* y-component of velocity in grid cell */
   double u;                     /* norm--root of summed squares--of u_x and u_y */
+  size_t plane = (size_t)params.nx*params.ny;  /* values per field */
+  double* fields = NULL;        /* the planes of a binary file */
+  t_fields head;                /* and its header */
 
-  fp = fopen(FINALSTATEFILE,"w");
+  fp = binary ? fopen(FINALSTATEBIN,"wb") : fopen(FINALSTATEFILE,"w");
   if (fp == NULL) {
     die("could not open file output file",__LINE__,__FILE__);
   }
+  if (binary) {
+    fields = malloc(4*plane*sizeof(double));
+    if (fields == NULL)
+      die("cannot allocate memory for the output fields",__LINE__,__FILE__);
+  }
 
-  stride = params.nx * params.ny;
+  stride = PADDED(params.nx) * PADDED(params.ny);
 
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
-      pos = (ii*params.nx + jj);
+      pos = (ii + GHOST)*PADDED(params.nx) + jj + GHOST;
       /* an occupied cell */
       if(obstacles[ii*params.nx + jj]) {
         u_x = u_y = u = 0.0;
@@ -526,11 +1394,33 @@ int write_values(const t_param params, float* cells, int* obstacles, double* av_
         /* compute pressure */
         pressure = local_density * c_sq;
       }
-      /* write to file */
-      fprintf(fp,"%d %d %.12E %.12E %.12E %.12E %d\n",jj,ii,u_x,u_y,u,pressure,obstacles[ii*params.nx + jj]);
+      if (binary) {
+        fields[ii*params.nx + jj]           = u_x;
+        fields[plane + ii*params.nx + jj]   = u_y;
+        fields[2*plane + ii*params.nx + jj] = u;
+        fields[3*plane + ii*params.nx + jj] = pressure;
+      }
+      else {
+        /* write to file */
+        fprintf(fp,"%d %d %.12E %.12E %.12E %.12E %d\n",jj,ii,u_x,u_y,u,pressure,obstacles[ii*params.nx + jj]);
+      }
     }
   }
 
+  /* each field in one go, rather than formatting each value */
+  if (binary) {
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, FIELDS_MAGIC, sizeof(head.magic));
+    head.nx    = params.nx;
+    head.ny    = params.ny;
+    head.iters = params.maxIters;
+    if (fwrite(&head, sizeof(head), 1, fp) != 1 ||
+        fwrite(fields, sizeof(double), 4*plane, fp) != 4*plane ||
+        fwrite(obstacles, sizeof(int), plane, fp) != plane)
+      die("could not write output fields",__LINE__,__FILE__);
+    free(fields);
+  }
+
   fclose(fp);
 
   fp = fopen(AVVELSFILE,"w");
@@ -546,75 +1436,397 @@ int write_values(const t_param params, float* cells, int* obstacles, double* av_
   return EXIT_SUCCESS;
 }
 
+int checkpoint_write(const char* name, const t_param params, t_real* cells,
+        double* av_vels, const int iters, const int accelerated)
+{
+  char   message[1024];      /* message buffer */
+  char   tmpname[1024];      /* the new checkpoint, until it is complete */
+  FILE*  fp;                 /* file pointer */
+  t_checkpoint head;         /* the header of the file */
+  int    ii,kk;              /* generic counters */
+  int    stride = PADDED(params.nx) * PADDED(params.ny);
+
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, CHECKPOINT_MAGIC, sizeof(head.magic));
+  head.real_size    = sizeof(t_real);
+  head.nx           = params.nx;
+  head.ny           = params.ny;
+  head.reynolds_dim = params.reynolds_dim;
+  head.density      = params.density;
+  head.accel        = params.accel;
+  head.omega        = params.omega;
+  head.iters        = iters;
+  head.accelerated  = accelerated;
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  fp = fopen(tmpname,"wb");
+  if (fp == NULL) {
+    sprintf(message,"could not open checkpoint file: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
 
+  if (fwrite(&head, sizeof(head), 1, fp) != 1)
+    die("could not write checkpoint header",__LINE__,__FILE__);
+  /* a row at a time, leaving out the ghost cells */
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(ii=0;ii<params.ny;ii++) {
+      if (fwrite(&cells[kk*stride + (ii + GHOST)*PADDED(params.nx) + GHOST], sizeof(t_real),
+                 params.nx, fp) != (size_t)params.nx)
+        die("could not write checkpoint grid",__LINE__,__FILE__);
+    }
+  }
+  if (fwrite(av_vels, sizeof(double), iters, fp) != (size_t)iters)
+    die("could not write checkpoint av velocities",__LINE__,__FILE__);
 
-//Find and use device assigned by BCP3 queue
-void init_context_bcp3(cl_context* context, cl_device_id* device)
+  /* make sure it is on disk before it replaces the last one, so
+  ** a run stopped at any point leaves a complete checkpoint */
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    die("could not flush checkpoint file",__LINE__,__FILE__);
+  fclose(fp);
+  if (rename(tmpname, name) != 0) {
+    sprintf(message,"could not rename checkpoint file to: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int checkpoint_read(const char* name, const t_param params, t_real* cells,
+        double* av_vels, int* accelerated)
 {
-    //
-    // Get the index into the device array allocated by the queue on BCP3
-    //
-    char* path = getenv("PBS_GPUFILE");
-    if (path == NULL)
-    {
-        fprintf(stderr, "Error: PBS_GPUFILE environment variable not set by queue\n");
-        exit(-1);
-    }
-    FILE* gpufile = fopen(path, "r");
-    if (gpufile == NULL)
-    {
-        fprintf(stderr, "Error: PBS_GPUFILE not found\n");
-        exit(-1);
+  char   message[1024];      /* message buffer */
+  int    fd;                 /* file descriptor */
+  struct stat st;            /* to find the size of the file */
+  const char* map;           /* the mapped file */
+  t_checkpoint head;         /* the header of the file */
+  size_t plane;              /* bytes per speed in the file */
+  const char* row;           /* a row of the file */
+  t_real* dst;               /* the same row of the grid */
+  int    ii,jj,kk;           /* generic counters */
+  int    stride = PADDED(params.nx) * PADDED(params.ny);
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    sprintf(message,"could not open checkpoint file: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
+  if ((size_t)st.st_size < sizeof(head))
+    die("checkpoint file is too short",__LINE__,__FILE__);
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    die("could not map checkpoint file",__LINE__,__FILE__);
+  close(fd);
+
+  /* the header, and the sizes it gives, must match this run.  The
+  ** densities may be of either precision */
+  memcpy(&head, map, sizeof(head));
+  if (memcmp(head.magic, CHECKPOINT_MAGIC, sizeof(head.magic)) != 0)
+    die("not a checkpoint file",__LINE__,__FILE__);
+  if (head.real_size != sizeof(float) && head.real_size != sizeof(double))
+    die("checkpoint densities are of unknown precision",__LINE__,__FILE__);
+  if (head.nx != params.nx || head.ny != params.ny ||
+      head.reynolds_dim != params.reynolds_dim || (t_real)head.density != params.density ||
+      (t_real)head.accel != params.accel || (t_real)head.omega != params.omega)
+    die("checkpoint parameters do not match the parameter file",__LINE__,__FILE__);
+  if (head.iters < 0 || head.iters > params.maxIters)
+    die("checkpoint has more timesteps than maxIters",__LINE__,__FILE__);
+  plane = (size_t)params.nx*params.ny*head.real_size;
+  if ((size_t)st.st_size != sizeof(head) + NSPEEDS*plane + head.iters*sizeof(double))
+    die("checkpoint file is the wrong size",__LINE__,__FILE__);
+
+  /* a row at a time, inside the ghost cells */
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(ii=0;ii<params.ny;ii++) {
+      row = map + sizeof(head) + kk*plane + (size_t)ii*params.nx*head.real_size;
+      dst = &cells[kk*stride + (ii + GHOST)*PADDED(params.nx) + GHOST];
+      if (head.real_size == sizeof(t_real))
+        memcpy(dst, row, params.nx*sizeof(t_real));
+      else if (head.real_size == sizeof(float))
+        for(jj=0;jj<params.nx;jj++) dst[jj] = ((const float*)row)[jj];
+      else
+        for(jj=0;jj<params.nx;jj++) dst[jj] = ((const double*)row)[jj];
     }
+  }
+  /* which need not be aligned */
+  memcpy(av_vels, map + sizeof(head) + NSPEEDS*plane, head.iters*sizeof(double));
 
-    size_t max_length = 100;
-    char* line = (char *)malloc(sizeof(char)*max_length);
+  munmap((void*)map, st.st_size);
 
-    size_t len = getline(&line, &max_length, gpufile);
+  *accelerated = head.accelerated;
 
-    int device_index = (int) strtol(&line[len-2], NULL, 10);
+  return head.iters;
+}
+
+void init_context(cl_context* context, cl_device_id* device)
+{
+  char   message[1024];                   /* message buffer */
+  const char* type_name = getenv("LBM_CL_DEVICE_TYPE");  /* the kind of device asked for */
+  const char* index_name = getenv("LBM_CL_DEVICE");      /* and which of them */
+  const char* path = getenv("PBS_GPUFILE");              /* the GPU the queue gave the job */
+  cl_device_type type = CL_DEVICE_TYPE_GPU;
+  cl_uint num_platforms;
+  cl_platform_id* platforms;
+  cl_device_id devices[MAX_DEVICES];      /* the devices of that kind, on every platform */
+  cl_platform_id owner[MAX_DEVICES];      /* and the platform of each */
+  cl_uint num_devices = 0,found;
+  int    device_index = 0;
+  cl_uint ii,jj;                          /* generic counters */
+  cl_int err;
+
+  if (type_name != NULL) {
+    if (strcmp(type_name,"gpu") == 0) type = CL_DEVICE_TYPE_GPU;
+    else if (strcmp(type_name,"cpu") == 0) type = CL_DEVICE_TYPE_CPU;
+    else if (strcmp(type_name,"accelerator") == 0) type = CL_DEVICE_TYPE_ACCELERATOR;
+    else if (strcmp(type_name,"all") == 0) type = CL_DEVICE_TYPE_ALL;
+    else die("LBM_CL_DEVICE_TYPE must be gpu, cpu, accelerator or all",__LINE__,__FILE__);
+  }
+
+  if (index_name != NULL) {
+    device_index = atoi(index_name);
+    if (device_index < 0)
+      die("LBM_CL_DEVICE must not be negative",__LINE__,__FILE__);
+  }
+  else if (path != NULL) {
+    // the index into the devices, allocated by the queue on BCP3, ends the first line
+    FILE* gpufile = fopen(path, "r");
+    size_t max_length = 100;
+    char* line = NULL;
+    ssize_t len;
 
+    if (gpufile == NULL) {
+      sprintf(message,"could not open PBS_GPUFILE: %s", path);
+      die(message,__LINE__,__FILE__);
+    }
+    len = getline(&line, &max_length, gpufile);
+    if (len < 2)
+      die("PBS_GPUFILE does not name a device",__LINE__,__FILE__);
+    device_index = (int) strtol(&line[len-2], NULL, 10);
     free(line);
     fclose(gpufile);
+  }
 
-    cl_int err;
+  // Query platforms
+  err = clGetPlatformIDs(0, NULL, &num_platforms);
+  if (err != CL_SUCCESS || num_platforms == 0)
+    die("no OpenCL platforms found",__LINE__,__FILE__);
+  platforms = (cl_platform_id*)malloc(sizeof(cl_platform_id)*num_platforms);
+  if (platforms == NULL)
+    die("cannot allocate memory for the platforms",__LINE__,__FILE__);
+  err = clGetPlatformIDs(num_platforms, platforms, NULL);
+  if (err != CL_SUCCESS)
+    die("could not get the OpenCL platforms",__LINE__,__FILE__);
+
+  // Gather the devices of the kind asked for from every platform; with
+  // no kind asked for, and no GPU, take any device there is
+  for (;;) {
+    for (ii = 0; ii < num_platforms && num_devices < MAX_DEVICES; ii++) {
+      err = clGetDeviceIDs(platforms[ii], type, MAX_DEVICES - num_devices,
+                           &devices[num_devices], &found);
+      if (err != CL_SUCCESS) continue;
+      if (found > MAX_DEVICES - num_devices) found = MAX_DEVICES - num_devices;
+      for (jj = 0; jj < found; jj++) owner[num_devices + jj] = platforms[ii];
+      num_devices += found;
+    }
+    if (num_devices > 0 || type_name != NULL || type == CL_DEVICE_TYPE_ALL) break;
+    type = CL_DEVICE_TYPE_ALL;
+  }
+  free(platforms);
+  if (num_devices == 0)
+    die("no OpenCL devices of the type asked for were found",__LINE__,__FILE__);
+  if ((cl_uint)device_index >= num_devices) {
+    sprintf(message,"device %d asked for, but only %u found", device_index, num_devices);
+    die(message,__LINE__,__FILE__);
+  }
 
-    // Query platforms
-    cl_uint num_platforms;
-    err = clGetPlatformIDs(0, NULL, &num_platforms);
-    if (err != CL_SUCCESS) {fprintf(stderr, "Error counting platforms: %d\n", err); exit(-1);}
+  // Assign the device id
+  *device = devices[device_index];
 
-    cl_platform_id platforms[num_platforms];
-    err = clGetPlatformIDs(num_platforms, platforms, NULL);
-    if (err != CL_SUCCESS) {fprintf(stderr, "Error getting platforms: %d\n", err); exit(-1);}
+  // Create the context
+  const cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)owner[device_index], 0};
+  *context = clCreateContext(properties, 1, device, NULL, NULL, &err);
+  if (err != CL_SUCCESS) {
+    sprintf(message,"could not create a context: %d", err);
+    die(message,__LINE__,__FILE__);
+  }
+}
 
-    // Get devices for each platform - stop when found a GPU
-    cl_uint max_devices = 8;
-    cl_device_id devices[max_devices];
-    cl_uint num_devices;
+void choose_work_group(cl_kernel kernel, cl_device_id device, const size_t size,
+        size_t local[2])
+{
+  const char* shape = getenv("LBM_CL_WORK_GROUP");  /* XxY, if set */
+  size_t kernel_max,device_max;   /* the most work-items in a group */
+  size_t item_max[3];             /* and along each dimension */
+  size_t multiple;                /* the group size the kernel runs best with a multiple of */
+  size_t limit;
+  int    grown;                   /* whether the group grew on the last pass */
+
+  if (shape != NULL) {
+    if (sscanf(shape, "%zux%zu", &local[0], &local[1]) != 2 ||
+        local[0] < 1 || local[1] < 1 || size % local[0] != 0 || size % local[1] != 0)
+      die("LBM_CL_WORK_GROUP must be XxY, each dividing the grid size",__LINE__,__FILE__);
+    return;
+  }
 
-    int i;
-    for (i = 0; i < num_platforms; i++)
-    {
-        err = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, max_devices, devices, &num_devices);
-        if (err == CL_SUCCESS && num_devices > 0)
-            break;
+  if (clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+        sizeof(kernel_max), &kernel_max, NULL) != CL_SUCCESS)
+    kernel_max = 1;
+  if (clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+        sizeof(multiple), &multiple, NULL) != CL_SUCCESS)
+    multiple = 1;
+  if (clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+        sizeof(device_max), &device_max, NULL) != CL_SUCCESS)
+    device_max = kernel_max;
+  if (clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+        sizeof(item_max), item_max, NULL) != CL_SUCCESS)
+    item_max[0] = item_max[1] = device_max;
+  limit = (kernel_max < device_max) ? kernel_max : device_max;
+
+  /*
+  ** Rows first, as far as the multiple the kernel prefers, the width of
+  ** a warp or of the vector unit, then doubling the shorter side while
+  ** it still divides the grid, up to the largest group allowed.  Sides
+  ** of powers of two divide size, which is a multiple of 32, up to 32.
+  */
+  local[0] = local[1] = 1;
+  while (2*local[0] <= multiple && 2*local[0] <= item_max[0] &&
+         2*local[0] <= limit && size % (2*local[0]) == 0)
+    local[0] *= 2;
+  do {
+    grown = FALSE;
+    if (local[1] < local[0] && 2*local[1] <= item_max[1] &&
+        2*local[0]*local[1] <= limit && size % (2*local[1]) == 0) {
+      local[1] *= 2;
+      grown = TRUE;
     }
-    if (num_devices == 0)
-    {
-        fprintf(stderr, "Error: no GPUs found");
-        exit(-1);
+    else if (2*local[0] <= item_max[0] &&
+        2*local[0]*local[1] <= limit && size % (2*local[0]) == 0) {
+      local[0] *= 2;
+      grown = TRUE;
+    }
+    else if (2*local[1] <= item_max[1] &&
+        2*local[0]*local[1] <= limit && size % (2*local[1]) == 0) {
+      local[1] *= 2;
+      grown = TRUE;
     }
+  } while (grown);
+}
 
-    // Assign the device id
-    *device = devices[device_index];
+/* fold len bytes into a 64 bit FNV-1a hash */
+static cl_ulong hash_bytes(cl_ulong hash, const void* bytes, const size_t len)
+{
+  const unsigned char* b = bytes;
+  size_t ii;
 
-    // Create the context
-    const cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platforms[i], 0};
-    *context = clCreateContext(properties, 1, device, NULL, NULL, &err);
-    if (err != CL_SUCCESS) {fprintf(stderr, "Error creating context: %d\n", err); exit(-1);}
+  for (ii = 0; ii < len; ii++) {
+    hash ^= b[ii];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
 }
 
+cl_program build_program(cl_context context, cl_device_id device, const cl_uint count,
+        const char** sources, const char* options, int* cached)
+{
+  const char* dir = getenv("LBM_CL_CACHE") ? getenv("LBM_CL_CACHE") : PROGRAM_CACHE;
+  char   message[1024];      /* message buffer */
+  char   info[4][256] = {"", "", "", ""};  /* what identifies the device and driver */
+  char   key[2048];          /* all that the binary depends on */
+  char   name[1024];         /* the file of the binary in the cache */
+  char   tmpname[1100];      /* the same, until it is complete */
+  cl_ulong hash = 0xcbf29ce484222325ULL;  /* hash of the sources, then of the key */
+  cl_program program = NULL;
+  cl_int err;
+  FILE*  fp;
+  size_t len;                /* bytes of the binary */
+  unsigned char* binary = NULL;
+  cl_uint ii;
+
+  *cached = FALSE;
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info[0]), info[0], NULL);
+  clGetDeviceInfo(device, CL_DEVICE_VENDOR, sizeof(info[1]), info[1], NULL);
+  clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(info[2]), info[2], NULL);
+  clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(info[3]), info[3], NULL);
+  for (ii = 0; ii < count; ii++)
+    hash = hash_bytes(hash, sources[ii], strlen(sources[ii]) + 1);
+  snprintf(key, sizeof(key), "%s\n%s\n%s\n%s\n%s\n%016llx\n", info[0], info[1], info[2],
+           info[3], options, (unsigned long long)hash);
+  hash = hash_bytes(0xcbf29ce484222325ULL, key, strlen(key));
+  snprintf(name, sizeof(name), "%s/d2q9-bgk-%016llx.bin", dir, (unsigned long long)hash);
+
+  /* try the cache: the magic, the key in full, then the binary */
+  if (strcmp(dir, "off") != 0 && (fp = fopen(name, "rb")) != NULL) {
+    char   magic[8];
+    char   stored[sizeof(key)] = "";
+    size_t key_len;
+
+    if (fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, PROGRAM_MAGIC, 8) == 0 &&
+        fread(&key_len, sizeof(key_len), 1, fp) == 1 && key_len == strlen(key) &&
+        fread(stored, 1, key_len, fp) == key_len && memcmp(stored, key, key_len) == 0 &&
+        fread(&len, sizeof(len), 1, fp) == 1 && len > 0 &&
+        (binary = malloc(len)) != NULL && fread(binary, 1, len, fp) == len) {
+      const unsigned char* binaries[1] = {binary};
+      cl_int status;
+
+      program = clCreateProgramWithBinary(context, 1, &device, &len, binaries, &status, &err);
+      if (program != NULL && err == CL_SUCCESS && status == CL_SUCCESS &&
+          clBuildProgram(program, 1, &device, options, NULL, NULL) == CL_SUCCESS)
+        *cached = TRUE;
+      else if (program != NULL) {
+        clReleaseProgram(program);
+        program = NULL;
+      }
+    }
+    free(binary);
+    binary = NULL;
+    fclose(fp);
+  }
+  if (program != NULL) return program;
+
+  /* build from source */
+  program = clCreateProgramWithSource(context, count, sources, NULL, &err);
+  if (err != CL_SUCCESS) {
+    sprintf(message,"could not create the program: %d", err);
+    die(message,__LINE__,__FILE__);
+  }
+  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    char log[16384] = "";   /* what the compiler had to say */
+
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+    fprintf(stderr, "%s\n", log);
+    sprintf(message,"could not build the program: %d", err);
+    die(message,__LINE__,__FILE__);
+  }
+
+  /* and keep its binary for next time, if the cache can be written:
+  ** it is only a cache, so failing to fill it is not an error */
+  if (strcmp(dir, "off") == 0 ||
+      (mkdir(dir, 0777) != 0 && errno != EEXIST) ||
+      clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(len), &len, NULL) != CL_SUCCESS ||
+      len == 0 || (binary = malloc(len)) == NULL)
+    return program;
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS) {
+    const size_t key_len = strlen(key);
+
+    /* written under a name of its own, so that jobs sharing the
+    ** cache never see each other's partly written binaries */
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", name, (int)getpid());
+    fp = fopen(tmpname, "wb");
+    if (fp != NULL) {
+      const int written = fwrite(PROGRAM_MAGIC, 8, 1, fp) == 1 &&
+                          fwrite(&key_len, sizeof(key_len), 1, fp) == 1 &&
+                          fwrite(key, 1, key_len, fp) == key_len &&
+                          fwrite(&len, sizeof(len), 1, fp) == 1 &&
+                          fwrite(binary, 1, len, fp) == len;
+
+      if (fclose(fp) != 0 || !written || rename(tmpname, name) != 0)
+        remove(tmpname);
+    }
+  }
+  free(binary);
+
+  return program;
+}
 
 
 char * getKernelSource(char *filename)
@@ -642,7 +1854,7 @@ char * getKernelSource(char *filename)
 
 
 
-int finalise(const t_param* params, float** h_cells_ptr, float** h_tmp_cells_ptr,
+int finalise(const t_param* params, t_real** h_cells_ptr, t_real** h_tmp_cells_ptr,
        int** obstacles_ptr, double** av_vels_ptr)
 {
   /* 
@@ -664,6 +1876,188 @@ int finalise(const t_param* params, float** h_cells_ptr, float** h_tmp_cells_ptr
 }
 
 
+#ifdef PROFILE
+/*
+** Instrumentation.  Each phase on the host is timed with
+** PROFILE_BEGIN() and PROFILE_END(), which also take the host's
+** hardware counts, if perf_event_open() is allowed, and the bytes
+** the phase is expected to move.  The kernels are timed by the
+** device, from the events of their commands: profile_event() holds
+** each event until profile_collect() finds its command has run, so
+** that the host need not wait for the device to time it.
+** profile_write() reports it all as JSON.
+*/
+#define NCOUNTERS       2       /* cycles and last level cache misses */
+
+static const char* counter_name[NCOUNTERS] = { "cycles", "llc_misses" };
+
+/* what has been measured of each phase */
+static struct {
+  double    seconds[NPHASES];            /* wallclock time in the phase */
+  double    bytes[NPHASES];              /* traffic of the phase */
+  long      calls[NPHASES];              /* no. of times it ran */
+  long long counts[NPHASES][NCOUNTERS];  /* hardware counts in the phase */
+  double    tic[NPHASES];                /* when the current call began */
+  long long start[NPHASES][NCOUNTERS];   /* the counts when it began */
+  int       fd[NCOUNTERS];               /* the counters, -1 if unavailable */
+  struct {
+    cl_event event;                      /* a command on the device */
+    int      phase;                      /* the phase it belongs to */
+    double   bytes;                      /* and its traffic */
+  }*        pending;                     /* commands not yet timed, in order */
+  int       npending;                    /* no. of them */
+  int       max_pending;                 /* room for them */
+} profile;
+
+static double profile_time(void)
+{
+  struct timeval timstr;  /* structure to hold elapsed time */
+
+  gettimeofday(&timstr,NULL);
+  return timstr.tv_sec+(timstr.tv_usec/1000000.0);
+}
+
+static long long profile_count(const int counter)
+{
+  long long count = 0;    /* value of the counter */
+
+  if (profile.fd[counter] < 0 || read(profile.fd[counter],&count,sizeof(count)) != sizeof(count))
+    return 0;
+  return count;
+}
+
+/* size of a file that has been written, for the I/O traffic */
+double profile_file_bytes(const char* name)
+{
+  struct stat st;         /* the file's status */
+
+  return (stat(name,&st) == 0) ? (double)st.st_size : 0.0;
+}
+
+void profile_init(void)
+{
+#ifdef __linux__
+  const unsigned long long config[NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;  /* what to count */
+#endif
+  int    kk;                    /* generic counter */
+
+  memset(&profile,0,sizeof(profile));
+  for(kk=0;kk<NCOUNTERS;kk++) {
+#ifdef __linux__
+    memset(&attr,0,sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[kk];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* the counters are often refused, e.g. by perf_event_paranoid or
+    ** in a container, in which case they are reported as null */
+    profile.fd[kk] = syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+#else
+    profile.fd[kk] = -1;
+#endif
+  }
+}
+
+void profile_begin(const int phase)
+{
+  int kk;                 /* generic counter */
+
+  for(kk=0;kk<NCOUNTERS;kk++) profile.start[phase][kk] = profile_count(kk);
+  profile.tic[phase] = profile_time();
+}
+
+void profile_end(const int phase, const double bytes)
+{
+  int kk;                 /* generic counter */
+
+  profile.seconds[phase] += profile_time() - profile.tic[phase];
+  for(kk=0;kk<NCOUNTERS;kk++) {
+    profile.counts[phase][kk] += profile_count(kk) - profile.start[phase][kk];
+  }
+  profile.bytes[phase] += bytes;
+  profile.calls[phase]++;
+}
+
+void profile_event(const int phase, cl_event event, const double bytes)
+{
+  if (profile.npending == profile.max_pending) {
+    profile.max_pending = profile.max_pending ? 2*profile.max_pending : 1024;
+    profile.pending = realloc(profile.pending,sizeof(*profile.pending)*profile.max_pending);
+    if (profile.pending == NULL)
+      die("cannot allocate memory for the profile",__LINE__,__FILE__);
+  }
+  profile.pending[profile.npending].event = event;
+  profile.pending[profile.npending].phase = phase;
+  profile.pending[profile.npending].bytes = bytes;
+  profile.npending++;
+}
+
+void profile_collect(const int wait)
+{
+  cl_ulong start,end;     /* when the command ran on the device, in ns */
+  cl_int   status;        /* whether it has run */
+  int      done;          /* no. of commands timed */
+  int      phase;
+
+  /* the commands run in order, so stop at the first still to run */
+  for(done=0;done<profile.npending;done++) {
+    if (wait) clWaitForEvents(1,&profile.pending[done].event);
+    else if (clGetEventInfo(profile.pending[done].event,CL_EVENT_COMMAND_EXECUTION_STATUS,
+               sizeof(status),&status,NULL) != CL_SUCCESS || status != CL_COMPLETE)
+      break;
+    phase = profile.pending[done].phase;
+    clGetEventProfilingInfo(profile.pending[done].event,CL_PROFILING_COMMAND_START,
+                            sizeof(start),&start,NULL);
+    clGetEventProfilingInfo(profile.pending[done].event,CL_PROFILING_COMMAND_END,
+                            sizeof(end),&end,NULL);
+    clReleaseEvent(profile.pending[done].event);
+    profile.seconds[phase] += (end - start)*1.0E-9;
+    profile.bytes[phase] += profile.pending[done].bytes;
+    profile.calls[phase]++;
+  }
+  profile.npending -= done;
+  memmove(profile.pending,&profile.pending[done],sizeof(*profile.pending)*profile.npending);
+}
+
+void profile_write(const t_param params, const int steps, const double elapsed)
+{
+  FILE*  fp;              /* file pointer */
+  int    ii,kk;           /* generic counters */
+
+  fp = fopen(PROFILEFILE,"w");
+  if (fp == NULL) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+
+  fprintf(fp,"{\n");
+  fprintf(fp,"  \"driver\": \"opencl\",\n");
+  fprintf(fp,"  \"nx\": %d,\n  \"ny\": %d,\n  \"iterations\": %d,\n  \"steps\": %d,\n",
+          params.nx,params.ny,params.maxIters,steps);
+  fprintf(fp,"  \"elapsed\": %.6f,\n",elapsed);
+  fprintf(fp,"  \"mlups\": %.3f,\n",
+          (elapsed > 0.0) ? (double)params.nx*params.ny*steps/elapsed/1.0E6 : 0.0);
+  fprintf(fp,"  \"phases\": {\n");
+  for(ii=0;ii<NPHASES;ii++) {
+    fprintf(fp,"    \"%s\": { \"device\": %s, \"calls\": %ld, \"seconds\": %.6f, \"bytes\": %.0f, \"gbytes_per_s\": %.3f",
+            phase_name[ii],phase_on_device[ii] ? "true" : "false",
+            profile.calls[ii],profile.seconds[ii],profile.bytes[ii],
+            (profile.seconds[ii] > 0.0) ? profile.bytes[ii]/profile.seconds[ii]/1.0E9 : 0.0);
+    for(kk=0;kk<NCOUNTERS;kk++) {
+      if (phase_on_device[ii] || profile.fd[kk] < 0) fprintf(fp,", \"%s\": null",counter_name[kk]);
+      else fprintf(fp,", \"%s\": %lld",counter_name[kk],profile.counts[ii][kk]);
+    }
+    fprintf(fp," }%s\n",(ii < NPHASES-1) ? "," : "");
+  }
+  fprintf(fp,"  }\n}\n");
+
+  fclose(fp);
+}
+#endif
+
 void die(const char* message, const int line, const char *file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
@@ -44,6 +44,94 @@
 **          |  ----- ----- -----
 **          ----------------------> nx
 **
+** The lattice is stored as a structure of arrays: each of the
+** 9 speeds has its own contiguous, 64-byte aligned 'plane' of
+** ny*nx values, laid out in the same row major order.  This
+** lets the kernels vectorise across neighbouring cells: built
+** with e.g. -O3 -march=native -fno-math-errno, 4 (AVX2) or 8
+** (AVX-512) cells are updated per instruction in double
+** precision, twice as many in single precision.
+**
+**  speeds[0]: | A0 | B0 | C0 | D0 | E0 | F0 | pad |
+**  speeds[1]: | A1 | B1 | C1 | D1 | E1 | F1 | pad |
+**  ...
+**
+** Built with -DAA_PATTERN the grid is streamed in place, so only
+** one lattice is allocated.  Steps alternate between two sweeps
+** (the 'AA pattern'): an odd step pulls each cell's densities from
+** its neighbours and writes the collided values straight back
+** where it read them, reversed; an even step reads and writes only
+** the cell itself, also reversed.  Between an odd and an even step
+** the planes hold the streamed densities; after an even step each
+** speed is held in the plane of its opposite, which is undone by
+** exchanging the plane pointers rather than the data.
+**
+** The obstacles are also held as runs of consecutive cells of
+** the same kind along each row, found once by initialise().  The
+** kernels sweep a run at a time, so that fluid cells are updated
+** without testing each cell, and blocked cells only rebound.
+** Blocked cells with no fluid neighbours are skipped altogether:
+** the densities they would hold only ever reach other blocked
+** cells, so never affect the fluid.  They keep the densities of
+** fluid at rest that every lattice starts with, which rebounding
+** between blocked cells would leave unchanged anyway.
+**
+** Built with -DPERSISTENT_REGION the threads are started once,
+** in a single parallel region around the whole timestep loop,
+** rather than once per timestep.  Each timestep then costs the one
+** barrier needed before the next may read the new state, which
+** matters on small grids with many threads.
+**
+** On machines with several sockets each row of the lattice is
+** first touched by the thread that will update it, so that its
+** pages are placed in the memory of that thread's socket, and
+** lattices of 2MB or more are backed by huge pages where the
+** kernel allows it (transparent huge pages).  This only pays off
+** if the threads stay where they started, so run them pinned:
+**
+**   OMP_PROC_BIND=spread OMP_PLACES=cores d2q9-bgk.exe ...
+**
+** which spreads the threads evenly over the sockets, one per core.
+** The timing output gives the binding and the memory bandwidth the
+** timesteps drew from each socket.
+**
+** Built with -DPROFILE each phase of the run is timed, and a
+** profile giving the time, memory traffic and hardware counts of
+** each phase, and the lattice updates per second, is written as
+** JSON to profile.json.  The hardware counts are of the master
+** thread only, and need perf_event_open() to be permitted.
+**
+** The precision is chosen at compile time with one of
+**
+**   -DPRECISION_DOUBLE  double precision throughout (the default)
+**   -DPRECISION_FLOAT   single precision throughout
+**   -DPRECISION_MIXED   single precision densities and arithmetic,
+**                       with the velocity and density sums in double
+**
+** Long runs can be checkpointed, and restarted after being stopped:
+**
+**   LBM_CHECKPOINT_EVERY=n  write a checkpoint every n timesteps
+**   LBM_CHECKPOINT=file     to this file, checkpoint.dat by default
+**   LBM_RESTART=file        carry on from a checkpoint
+**
+** A checkpoint is a binary copy of the grid and of the average
+** velocities so far, see t_checkpoint, and is read back by mapping
+** it.  Each new checkpoint replaces the last only once it is
+** complete.  With AA_PATTERN checkpoints are only made after an even
+** no. of steps, and with TEMPORAL_BLOCKING between blocks, when the
+** grid is in order; so they may come a little after every n steps.
+**
+** Snapshots of the velocities and pressures can also be taken as the
+** run goes along, every n timesteps with LBM_SNAPSHOT_EVERY=n, into
+** snapshot_<timestep>.dat.  Taking one only copies the grid: a thread
+** of its own writes it out while the timesteps carry on.  There are
+** two copies, so the timesteps only wait if both are yet to be written.
+**
+** With LBM_OUTPUT=binary the final state and the snapshots are written
+** in binary, to final_state.bin and snapshot_<timestep>.bin, which is
+** much quicker than formatting them as text.  HPC-bin2text.c converts
+** them to text, the same as would otherwise have been written.
+**
 ** Note the names of the input parameter and obstacle files
 ** are passed on the command line, e.g.:
 **
@@ -53,17 +141,97 @@
 ** if you choose a different obstacle file.
 */
 
+#define _GNU_SOURCE       /* for sched_getcpu() */
 #include<stdio.h>
 #include<stdlib.h>
-#include<math.h>
+#include<string.h>
+#include<tgmath.h>        /* so sqrt() matches the precision */
 #include<time.h>
+#include<sched.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<pthread.h>
 #include<omp.h>
+#ifdef PROFILE
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
+#endif
 
 #define NSPEEDS         9
+#define ALIGNMENT       64      /* bytes; a cache line, and one AVX-512 register */
+#define HUGE_PAGE       (2*1024*1024)  /* bytes; a transparent huge page */
+#define MAX_SOCKETS     16      /* sockets the bandwidth is reported for */
+#define ALWAYS_INLINE   inline __attribute__((always_inline)) /* so rows vectorise */
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
+#define SNAPSHOTFILE    "snapshot_%06d.dat"  /* of the no. of timesteps made */
+#define SNAPSHOTBIN     "snapshot_%06d.bin"
+#define FIELDS_MAGIC    "LBMFLDS1"     /* first 8 bytes of a binary field file */
 #define AVVELSFILE      "av_vels.dat"
+#define PROFILEFILE     "profile.json"
+#define CHECKPOINTFILE  "checkpoint.dat"
+#define CHECKPOINT_MAGIC "LBMCKPT1"     /* first 8 bytes of a checkpoint file */
+#ifndef TILE_ROWS
+#define TILE_ROWS       32      /* default rows per temporal blocking tile */
+#endif
+#ifndef TILE_STEPS
+#define TILE_STEPS      4       /* default timesteps per temporal blocking tile */
+#endif
+
+#if !defined(PRECISION_FLOAT) && !defined(PRECISION_MIXED) && !defined(PRECISION_DOUBLE)
+#define PRECISION_DOUBLE
+#endif
+#if defined(PRECISION_FLOAT) + defined(PRECISION_MIXED) + defined(PRECISION_DOUBLE) > 1
+#error "choose only one of PRECISION_FLOAT, PRECISION_MIXED and PRECISION_DOUBLE"
+#endif
+
+/* the types of the densities, and of the sums over the grid */
+#if defined(PRECISION_FLOAT)
+typedef float  t_real;
+typedef float  t_acc;
+#elif defined(PRECISION_MIXED)
+typedef float  t_real;
+typedef double t_acc;
+#else
+typedef double t_real;
+typedef double t_acc;
+#endif
+#define REAL(x)         ((t_real)(x))  /* keep literals from promoting floats */
+
+#if defined(TEMPORAL_BLOCKING) && defined(AA_PATTERN)
+#error "TEMPORAL_BLOCKING needs the scratch space grid, so cannot be used with AA_PATTERN"
+#endif
+#if defined(TEMPORAL_BLOCKING) && defined(PERSISTENT_REGION)
+#error "TEMPORAL_BLOCKING already advances several timesteps per parallel region"
+#endif
+
+#ifdef PROFILE
+/* the phases of a run that are timed */
+enum phase {
+  PH_INITIALISE,      /* reading the input and setting up the grids */
+  PH_ACCELERATE,      /* accelerate_flow() */
+  PH_STREAM_COLLIDE,  /* the timesteps' fused propagate, collision and velocity sweeps */
+  PH_REDUCTION,       /* the final av_velocity() */
+  PH_IO,              /* write_values(), checkpoints and taking snapshots */
+  NPHASES
+};
+static const char* phase_name[NPHASES] = {
+  "initialise", "accelerate", "stream_collide", "reduction", "io"
+};
+#define PROFILE_INIT()              profile_init()
+#define PROFILE_BEGIN(phase)        profile_begin(phase)
+#define PROFILE_END(phase,bytes)    profile_end(phase,bytes)
+#define PROFILE_WRITE(params,steps,time) profile_write(params,steps,time)
+#else
+#define PROFILE_INIT()
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase,bytes)
+#define PROFILE_WRITE(params,steps,time)
+#endif
 
 /* struct to hold the parameter values */
 typedef struct {
@@ -76,47 +244,241 @@ typedef struct {
   double omega;         /* relaxation parameter */
 } t_param;
 
-/* struct to hold the 'speed' values */
+/*
+** The header of a checkpoint file.  It is followed by the 9 planes of
+** the grid, each of ny*nx densities of real_size bytes in row major
+** order, then by the iters average velocities recorded so far, as
+** doubles.  Every driver writes the same format, so a run can be
+** restarted by any of them.
+*/
+typedef struct {
+  char   magic[8];      /* CHECKPOINT_MAGIC */
+  int    real_size;     /* bytes per density */
+  int    nx;            /* the parameters of the run, which a restart must match */
+  int    ny;
+  int    reynolds_dim;
+  double density;
+  double accel;
+  double omega;
+  int    iters;         /* no. of timesteps made */
+  int    accelerated;   /* whether the last step also accelerated the flow */
+} t_checkpoint;
+
+/* struct to hold the 'speed' values, one plane per speed */
 typedef struct {
-  double speeds[NSPEEDS];
+  t_real* speeds[NSPEEDS];  /* speeds[kk][ii*nx + jj] */
+  t_real* data;             /* aligned block backing all the planes */
 } t_speed;
 
+/* a run of consecutive cells along a row, all of one kind */
+typedef struct {
+  int start;    /* first column of the run */
+  int end;      /* one past the last column of the run */
+  int kind;     /* what a sweep does with the cells, see enum cell */
+} t_run;
+
+/* the runs making up each row of the grid */
+typedef struct {
+  t_run* run;        /* all the runs, in row major order */
+  int*   row;        /* row ii is run[row[ii]] .. run[row[ii+1]-1] */
+  int    tot_cells;  /* no. of unblocked cells in the grid */
+  int    swept;      /* no. of cells a sweep visits, i.e. not solid */
+} t_runs;
+
+/*
+** The header of a binary field file, final_state.bin or a snapshot.
+** It is followed by planes of ny*nx values in row major order: the x
+** and y components of the velocity, its norm and the pressure of each
+** cell, as doubles, then whether each cell is blocked, as ints.
+** HPC-bin2text.c turns one back into the text write_values() writes.
+*/
+typedef struct {
+  char   magic[8];      /* FIELDS_MAGIC */
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    iters;         /* no. of timesteps made */
+  int    pad;           /* keeps the planes aligned */
+} t_fields;
+
+/* a copy of the grid, to be written out by the writer thread */
+typedef struct {
+  t_speed cells;        /* the densities */
+  int     iters;        /* no. of timesteps made when it was taken */
+  int     full;         /* whether it is still to be written */
+} t_snapshot;
+
+/* the thread writing snapshots while the timesteps carry on.  The
+** two snapshots are filled and written in turn, so a new one can be
+** taken while the last is still being written */
+typedef struct {
+  pthread_t       thread;
+  pthread_mutex_t lock;     /* guards full, and done */
+  pthread_cond_t  changed;  /* a snapshot has filled or emptied, or done is set */
+  t_snapshot      snap[2];
+  int             next;     /* the snapshot to take next */
+  int             done;     /* whether any more are to be taken */
+  t_param         params;
+  const int*      obstacles;
+  int             binary;   /* whether to write them in binary, or as text */
+} t_writer;
+
+/* what is saved as the run goes along */
+typedef struct {
+  const char* checkpointfile;    /* where to write checkpoints */
+  int         checkpoint_every;  /* timesteps between checkpoints, 0 for none */
+  int         snapshot_every;    /* timesteps between snapshots, 0 for none */
+  t_writer*   writer;            /* the thread writing the snapshots */
+} t_output;
+
 enum boolean { FALSE, TRUE };
 
+/* the kinds of cell, by what a sweep does with them */
+enum cell {
+  FLUID,    /* collide */
+  WALL,     /* blocked next to fluid, rebound */
+  SOLID     /* blocked with no fluid neighbours, skip */
+};
+
+/* the ways a sweep can move densities, see timestep() */
+enum sweep {
+  PULL,     /* gather from neighbours into the scratch space grid */
+  AA_ODD,   /* gather from neighbours, write back in place */
+  AA_EVEN   /* read and write each cell in place */
+};
+
+/* the no. of steps after which the grid is back in order */
+#ifdef AA_PATTERN
+#define ORDER_STEPS     2
+#else
+#define ORDER_STEPS     1
+#endif
+
 /*
 ** function prototypes
 */
 
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
-	       t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, 
-	       int** obstacles_ptr, double** av_vels_ptr);
+	       t_param* params, t_speed* cells_ptr, t_speed* tmp_cells_ptr, 
+	       int** obstacles_ptr, t_runs* runs_ptr, double** av_vels_ptr);
 
 /* 
 ** The main calculation methods.
-** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** timestep makes a single 'pull' sweep over the grid: each cell
+** gathers its propagated densities from its neighbours, applies
+** rebound or collision, and contributes to the average velocity,
+** which is returned.  The new state is left in cells.
+**
+** With AA_PATTERN the sweep is made in place instead, and
+** unstream() puts the grid back in order if the last step was odd.
+**
+** With TEMPORAL_BLOCKING timestep_tiled() is used instead, to
+** advance several timesteps at once a tile of rows at a time.
+**
+** With PERSISTENT_REGION timestep_persistent() is used instead, to
+** make all the timesteps from within one parallel region.  Both it
+** and timestep() share the rows of each sweep among the threads with
+** sweep_rows(), and then exchange the grids with swap_lattices().
+**
+** accelerate_flow() is applied only to the initial state and to
+** each snapshot's; otherwise the next step's acceleration is folded
+** into the sweep as the densities of the 2nd row of the grid are
+** written out.
 */
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells);
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int write_values(const t_param params, t_speed* cells, int* obstacles, double* av_vels);
+double timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, const t_runs* runs,
+                const int sweep, const int accel);
+int accelerate_flow(const t_param params, t_speed* cells, const t_runs* runs);
+void swap_opposite(t_speed* lattice);
+void unstream(const t_param params, t_speed* cells);
+int timestep_tiled(const t_param params, t_speed* cells, t_speed* tmp_cells, const t_runs* runs,
+                   const int nsteps, const int tile_rows, const int accel, double* av_vels);
+int timestep_persistent(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                        const t_runs* runs, const int first, const t_output* output,
+                        double* av_vels);
+t_acc sweep_rows(const t_param params, t_speed* cells, t_speed* tmp_cells, const t_runs* runs,
+                 const int sweep, const int accel);
+void swap_lattices(t_speed* cells, t_speed* tmp_cells, const int sweep);
+int write_values(const t_param params, t_speed* cells, int* obstacles, double* av_vels,
+                 const int binary);
+
+/* write the velocities and pressures of the grid to a file, as text
+** or as a binary field file, see t_fields */
+int write_state(const t_param params, t_speed* cells, const int* obstacles,
+                const char* name, const int iters, const int binary);
+
+/*
+** Checkpoints.  checkpoint_write() saves the grid and the average
+** velocities of the first iters timesteps, replacing the file only
+** once the new one is complete.  checkpoint_read() maps a checkpoint
+** back into the grid, and returns the no. of timesteps it had made.
+*/
+int checkpoint_write(const char* name, const t_param params, t_speed* cells,
+                     double* av_vels, const int iters);
+int checkpoint_read(const char* name, const t_param params, t_speed* cells,
+                    double* av_vels, int* accelerated);
+
+/*
+** Snapshots.  writer_start() starts the thread that writes them, and
+** writer_stop() waits for it to finish them.  writer_snapshot() copies
+** the grid into the free snapshot, waiting only if the writer is still
+** busy with both, and hands it over to be written.
+*/
+void writer_start(t_writer* writer, const t_param params, const int* obstacles,
+                  const int binary);
+void writer_snapshot(t_writer* writer, t_speed* cells, const int iters);
+void writer_stop(t_writer* writer);
+
+/*
+** output_due() says whether a checkpoint or a snapshot falls after step
+** before and up to step after, and output_save() makes them.  step_due()
+** says the same of something made every so many steps, and
+** snapshot_due() of a snapshot.  A snapshot must hold the state a run
+** of that many steps would end with, so the step before it is made
+** without accelerating the flow, and output_save() accelerates it once
+** the snapshot is taken, before any checkpoint.
+*/
+int output_due(const t_output* output, const int before, const int after);
+void output_save(const t_param params, t_speed* cells, const t_runs* runs, double* av_vels,
+                 const t_output* output, const int before, const int after);
+int step_due(const int every, const int before, const int after);
+int snapshot_due(const t_output* output, const int before, const int after);
 
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-	     int** obstacles_ptr, double** av_vels_ptr);
+int finalise(const t_param* params, t_speed* cells_ptr, t_speed* tmp_cells_ptr,
+	     int** obstacles_ptr, t_runs* runs_ptr, double** av_vels_ptr);
 
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
-double total_density(const t_param params, t_speed* cells);
+t_acc total_density(const t_param params, t_speed* cells);
 
 /* compute average velocity */
-double av_velocity(const t_param params, t_speed* cells, int* obstacles);
+double av_velocity(const t_param params, t_speed* cells, const t_runs* runs);
 
 /* calculate Reynolds number */
-double calc_reynolds(const t_param params, t_speed* cells, int* obstacles);
+double calc_reynolds(const t_param params, t_speed* cells, const t_runs* runs);
+
+/* allocate the aligned planes of a lattice of rows*nx cells */
+void alloc_lattice(const t_param* params, const int rows, t_speed* lattice, const char* name);
+
+/* set rows first to last-1 of a lattice to the densities of fluid at rest */
+void rest_rows(const t_param* params, t_speed* lattice, const int first, const int last);
+
+/* split each row of the obstacle map into runs of each kind of cell */
+void find_runs(const t_param* params, const int* obstacles, t_runs* runs);
+
+/* report the thread binding and the bandwidth drawn from each socket */
+void socket_bandwidth(const t_param params, const t_runs* runs, const int steps,
+                      const double elapsed);
+int cpu_socket(const int cpu);
+
+#ifdef PROFILE
+/* time the phases of the run, and report them */
+void profile_init(void);
+void profile_begin(const int phase);
+void profile_end(const int phase, const double bytes);
+void profile_write(const t_param params, const int steps, const double elapsed);
+double profile_file_bytes(const char* name);
+#endif
 
 /* utility functions */
 void die(const char* message, const int line, const char *file);
@@ -131,16 +493,34 @@ int main(int argc, char* argv[])
   char*    paramfile = NULL;    /* name of the input parameter file */
   char*    obstaclefile = NULL; /* name of a the input obstacle file */
   t_param  params;              /* struct to hold parameter values */
-  t_speed* cells     = NULL;    /* grid containing fluid densities */
-  t_speed* tmp_cells = NULL;    /* scratch space */
+  t_speed  cells;               /* grid containing fluid densities */
+  t_speed  tmp_cells;           /* scratch space */
   int*     obstacles = NULL;    /* grid indicating which cells are blocked */
+  t_runs   runs;                /* the same, as runs of each kind of cell */
   double*  av_vels   = NULL;    /* a record of the av. velocity computed for each timestep */
+#ifndef PERSISTENT_REGION
   int      ii;                  /* generic counter */
+#endif
+  int      first = 0;           /* the first timestep to make, after any restart */
+  int      accelerated = FALSE; /* whether a restart's flow is already accelerated */
+  char*    restartfile;         /* checkpoint to restart from, if any */
+  t_output output;              /* what is saved as the run goes along */
+  t_writer writer;              /* the thread writing snapshots */
+  char*    format;              /* the format of the output files */
+  int      binary;              /* whether to write the final state in binary */
+#ifdef TEMPORAL_BLOCKING
+  int      tile_rows;           /* rows of the grid owned by each tile */
+  int      tile_steps;          /* timesteps each tile is advanced by at once */
+  int      nsteps;              /* timesteps in the current block */
+#elif !defined(PERSISTENT_REGION)
+  int      sweep = PULL;        /* how each timestep moves the densities */
+#endif
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
   double tic,toc;               /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;                /* floating point number to record elapsed user CPU time */
   double systim;                /* floating point number to record elapsed system CPU time */
+  double reynolds;              /* Reynolds number of the final state */
 
   /* parse the command line */
   if(argc != 3) {
@@ -152,21 +532,108 @@ int main(int argc, char* argv[])
   }
 
   /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+  PROFILE_INIT();
+  PROFILE_BEGIN(PH_INITIALISE);
+  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &runs, &av_vels);
+  PROFILE_END(PH_INITIALISE, 2.0*NSPEEDS*sizeof(t_real)*params.nx*params.ny);
+
+#ifdef TEMPORAL_BLOCKING
+  /* tiles should fit in cache: (tile_rows + 2*(tile_steps-1)) rows
+  ** of all the speeds, twice, per thread */
+  tile_rows  = getenv("LBM_TILE_ROWS")  ? atoi(getenv("LBM_TILE_ROWS"))  : TILE_ROWS;
+  tile_steps = getenv("LBM_TILE_STEPS") ? atoi(getenv("LBM_TILE_STEPS")) : TILE_STEPS;
+  if (tile_rows < 1 || tile_steps < 1)
+    die("LBM_TILE_ROWS and LBM_TILE_STEPS must be positive",__LINE__,__FILE__);
+#endif
+
+  /* checkpoint and take snapshots every so many timesteps, and
+  ** restart from a checkpoint */
+  output.checkpointfile   = getenv("LBM_CHECKPOINT") ? getenv("LBM_CHECKPOINT") : CHECKPOINTFILE;
+  output.checkpoint_every = getenv("LBM_CHECKPOINT_EVERY") ? atoi(getenv("LBM_CHECKPOINT_EVERY")) : 0;
+  output.snapshot_every   = getenv("LBM_SNAPSHOT_EVERY") ? atoi(getenv("LBM_SNAPSHOT_EVERY")) : 0;
+  output.writer           = NULL;
+  restartfile             = getenv("LBM_RESTART");
+  if (output.checkpoint_every < 0 || output.snapshot_every < 0)
+    die("LBM_CHECKPOINT_EVERY and LBM_SNAPSHOT_EVERY must not be negative",__LINE__,__FILE__);
+  format = getenv("LBM_OUTPUT") ? getenv("LBM_OUTPUT") : "text";
+  if (strcmp(format,"text") != 0 && strcmp(format,"binary") != 0)
+    die("LBM_OUTPUT must be text or binary",__LINE__,__FILE__);
+  binary = strcmp(format,"binary") == 0;
+  if (output.snapshot_every > 0) {
+    writer_start(&writer,params,obstacles,binary);
+    output.writer = &writer;
+  }
+
+#ifdef AA_PATTERN
+  /* start as if after an even step, with each speed
+  ** held in the plane of its opposite */
+  swap_opposite(&cells);
+#endif
+  if (restartfile != NULL) {
+    PROFILE_BEGIN(PH_IO);
+    first = checkpoint_read(restartfile,params,&cells,av_vels,&accelerated);
+    PROFILE_END(PH_IO, profile_file_bytes(restartfile));
+  }
 
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr,NULL);
   tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
-  for (ii=0;ii<params.maxIters;ii++) {
-    timestep(params,cells,tmp_cells,obstacles);
-    av_vels[ii] = av_velocity(params,cells,obstacles);
+  if (!accelerated) {
+    PROFILE_BEGIN(PH_ACCELERATE);
+    accelerate_flow(params,&cells,&runs);
+    PROFILE_END(PH_ACCELERATE, 2.0*6*sizeof(t_real)*params.nx);
+  }
+#ifdef PERSISTENT_REGION
+  /* all the timesteps at once */
+  PROFILE_BEGIN(PH_STREAM_COLLIDE);
+  timestep_persistent(params,&cells,&tmp_cells,&runs,first,&output,av_vels);
+  PROFILE_END(PH_STREAM_COLLIDE, 2.0*NSPEEDS*sizeof(t_real)*runs.swept*(params.maxIters - first));
+#else
+  for (ii=first;ii<params.maxIters;ii++) {
+#ifdef TEMPORAL_BLOCKING
+    /* advance a block of timesteps at once, which records
+    ** each of their average velocities */
+    if ((ii - first) % tile_steps == 0) {
+      nsteps = (params.maxIters - ii < tile_steps) ? (params.maxIters - ii) : tile_steps;
+      PROFILE_BEGIN(PH_STREAM_COLLIDE);
+      timestep_tiled(params,&cells,&tmp_cells,&runs,nsteps,tile_rows,
+                     ii + nsteps < params.maxIters && !snapshot_due(&output,ii,ii + nsteps),
+                     &av_vels[ii]);
+      PROFILE_END(PH_STREAM_COLLIDE, 2.0*NSPEEDS*sizeof(t_real)*runs.swept*nsteps);
+      /* the grid is only whole between blocks */
+      if (output_due(&output,ii,ii + nsteps))
+        output_save(params,&cells,&runs,av_vels,&output,ii,ii + nsteps);
+    }
+#else
+#ifdef AA_PATTERN
+    sweep = ((ii - first) % 2 == 0) ? AA_ODD : AA_EVEN;
+#endif
+    /* no need to accelerate the flow after the final step, nor yet
+    ** before a snapshot.  With AA_PATTERN the grid is only in order
+    ** after an even step */
+    PROFILE_BEGIN(PH_STREAM_COLLIDE);
+    av_vels[ii] = timestep(params,&cells,&tmp_cells,&runs,sweep,ii < params.maxIters-1 &&
+                           !(sweep != AA_ODD && snapshot_due(&output,ii + 1 - ORDER_STEPS,ii + 1)));
+    PROFILE_END(PH_STREAM_COLLIDE, 2.0*NSPEEDS*sizeof(t_real)*runs.swept);
+    if (sweep != AA_ODD && output_due(&output,ii + 1 - ORDER_STEPS,ii + 1))
+      output_save(params,&cells,&runs,av_vels,&output,ii + 1 - ORDER_STEPS,ii + 1);
+#endif
 #ifdef DEBUG
     printf("==timestep: %d==\n",ii);
     printf("av velocity: %.12E\n", av_vels[ii]);
-    printf("tot density: %.12E\n",total_density(params,cells));
+    printf("tot density: %.12E\n",total_density(params,&cells));
 #endif
   }
+#ifdef AA_PATTERN
+  /* an odd last step leaves the streamed densities */
+  if (sweep == AA_ODD) {
+    PROFILE_BEGIN(PH_STREAM_COLLIDE);
+    unstream(params,&cells);
+    PROFILE_END(PH_STREAM_COLLIDE, 2.0*8*sizeof(t_real)*params.nx*params.ny);
+  }
+#endif
+#endif
   gettimeofday(&timstr,NULL);
   toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
   getrusage(RUSAGE_SELF, &ru);
@@ -175,212 +642,738 @@ int main(int argc, char* argv[])
   timstr=ru.ru_stime;        
   systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
+  /* let the last snapshots be written */
+  if (output.writer != NULL) {
+    PROFILE_BEGIN(PH_IO);
+    writer_stop(&writer);
+    PROFILE_END(PH_IO, 0.0);
+  }
+
   /* write final values and free memory */
   printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n",calc_reynolds(params,cells,obstacles));
+  PROFILE_BEGIN(PH_REDUCTION);
+  reynolds = calc_reynolds(params,&cells,&runs);
+  PROFILE_END(PH_REDUCTION, (double)NSPEEDS*sizeof(t_real)*runs.tot_cells);
+  printf("Reynolds number:\t\t%.12E\n",reynolds);
   printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
   printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
   printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-  write_values(params,cells,obstacles,av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  socket_bandwidth(params,&runs,params.maxIters - first,toc-tic);
+  PROFILE_BEGIN(PH_IO);
+  write_values(params,&cells,obstacles,av_vels,binary);
+  PROFILE_END(PH_IO, profile_file_bytes(binary ? FINALSTATEBIN : FINALSTATEFILE)
+                     + profile_file_bytes(AVVELSFILE));
+  PROFILE_WRITE(params,params.maxIters - first,toc-tic);
+  finalise(&params, &cells, &tmp_cells, &obstacles, &runs, &av_vels);
   
   return EXIT_SUCCESS;
 }
 
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+/*
+** Gather the propagated densities of one cell from its neighbours in
+** cells, then collide them into row d_y of tmp_cells.  y_s, y and y_n
+** are the offsets of the rows south of, containing and north of the
+** cell, and x_w, x and x_e its west, own and east columns.  Returns the norm of
+** the new velocity of an unblocked cell, computed from the densities
+** as written so that it matches av_velocity() of the new state.
+**
+** in_place instead writes each new density back over the density of
+** the opposite speed that was gathered, which only this cell touches.
+*/
+static ALWAYS_INLINE t_acc stream_collide_cell(const t_param params, const t_speed* cells,
+                                         t_speed* tmp_cells, const int in_place,
+                                         const int blocked, const int accel,
+                                         const int y_s, const int y, const int y_n,
+                                         const int d_y,
+                                         const int x_w, const int x, const int x_e)
 {
-  accelerate_flow(params,cells,obstacles);
-  propagate(params,cells,tmp_cells);
-  collision(params,cells,tmp_cells,obstacles);
-  return EXIT_SUCCESS; 
+  const t_real c_sq = 3.0;      /* square of speed of sound */
+  const t_real w0 = 4.0/9.0;    /* weighting factor */
+  const t_real w1 = 1.0/9.0;    /* weighting factor */
+  const t_real w2 = 1.0/36.0;   /* weighting factor */
+  const t_real a1 = params.density * params.accel / 9.0;   /* acceleration weights */
+  const t_real a2 = params.density * params.accel / 36.0;
+  const t_real omega = params.omega;  /* relaxation parameter */
+  const int pos = d_y + x;      /* index of the new cell in each plane */
+  t_real* const* s = cells->speeds;
+  t_real* const* d = tmp_cells->speeds;
+  t_real t[NSPEEDS];            /* propagated densities */
+  t_real n[NSPEEDS];            /* densities after collision */
+  t_real u_x,u_y;               /* av. velocities in x and y directions */
+  t_real u[NSPEEDS];            /* directional velocities */
+  t_real d_equ[NSPEEDS];        /* equilibrium densities */
+  t_real u_sq;                  /* squared velocity */
+  t_real local_density;         /* sum of densities in the cell */
+  t_acc  n_density,n_x,n_y;     /* the same for the new densities */
+  t_acc  norm;                  /* norm of the new velocity */
+  int    kk;                    /* generic counter */
+
+  /* pull in the densities travelling towards this cell, following
+  ** appropriate directions of travel */
+  t[0] = s[0][y   + x  ]; /* central cell, no movement */
+  t[1] = s[1][y   + x_w]; /* east, from the west */
+  t[2] = s[2][y_s + x  ]; /* north, from the south */
+  t[3] = s[3][y   + x_e]; /* west, from the east */
+  t[4] = s[4][y_n + x  ]; /* south, from the north */
+  t[5] = s[5][y_s + x_w]; /* north-east, from the south-west */
+  t[6] = s[6][y_s + x_e]; /* north-west, from the south-east */
+  t[7] = s[7][y_n + x_e]; /* south-west, from the north-east */
+  t[8] = s[8][y_n + x_w]; /* south-east, from the north-west */
+
+  /* compute local density total */
+  local_density = t[0] + t[1] + t[2] + t[3] + t[4]
+                + t[5] + t[6] + t[7] + t[8];
+  /* compute x velocity component */
+  u_x = (t[1] + t[5] + t[8] - (t[3] + t[6] + t[7])) / local_density;
+  /* compute y velocity component */
+  u_y = (t[2] + t[5] + t[6] - (t[4] + t[7] + t[8])) / local_density;
+  /* velocity squared */ 
+  u_sq = u_x * u_x + u_y * u_y;
+  /* directional velocity components */
+  u[1] =   u_x;        /* east */
+  u[2] =         u_y;  /* north */
+  u[3] = - u_x;        /* west */
+  u[4] =       - u_y;  /* south */
+  u[5] =   u_x + u_y;  /* north-east */
+  u[6] = - u_x + u_y;  /* north-west */
+  u[7] = - u_x - u_y;  /* south-west */
+  u[8] =   u_x - u_y;  /* south-east */
+  /* equilibrium densities */
+  /* zero velocity density: weight w0 */
+  d_equ[0] = w0 * local_density * (REAL(1.0) - u_sq * REAL(1.5));
+  /* axis speeds: weight w1 */
+  for(kk=1;kk<5;kk++) {
+    d_equ[kk] = w1 * local_density * (REAL(1.0) + u[kk] * c_sq
+                                      + (u[kk] * u[kk]) * REAL(4.5)
+                                      - u_sq * REAL(1.5));
+  }
+  /* diagonal speeds: weight w2 */
+  for(kk=5;kk<NSPEEDS;kk++) {
+    d_equ[kk] = w2 * local_density * (REAL(1.0) + u[kk] * c_sq
+                                      + (u[kk] * u[kk]) * REAL(4.5)
+                                      - u_sq * REAL(1.5));
+  }
+
+  if(blocked) {
+    /* occupied cells mirror the propagated values */
+    n[0] = t[0];
+    n[1] = t[3];
+    n[2] = t[4];
+    n[3] = t[1];
+    n[4] = t[2];
+    n[5] = t[7];
+    n[6] = t[8];
+    n[7] = t[5];
+    n[8] = t[6];
+    norm = 0.0;
+  }
+  else {
+    /* relaxation step */
+    for(kk=0;kk<NSPEEDS;kk++) {
+      n[kk] = t[kk] + omega * (d_equ[kk] - t[kk]);
+    }
+    /* norm of the new velocity, at the precision of the sums */
+    n_density = (t_acc)n[0] + n[1] + n[2] + n[3] + n[4]
+              + n[5] + n[6] + n[7] + n[8];
+    n_x = ((t_acc)n[1] + n[5] + n[8] - ((t_acc)n[3] + n[6] + n[7])) / n_density;
+    n_y = ((t_acc)n[2] + n[5] + n[6] - ((t_acc)n[4] + n[7] + n[8])) / n_density;
+    norm = sqrt((n_x * n_x) + (n_y * n_y));
+    /* accelerate the flow for the next step, if we
+    ** don't send a density negative.  The tests are all made,
+    ** rather than short circuited, so that the loop has no
+    ** branches; otherwise gcc won't vectorise it in single precision */
+    if(accel & ((n[3] - a1) > 0) & ((n[6] - a2) > 0) & ((n[7] - a2) > 0)) {
+      /* increase 'east-side' densities */
+      n[1] += a1;
+      n[5] += a2;
+      n[8] += a2;
+      /* decrease 'west-side' densities */
+      n[3] -= a1;
+      n[6] -= a2;
+      n[7] -= a2;
+    }
+  }
+
+  if (in_place) {
+    s[0][y   + x  ] = n[0];
+    s[1][y   + x_w] = n[3];
+    s[2][y_s + x  ] = n[4];
+    s[3][y   + x_e] = n[1];
+    s[4][y_n + x  ] = n[2];
+    s[5][y_s + x_w] = n[7];
+    s[6][y_s + x_e] = n[8];
+    s[7][y_n + x_e] = n[5];
+    s[8][y_n + x_w] = n[6];
+  }
+  else {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      d[kk][pos] = n[kk];
+    }
+  }
+
+  return norm;
 }
 
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles)
+/* stream and collide columns lo to hi-1 of one row, whose neighbouring
+** rows are at offsets y_s and y_n, into row d_y.  The cells are all
+** fluid or all walls, so each kind gets its own loop, and walls skip
+** the collision entirely.  Returns the summed velocity norms */
+static ALWAYS_INLINE t_acc stream_collide_run(const t_param params, const t_speed* cells,
+                                 t_speed* tmp_cells, const int blocked,
+                                 const int y_s, const int y, const int y_n, const int d_y,
+                                 int lo, int hi, const int sweep, const int accel)
 {
-  int ii;     /* generic counters */
-  double w1,w2;  /* weighting factors */
-  int row_count,row_start,row_end;
-  
-  /* compute weighting factors */
-  w1 = params.density * params.accel / 9.0;
-  w2 = params.density * params.accel / 36.0;
+  int    jj;               /* generic counter */
+  const int nx = params.nx;
+  const int in_place = (sweep != PULL);
+  t_acc  tot_u = 0.0;      /* accumulated magnitudes of velocity */
+  /* local copies, so the plane pointers are seen to be loop invariant
+  ** rather than reloaded for every cell, which defeats vectorisation */
+  const t_speed src = *cells;
+  t_speed dst = *tmp_cells;
+
+  if (sweep == AA_EVEN) {
+    /* rebounding in place would write each density back where it is */
+    if (blocked) return 0.0;
+    /* each cell only touches itself */
+#pragma omp simd reduction(+:tot_u)
+    for(jj=lo;jj<hi;jj++) {
+      tot_u += stream_collide_cell(params,&src,&dst,in_place,FALSE,accel,
+                                   y,y,y,y,jj,jj,jj);
+    }
+    return tot_u;
+  }
 
-  /* modify the 2nd row of the grid */
-  ii=params.ny - 2;
-  row_start = ii*params.nx;
-  row_end = row_start + params.nx;
-#pragma omp parallel for shared(cells,obstacles,ii)\
- private(row_count) firstprivate(row_start,row_end)
-  for(row_count=row_start;row_count<row_end;row_count++) {
-    /* if the cell is not occupied and
-    ** we don't send a density negative */
-    if( !obstacles[row_count] && 
-	    (cells[row_count].speeds[3] - w1) > 0.0 &&
-	    (cells[row_count].speeds[6] - w2) > 0.0 &&
-	    (cells[row_count].speeds[7] - w2) > 0.0 ) {
-      /* increase 'east-side' densities */
-      cells[row_count].speeds[1] += w1;
-      cells[row_count].speeds[5] += w2;
-      cells[row_count].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[row_count].speeds[3] -= w1;
-      cells[row_count].speeds[6] -= w2;
-      cells[row_count].speeds[7] -= w2;
+  /* the end columns wrap around, the rest of the row is unit stride */
+  if (lo == 0) {
+    tot_u += stream_collide_cell(params,&src,&dst,in_place,blocked,accel,
+                                 y_s,y,y_n,d_y,nx-1,0,(nx > 1) ? 1 : 0);
+    lo = 1;
+  }
+  if (hi == nx && hi > lo) {
+    tot_u += stream_collide_cell(params,&src,&dst,in_place,blocked,accel,
+                                 y_s,y,y_n,d_y,nx-2,nx-1,0);
+    hi = nx - 1;
+  }
+#pragma omp simd reduction(+:tot_u)
+  for(jj=lo;jj<hi;jj++) {
+    tot_u += stream_collide_cell(params,&src,&dst,in_place,blocked,accel,
+                                 y_s,y,y_n,d_y,jj-1,jj,jj+1);
+  }
+
+  return tot_u;
+}
+
+/* stream and collide row ii, whose neighbouring rows are at offsets
+** y_s and y_n, into row d_y, a run at a time, skipping solid runs.
+** Returns the summed velocity norms */
+static ALWAYS_INLINE t_acc stream_collide_row(const t_param params, const t_speed* cells,
+                                 t_speed* tmp_cells, const t_runs* runs, const int ii,
+                                 const int y_s, const int y, const int y_n, const int d_y,
+                                 const int sweep, const int accel)
+{
+  int    rr;               /* generic counter */
+  const t_run* run;        /* the current run */
+  t_acc  tot_u = 0.0;      /* accumulated magnitudes of velocity */
+
+  for(rr=runs->row[ii];rr<runs->row[ii+1];rr++) {
+    run = &runs->run[rr];
+    if (run->kind == FLUID) {
+      tot_u += stream_collide_run(params,cells,tmp_cells,FALSE,y_s,y,y_n,d_y,
+                                  run->start,run->end,sweep,accel);
+    }
+    else if (run->kind == WALL) {
+      tot_u += stream_collide_run(params,cells,tmp_cells,TRUE,y_s,y,y_n,d_y,
+                                  run->start,run->end,sweep,FALSE);
+    }
+  }
+
+  return tot_u;
+}
+
+#ifdef TEMPORAL_BLOCKING
+/* a pull sweep of one tile row.  Kept out of line: inlined into the
+** tile loop, gcc splits it at the owned rows and the copies run slowly */
+static __attribute__((noinline)) t_acc tile_row(const t_param params, const t_speed* src,
+                                                 t_speed* dst, const t_runs* runs, const int ii,
+                                                 const int y_s, const int y, const int y_n,
+                                                 const int d_y, const int accel)
+{
+  return stream_collide_row(params,src,dst,runs,ii,y_s,y,y_n,d_y,PULL,accel);
+}
+#endif
+
+double timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, const t_runs* runs,
+                const int sweep, const int accel)
+{
+  t_acc  tot_u = 0.0;    /* accumulated magnitudes of velocity for each cell */
+
+#pragma omp parallel reduction(+:tot_u)
+  tot_u += sweep_rows(params,cells,tmp_cells,runs,sweep,accel);
+
+  swap_lattices(cells,tmp_cells,sweep);
+
+  return tot_u / (double)runs->tot_cells;
+}
+
+#ifdef PERSISTENT_REGION
+/* add up the threads' sums of each timestep from *summed to last-1 */
+static void sum_partials(const t_acc* partial, const int nthreads, const int last,
+                         int* summed, double* av_vels)
+{
+  int    tt;             /* generic counter */
+  t_acc  tot_u;          /* accumulated magnitudes of velocity for a step */
+
+  for(;*summed<last;(*summed)++) {
+    tot_u = 0.0;
+    for(tt=0;tt<nthreads;tt++) tot_u += partial[(*summed%2)*nthreads + tt];
+    av_vels[*summed] = tot_u;
+  }
+}
+
+int timestep_persistent(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                        const t_runs* runs, const int first, const t_output* output,
+                        double* av_vels)
+{
+  int    ii;                   /* generic counter */
+  int    sweep = PULL;         /* how each timestep moves the densities */
+  int    summed = first;       /* timesteps whose sums have been combined */
+  int    averaged = first;     /* and then averaged */
+  const int nthreads = omp_get_max_threads();
+  t_acc* partial;              /* each thread's sums of the last two steps */
+
+  /* the threads' sums are added up in the order of the threads, so that
+  ** the averages are the same from one run to the next.  Unused slots,
+  ** if the region has fewer threads, stay zero */
+  partial = calloc(2*nthreads,sizeof(t_acc));
+  if (partial == NULL)
+    die("cannot allocate memory for the velocity sums",__LINE__,__FILE__);
+
+#pragma omp parallel private(ii) firstprivate(sweep)
+  {
+    /* the thread's own copies of the grids, which every
+    ** thread exchanges alike, so that needs no barrier */
+    t_speed lattice = *cells;
+    t_speed scratch = *tmp_cells;
+    const int tid = omp_get_thread_num();
+
+    for(ii=first;ii<params.maxIters;ii++) {
+#ifdef AA_PATTERN
+      sweep = ((ii - first) % 2 == 0) ? AA_ODD : AA_EVEN;
+#endif
+      /* no need to accelerate the flow after the final step, nor yet
+      ** before a snapshot.  The barrier ending the sweep is the only
+      ** one each step needs */
+      partial[(ii%2)*nthreads + tid] =
+        sweep_rows(params,&lattice,&scratch,runs,sweep,ii < params.maxIters-1 &&
+                   !(sweep != AA_ODD && snapshot_due(output,ii + 1 - ORDER_STEPS,ii + 1)));
+      swap_lattices(&lattice,&scratch,sweep);
+      /* the previous step's sums were all written before the barrier
+      ** ending this sweep, and their slots are not written again
+      ** until after the barrier ending the next one */
+#pragma omp master
+      sum_partials(partial,nthreads,ii,&summed,av_vels);
+#ifdef DEBUG
+#pragma omp barrier
+#pragma omp master
+      {
+        sum_partials(partial,nthreads,ii + 1,&summed,av_vels);
+        printf("==timestep: %d==\n",ii);
+        printf("av velocity: %.12E\n", av_vels[ii] / (double)runs->tot_cells);
+        printf("tot density: %.12E\n",total_density(params,&lattice));
+      }
+#pragma omp barrier
+#endif
+      /* every thread takes the same branch.  The first barrier
+      ** completes the step's sums, the second keeps the next step
+      ** from writing the grid before it has been saved */
+      if (sweep != AA_ODD && output_due(output,ii + 1 - ORDER_STEPS,ii + 1)) {
+#pragma omp barrier
+#pragma omp master
+        {
+          sum_partials(partial,nthreads,ii + 1,&summed,av_vels);
+          for(;averaged<=ii;averaged++) av_vels[averaged] /= (double)runs->tot_cells;
+          output_save(params,&lattice,runs,av_vels,output,ii + 1 - ORDER_STEPS,ii + 1);
+        }
+#pragma omp barrier
+      }
+    }
+
+#pragma omp master
+    {
+      *cells = lattice;
+      *tmp_cells = scratch;
     }
   }
 
+  /* the region ends with a barrier, so all the sums are complete */
+  sum_partials(partial,nthreads,params.maxIters,&summed,av_vels);
+  for(ii=averaged;ii<params.maxIters;ii++) av_vels[ii] /= (double)runs->tot_cells;
+  free(partial);
+
+#ifdef AA_PATTERN
+  /* an odd last step, the first of each pair, leaves the streamed densities */
+  if ((params.maxIters - first) % 2 == 1) unstream(params,cells);
+#endif
+
   return EXIT_SUCCESS;
 }
+#endif
 
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells)
+t_acc sweep_rows(const t_param params, t_speed* cells, t_speed* tmp_cells, const t_runs* runs,
+                 const int sweep, const int accel)
 {
-  int ii,jj;            /* generic counters */
-  int x_e,x_w,y_n,y_s;  /* indices of neighbouring cells */
+  int    ii;             /* generic counter */
+  int    y,y_n,y_s;      /* offsets of the row and its neighbours */
+  t_acc  tot_u = 0.0;    /* accumulated magnitudes of velocity for this thread's rows */
+  int    row_accel;      /* whether to accelerate the current row */
+
+  /* each kind of sweep gets its own copy of the row kernel.  The
+  ** static schedule matches the first touch in initialise(), and the
+  ** barrier at the end keeps the next sweep from starting early */
+#pragma omp for schedule(static)
+  for(ii=0;ii<params.ny;ii++) {
+    /* determine offsets of the axis-direction neighbours
+    ** respecting periodic boundary conditions (wrap around) */
+    y   = ii*params.nx;
+    y_n = ((ii + 1) % params.ny) * params.nx;
+    y_s = ((ii == 0) ? (ii + params.ny - 1) : (ii - 1)) * params.nx;
+    row_accel = accel && ii == params.ny - 2;
+    switch (sweep) {
+    case PULL:
+      tot_u += stream_collide_row(params,cells,tmp_cells,runs,ii,y_s,y,y_n,y,
+                                  PULL,row_accel);
+      break;
+    case AA_ODD:
+      tot_u += stream_collide_row(params,cells,tmp_cells,runs,ii,y_s,y,y_n,y,
+                                  AA_ODD,row_accel);
+      break;
+    case AA_EVEN:
+      tot_u += stream_collide_row(params,cells,tmp_cells,runs,ii,y_s,y,y_n,y,
+                                  AA_EVEN,row_accel);
+      break;
+    }
+  }
+
+  return tot_u;
+}
+
+void swap_lattices(t_speed* cells, t_speed* tmp_cells, const int sweep)
+{
+  t_speed swap;          /* for exchanging the grids */
+
+  if (sweep == PULL) {
+    /* the new state is in the scratch space grid */
+    swap = *cells;
+    *cells = *tmp_cells;
+    *tmp_cells = swap;
+  }
+  else {
+    /* each new density was written to the plane of its opposite */
+    swap_opposite(cells);
+  }
+}
+
+#ifdef TEMPORAL_BLOCKING
+int timestep_tiled(const t_param params, t_speed* cells, t_speed* tmp_cells, const t_runs* runs,
+                   const int nsteps, const int tile_rows, const int accel, double* av_vels)
+{
+  const int nx    = params.nx;
+  const int halo  = nsteps - 1;               /* rows either side needed for nsteps */
+  const int rows  = tile_rows + 2*halo;       /* rows held by a tile */
+  const int ntiles = (params.ny + tile_rows - 1) / tile_rows;
+  t_acc  tot_u[nsteps];                       /* accumulated velocities for each step */
+  int    ii,tt,ll;                            /* generic counters */
+  t_speed swap;                               /* for exchanging the grids */
+
+  for(tt=0;tt<nsteps;tt++) tot_u[tt] = 0.0;
+
+#pragma omp parallel private(ii,tt,ll)
+  {
+    t_speed tile[2];       /* the thread's pair of scratch tiles */
+    t_speed* src;          /* the lattice read by a step */
+    t_speed* dst;          /* the lattice written by a step */
+    int    start,own;      /* first grid row of the tile and no. of rows it owns */
+    int    lo,hi;          /* tile rows computed by a step */
+    int    g,g_n,g_s;      /* grid rows of a tile row and its neighbours */
+    int    y,y_n,y_s,d_y;  /* offsets of the rows in their lattices */
+    t_acc  row_u;          /* summed velocities of a row */
+
+    alloc_lattice(&params, rows, &tile[0], "temporal blocking tile");
+    alloc_lattice(&params, rows, &tile[1], "temporal blocking tile");
+    /* as with the grids, the solid cells of the tiles are never
+    ** written, but the walls next to them read them */
+    rest_rows(&params, &tile[0], 0, rows);
+    rest_rows(&params, &tile[1], 0, rows);
+
+    /*
+    ** Each tile owns tile_rows rows of the grid, and advances them nsteps
+    ** timesteps while they are in cache.  To do this without reference to
+    ** its neighbours it also recomputes the halo rows either side, one
+    ** fewer on each side every step: the first step reads the grid itself,
+    ** the last writes only the owned rows back into tmp_cells.
+    */
+#pragma omp for schedule(static) reduction(+:tot_u[:nsteps])
+    for(ii=0;ii<ntiles;ii++) {
+      start = ii*tile_rows - halo;
+      own = (ii == ntiles - 1) ? (params.ny - ii*tile_rows) : tile_rows;
+      for(tt=0;tt<nsteps;tt++) {
+        src = (tt == 0) ? cells : &tile[(tt+1) % 2];
+        dst = (tt == nsteps-1) ? tmp_cells : &tile[tt % 2];
+        lo = tt;
+        hi = own + 2*halo - tt;
+        for(ll=lo;ll<hi;ll++) {
+          /* grid row of this tile row, with periodic wrap around */
+          g   = ((start + ll) % params.ny + params.ny) % params.ny;
+          g_n = (g + 1) % params.ny;
+          g_s = (g == 0) ? (params.ny - 1) : (g - 1);
+          if (tt == 0) {
+            y = g*nx; y_n = g_n*nx; y_s = g_s*nx;
+          }
+          else {
+            y = ll*nx; y_n = (ll+1)*nx; y_s = (ll-1)*nx;
+          }
+          d_y = (tt == nsteps-1) ? g*nx : ll*nx;
+          /* each step but the block's last accelerates the flow for
+          ** the next, and that one only if asked */
+          row_u = tile_row(params,src,dst,runs,g,y_s,y,y_n,d_y,
+                           (tt < nsteps-1 || accel) && g == params.ny - 2);
+          /* only the owned rows count towards the average velocity */
+          if (ll >= halo && ll < halo + own) tot_u[tt] += row_u;
+        }
+      }
+    }
+
+    free(tile[0].data);
+    free(tile[1].data);
+  }
+
+  for(tt=0;tt<nsteps;tt++) {
+    av_vels[tt] = tot_u[tt] / (double)runs->tot_cells;
+  }
+
+  /* the new state is in the scratch space grid */
+  swap = *cells;
+  *cells = *tmp_cells;
+  *tmp_cells = swap;
 
-  /* loop over _all_ cells */
-#pragma omp parallel for shared(cells,tmp_cells) private(ii,jj,x_e,x_w,y_n,y_s)
+  return EXIT_SUCCESS;
+}
+#endif
+
+void swap_opposite(t_speed* lattice)
+{
+  t_real* swap;  /* for exchanging the planes */
+
+  swap = lattice->speeds[1]; lattice->speeds[1] = lattice->speeds[3]; lattice->speeds[3] = swap;
+  swap = lattice->speeds[2]; lattice->speeds[2] = lattice->speeds[4]; lattice->speeds[4] = swap;
+  swap = lattice->speeds[5]; lattice->speeds[5] = lattice->speeds[7]; lattice->speeds[7] = swap;
+  swap = lattice->speeds[6]; lattice->speeds[6] = lattice->speeds[8]; lattice->speeds[8] = swap;
+}
+
+void unstream(const t_param params, t_speed* cells)
+{
+  int ii,jj;            /* generic counters */
+  int x_e,x_w,y,y_n;    /* offsets of the cell and its neighbours */
+  t_real swap;          /* for exchanging densities */
+  t_real** s = cells->speeds;
+
+  /* after an odd step each cell holds the densities that have just
+  ** arrived there.  Send each one back to the cell it came from,
+  ** into the plane of its opposite speed, which in turn goes to the
+  ** now empty slot: i.e. swap the pairs the next odd step would read */
+#pragma omp parallel for schedule(static) private(jj,x_e,x_w,y,y_n,swap)
   for(ii=0;ii<params.ny;ii++) {
+    y   = ii*params.nx;
+    y_n = ((ii + 1) % params.ny) * params.nx;
     for(jj=0;jj<params.nx;jj++) {
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      y_n = (ii + 1) % params.ny;
       x_e = (jj + 1) % params.nx;
-      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
       x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_cells[ii *params.nx + jj].speeds[0]  = cells[ii*params.nx + jj].speeds[0]; /* central cell, */
-                                                                                     /* no movement   */
-      tmp_cells[ii *params.nx + x_e].speeds[1] = cells[ii*params.nx + jj].speeds[1]; /* east */
-      tmp_cells[y_n*params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[2]; /* north */
-      tmp_cells[ii *params.nx + x_w].speeds[3] = cells[ii*params.nx + jj].speeds[3]; /* west */
-      tmp_cells[y_s*params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[4]; /* south */
-      tmp_cells[y_n*params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
-      tmp_cells[y_n*params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
-      tmp_cells[y_s*params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[7]; /* south-west */      
-      tmp_cells[y_s*params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[8]; /* south-east */      
+      swap = s[1][y   + x_e]; s[1][y   + x_e] = s[3][y + jj]; s[3][y + jj] = swap; /* east */
+      swap = s[2][y_n + jj ]; s[2][y_n + jj ] = s[4][y + jj]; s[4][y + jj] = swap; /* north */
+      swap = s[5][y_n + x_e]; s[5][y_n + x_e] = s[7][y + jj]; s[7][y + jj] = swap; /* north-east */
+      swap = s[6][y_n + x_w]; s[6][y_n + x_w] = s[8][y + jj]; s[8][y + jj] = swap; /* north-west */
+    }
+  }
+
+  /* as after an even step */
+  swap_opposite(cells);
+}
+
+int accelerate_flow(const t_param params, t_speed* cells, const t_runs* runs)
+{
+  int ii,rr;     /* generic counters */
+  t_real w1,w2;  /* weighting factors */
+  int row_count,row_start,row_end;
+  t_real* restrict s1 = cells->speeds[1];
+  t_real* restrict s3 = cells->speeds[3];
+  t_real* restrict s5 = cells->speeds[5];
+  t_real* restrict s6 = cells->speeds[6];
+  t_real* restrict s7 = cells->speeds[7];
+  t_real* restrict s8 = cells->speeds[8];
+  
+  /* compute weighting factors */
+  w1 = params.density * params.accel / 9.0;
+  w2 = params.density * params.accel / 36.0;
+
+  /* modify the unoccupied cells of the 2nd row of the grid */
+  ii=params.ny - 2;
+  for(rr=runs->row[ii];rr<runs->row[ii+1];rr++) {
+    if (runs->run[rr].kind != FLUID) continue;
+    row_start = ii*params.nx + runs->run[rr].start;
+    row_end   = ii*params.nx + runs->run[rr].end;
+#pragma omp simd
+    for(row_count=row_start;row_count<row_end;row_count++) {
+      /* if we don't send a density negative */
+      if( (s3[row_count] - w1) > 0 &&
+          (s6[row_count] - w2) > 0 &&
+          (s7[row_count] - w2) > 0 ) {
+        /* increase 'east-side' densities */
+        s1[row_count] += w1;
+        s5[row_count] += w2;
+        s8[row_count] += w2;
+        /* decrease 'west-side' densities */
+        s3[row_count] -= w1;
+        s6[row_count] -= w2;
+        s7[row_count] -= w2;
+      }
     }
   }
 
   return EXIT_SUCCESS;
 }
 
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
-{
-  int ii,kk;                 /* generic counters */
-  const double c_sq = 3.0;  /* square of speed of sound */
-  const double w0 = 4.0/9.0;    /* weighting factor */
-  const double w1 = 1.0/9.0;    /* weighting factor */
-  const double w2 = 1.0/36.0;   /* weighting factor */
-  double u_x,u_y;               /* av. velocities in x and y directions */
-  double u[NSPEEDS];            /* directional velocities */
-  double d_equ[NSPEEDS];        /* equilibrium densities */
-  double u_sq;                  /* squared velocity */
-  double local_density;         /* sum of densities in a particular cell */
-  int row_start,row_end,row_count;
-
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
-  #pragma omp parallel for shared(cells,tmp_cells)\
-   private(u_x,u_y,u,d_equ,u_sq,local_density,ii,kk,row_start,row_end,row_count)
-  for(ii=0;ii<params.ny;ii++) {
-    row_start = ii*params.nx;
-    row_end = row_start + params.nx;
-    for (row_count=row_start;row_count<row_end;row_count++) {
-      /* don't consider occupied cells */
-      if(obstacles[row_count]) {
-        /* called after propagate, so taking values from scratch space
-	      ** mirroring, and writing into main grid */
-	      cells[row_count].speeds[1] = tmp_cells[row_count].speeds[3];
-	      cells[row_count].speeds[2] = tmp_cells[row_count].speeds[4];
-	      cells[row_count].speeds[3] = tmp_cells[row_count].speeds[1];
-	      cells[row_count].speeds[4] = tmp_cells[row_count].speeds[2];
-	      cells[row_count].speeds[5] = tmp_cells[row_count].speeds[7];
-	      cells[row_count].speeds[6] = tmp_cells[row_count].speeds[8];
-	      cells[row_count].speeds[7] = tmp_cells[row_count].speeds[5];
-	      cells[row_count].speeds[8] = tmp_cells[row_count].speeds[6];
+void alloc_lattice(const t_param* params, const int rows, t_speed* lattice, const char* name)
+{
+  char   message[1024];  /* message buffer */
+  size_t plane;          /* values per speed plane, padded to the alignment */
+  size_t bytes;          /* size of the block backing the planes */
+  size_t align;          /* alignment of the block */
+  int    kk;             /* generic counter */
+
+  plane = (size_t)rows*params->nx;
+  plane = (plane + ALIGNMENT/sizeof(t_real) - 1) & ~(ALIGNMENT/sizeof(t_real) - 1);
+  bytes = sizeof(t_real)*plane*NSPEEDS;
+  align = ALIGNMENT;
+
+#ifdef MADV_HUGEPAGE
+  /* blocks of a huge page or more are made whole huge pages, so that
+  ** none of it has to fall back to small pages */
+  if (bytes >= HUGE_PAGE) {
+    align = HUGE_PAGE;
+    bytes = (bytes + HUGE_PAGE - 1) & ~((size_t)HUGE_PAGE - 1);
+  }
+#endif
+
+  if (posix_memalign((void**)&lattice->data, align, bytes) != 0) {
+    sprintf(message,"cannot allocate memory for %s", name);
+    die(message,__LINE__,__FILE__);
+  }
+
+#ifdef MADV_HUGEPAGE
+  /* nothing has been touched yet, so the huge pages are still placed
+  ** by the first touch.  This is only advice: if the kernel won't
+  ** use huge pages the lattice simply stays in small ones */
+  if (align == HUGE_PAGE) madvise(lattice->data, bytes, MADV_HUGEPAGE);
+#endif
+  for(kk=0;kk<NSPEEDS;kk++) {
+    lattice->speeds[kk] = lattice->data + kk*plane;
+  }
+}
+
+void rest_rows(const t_param* params, t_speed* lattice, const int first, const int last)
+{
+  const double w0 = params->density * 4.0/9.0;   /* weighting factors */
+  const double w1 = params->density      /9.0;
+  const double w2 = params->density      /36.0;
+  int    ii,jj;          /* generic counters */
+
+  for(ii=first;ii<last;ii++) {
+    for(jj=0;jj<params->nx;jj++) {
+      /* centre */
+      lattice->speeds[0][ii*params->nx + jj] = w0;
+      /* axis directions */
+      lattice->speeds[1][ii*params->nx + jj] = w1;
+      lattice->speeds[2][ii*params->nx + jj] = w1;
+      lattice->speeds[3][ii*params->nx + jj] = w1;
+      lattice->speeds[4][ii*params->nx + jj] = w1;
+      /* diagonals */
+      lattice->speeds[5][ii*params->nx + jj] = w2;
+      lattice->speeds[6][ii*params->nx + jj] = w2;
+      lattice->speeds[7][ii*params->nx + jj] = w2;
+      lattice->speeds[8][ii*params->nx + jj] = w2;
+    }
+  }
+}
+
+void find_runs(const t_param* params, const int* obstacles, t_runs* runs)
+{
+  char   message[1024];  /* message buffer */
+  int    ii,jj,kk,ll;    /* generic counters */
+  int    nruns;          /* no. of runs in the grid */
+  int*   kind;           /* the kind of each cell */
+  const int nx = params->nx;
+  const int ny = params->ny;
+
+  kind = malloc(sizeof(int)*ny*nx);
+  if (kind == NULL) die("cannot allocate memory for runs",__LINE__,__FILE__);
+
+  /* a blocked cell is a wall if any of its neighbours, with
+  ** wrap around, is fluid */
+  for(ii=0;ii<ny;ii++) {
+    for(jj=0;jj<nx;jj++) {
+      if (!obstacles[ii*nx + jj]) {
+        kind[ii*nx + jj] = FLUID;
+        continue;
       }
-      else {
-	      /* compute local density total */
-	      local_density = 0.0;
-	      for(kk=0;kk<NSPEEDS;kk++) {
-	        local_density += tmp_cells[row_count].speeds[kk];
-	      }
-	      /* compute x velocity component */
-	      u_x = (tmp_cells[row_count].speeds[1] + 
-	            tmp_cells[row_count].speeds[5] + 
-	            tmp_cells[row_count].speeds[8]
-	            - (tmp_cells[row_count].speeds[3] + 
-		          tmp_cells[row_count].speeds[6] + 
-		          tmp_cells[row_count].speeds[7]))
-	            / local_density;
-	      /* compute y velocity component */
-	      u_y = (tmp_cells[row_count].speeds[2] + 
-	            tmp_cells[row_count].speeds[5] + 
-	            tmp_cells[row_count].speeds[6]
-	            - (tmp_cells[row_count].speeds[4] + 
-		          tmp_cells[row_count].speeds[7] + 
-		          tmp_cells[row_count].speeds[8]))
-	            / local_density;
-	      /* velocity squared */ 
-	      u_sq = u_x * u_x + u_y * u_y;
-	      /* directional velocity components */
-	      u[1] =   u_x;        /* east */
-	      u[2] =         u_y;  /* north */
-	      u[3] = - u_x;        /* west */
-	      u[4] =       - u_y;  /* south */
-	      u[5] =   u_x + u_y;  /* north-east */
-	      u[6] = - u_x + u_y;  /* north-west */
-	      u[7] = - u_x - u_y;  /* south-west */
-	      u[8] =   u_x - u_y;  /* south-east */
-	      /* equilibrium densities */
-	      /* zero velocity density: weight w0 */
-	      d_equ[0] = w0 * local_density * (1.0 - u_sq * 1.5);
-	      /* axis speeds: weight w1 */
-	      d_equ[1] = w1 * local_density * (1.0 + u[1] * c_sq
-					       + (u[1] * u[1]) * 4.5
-					       - u_sq * 1.5);
-	      d_equ[2] = w1 * local_density * (1.0 + u[2] * c_sq
-					       + (u[2] * u[2]) * 4.5
-					       - u_sq * 1.5);
-	      d_equ[3] = w1 * local_density * (1.0 + u[3] * c_sq
-					       + (u[3] * u[3]) * 4.5
-					       - u_sq * 1.5);
-	      d_equ[4] = w1 * local_density * (1.0 + u[4] * c_sq
-					       + (u[4] * u[4]) * 4.5
-					       - u_sq * 1.5);
-	      /* diagonal speeds: weight w2 */
-	      d_equ[5] = w2 * local_density * (1.0 + u[5] * c_sq
-					      + (u[5] * u[5]) * 4.5
-					      - u_sq * 1.5);
-	      d_equ[6] = w2 * local_density * (1.0 + u[6] * c_sq
-					      + (u[6] * u[6]) * 4.5
-					      - u_sq * 1.5);
-	      d_equ[7] = w2 * local_density * (1.0 + u[7] * c_sq
-					      + (u[7] * u[7]) * 4.5
-					      - u_sq * 1.5);
-	      d_equ[8] = w2 * local_density * (1.0 + u[8] * c_sq
-					      + (u[8] * u[8]) * 4.5
-					      - u_sq * 1.5);
-	      /* relaxation step */
-	      for(kk=0;kk<NSPEEDS;kk++) {
-	        cells[row_count].speeds[kk] = (tmp_cells[row_count].speeds[kk]
-						 + params.omega * 
-						 (d_equ[kk] - tmp_cells[row_count].speeds[kk]));
-	      }
+      kind[ii*nx + jj] = SOLID;
+      for(kk=-1;kk<=1;kk++) {
+        for(ll=-1;ll<=1;ll++) {
+          if (!obstacles[((ii + kk + ny) % ny)*nx + (jj + ll + nx) % nx])
+            kind[ii*nx + jj] = WALL;
+        }
       }
     }
   }
 
-  return EXIT_SUCCESS; 
+  /* a run starts at the beginning of each row and
+  ** wherever the kind of cell changes */
+  nruns = 0;
+  for(ii=0;ii<ny*nx;ii++) {
+    nruns += (ii % nx == 0 || kind[ii] != kind[ii-1]);
+  }
+
+  runs->row = malloc(sizeof(int)*(ny + 1));
+  runs->run = malloc(sizeof(t_run)*nruns);
+  if (runs->row == NULL || runs->run == NULL) {
+    sprintf(message,"cannot allocate memory for %d runs", nruns);
+    die(message,__LINE__,__FILE__);
+  }
+
+  nruns = 0;
+  runs->tot_cells = 0;
+  runs->swept = 0;
+  for(ii=0;ii<ny;ii++) {
+    runs->row[ii] = nruns;
+    for(jj=0;jj<nx;jj++) {
+      if (jj == 0 || kind[ii*nx + jj] != kind[ii*nx + jj-1]) {
+        runs->run[nruns].start = jj;
+        runs->run[nruns].kind = kind[ii*nx + jj];
+        nruns++;
+      }
+      runs->run[nruns-1].end = jj + 1;
+      runs->tot_cells += (kind[ii*nx + jj] == FLUID);
+      runs->swept += (kind[ii*nx + jj] != SOLID);
+    }
+  }
+  runs->row[ny] = nruns;
+
+  free(kind);
 }
 
 int initialise(const char* paramfile, const char* obstaclefile,
-	       t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, 
-	       int** obstacles_ptr, double** av_vels_ptr)
+	       t_param* params, t_speed* cells_ptr, t_speed* tmp_cells_ptr, 
+	       int** obstacles_ptr, t_runs* runs_ptr, double** av_vels_ptr)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
@@ -388,7 +1381,6 @@ int initialise(const char* paramfile, const char* obstaclefile,
   int    xx,yy;          /* generic array indices */
   int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
   int    retval;         /* to hold return value for checking */
-  double w0,w1,w2;       /* weighting factors */
 
   /* open the parameter file */
   fp = fopen(paramfile,"r");
@@ -422,54 +1414,49 @@ int initialise(const char* paramfile, const char* obstaclefile,
   ** Remember C is pass-by-value, so we need to
   ** pass pointers into the initialise function.
   **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
+  ** NB each speed is allocated as a 1D array, so that
+  ** the memory will be contiguous.  We still want to
   ** index this memory as if it were a (row major
   ** ordered) 2D array, however.  We will perform
   ** some arithmetic using the row and column
   ** coordinates, inside the square brackets, when
   ** we want to access elements of this array.
   **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
+  ** Note also that the 9 planes of a lattice share a
+  ** single aligned block, with each plane padded so
+  ** the next one also starts on a cache line.
   */
 
   /* main grid */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed)*(params->ny*params->nx));
-  if (*cells_ptr == NULL) 
-    die("cannot allocate memory for cells",__LINE__,__FILE__);
+  alloc_lattice(params, params->ny, cells_ptr, "cells");
 
   /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (t_speed*)malloc(sizeof(t_speed)*(params->ny*params->nx));
-  if (*tmp_cells_ptr == NULL) 
-    die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
+#ifdef AA_PATTERN
+  /* not needed when streaming in place */
+  memset(tmp_cells_ptr, 0, sizeof(t_speed));
+#else
+  alloc_lattice(params, params->ny, tmp_cells_ptr, "tmp_cells");
+#endif
   
   /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int*)*(params->ny*params->nx));
+  *obstacles_ptr = malloc(sizeof(int)*(params->ny*params->nx));
   if (*obstacles_ptr == NULL) 
     die("cannot allocate column memory for obstacles",__LINE__,__FILE__);
 
-  /* initialise densities */
-  w0 = params->density * 4.0/9.0;
-  w1 = params->density      /9.0;
-  w2 = params->density      /36.0;
-
+  /* initialise densities, those of the scratch space grid too: the
+  ** sweeps never write the solid cells, so each grid keeps the values
+  ** set here in them.
+  **
+  ** The pages of each row are placed by the thread that first touches
+  ** them.  Using the same static schedule over the rows as timestep(),
+  ** that is the thread which will update them, so they are placed in
+  ** the memory of its socket.  The scratch space grid is touched the
+  ** same way */
+#pragma omp parallel for schedule(static)
   for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      /* centre */
-      (*cells_ptr)[ii*params->nx + jj].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii*params->nx + jj].speeds[1] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[2] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[3] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii*params->nx + jj].speeds[5] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[6] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[7] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[8] = w2;
-    }
+    rest_rows(params, cells_ptr, ii, ii+1);
+    /* unless streaming in place */
+    if (tmp_cells_ptr->data != NULL) rest_rows(params, tmp_cells_ptr, ii, ii+1);
   }
 
   /* first set all cells in obstacle array to zero */ 
@@ -504,6 +1491,9 @@ int initialise(const char* paramfile, const char* obstaclefile,
   /* and close the file */
   fclose(fp);
 
+  /* the same map, as runs of each kind of cell along each row */
+  find_runs(params, *obstacles_ptr, runs_ptr);
+
   /* 
   ** allocate space to hold a record of the avarage velocities computed 
   ** at each timestep
@@ -513,98 +1503,168 @@ int initialise(const char* paramfile, const char* obstaclefile,
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-	     int** obstacles_ptr, double** av_vels_ptr)
+int finalise(const t_param* params, t_speed* cells_ptr, t_speed* tmp_cells_ptr,
+	     int** obstacles_ptr, t_runs* runs_ptr, double** av_vels_ptr)
 {
   /* 
   ** free up allocated memory
   */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
+  free(cells_ptr->data);
+  cells_ptr->data = NULL;
 
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+  free(tmp_cells_ptr->data);
+  tmp_cells_ptr->data = NULL;
 
   free(*obstacles_ptr);
   *obstacles_ptr = NULL;
 
+  free(runs_ptr->run);
+  runs_ptr->run = NULL;
+  free(runs_ptr->row);
+  runs_ptr->row = NULL;
+
   free(*av_vels_ptr);
   *av_vels_ptr = NULL;
 
   return EXIT_SUCCESS;
 }
 
-double av_velocity(const t_param params, t_speed* cells, int* obstacles)
+void socket_bandwidth(const t_param params, const t_runs* runs, const int steps,
+                      const double elapsed)
 {
-  int    ii,kk;       /* generic counters */
-  int    tot_cells = 0;  /* no. of cells used in calculation */
-  double local_density;  /* total density in cell */
-  double u_x;            /* x-component of velocity for current cell */
-  double u_y;            /* y-component of velocity for current cell */
-  double tot_u;          /* accumulated magnitudes of velocity for each cell */
-  int row_start,row_count,row_end;
+  const char* binding[] = { "false", "true", "master", "close", "spread" };
+  double bytes[MAX_SOCKETS];    /* lattice traffic of each socket's threads */
+  int    threads[MAX_SOCKETS];  /* no. of threads on each socket */
+  int    ii,rr;                 /* generic counters */
+  const omp_proc_bind_t bind = omp_get_proc_bind();
+
+  for(ii=0;ii<MAX_SOCKETS;ii++) {
+    bytes[ii] = 0.0;
+    threads[ii] = 0;
+  }
+
+  /*
+  ** Each timestep reads and writes every density of the cells that are
+  ** swept.  Count those in the rows each thread updates, with the same
+  ** static schedule as timestep(), and charge them to the socket the
+  ** thread is running on.  With TEMPORAL_BLOCKING this is the traffic
+  ** the timesteps would have drawn without it.
+  */
+#pragma omp parallel private(ii,rr)
+  {
+    const int socket = cpu_socket(sched_getcpu());
+    double cells = 0.0;         /* cells swept by this thread each step */
+
+#pragma omp for schedule(static)
+    for(ii=0;ii<params.ny;ii++) {
+      for(rr=runs->row[ii];rr<runs->row[ii+1];rr++) {
+        if (runs->run[rr].kind != SOLID)
+          cells += runs->run[rr].end - runs->run[rr].start;
+      }
+    }
+#pragma omp critical
+    {
+      bytes[socket] += cells * 2.0*NSPEEDS*sizeof(t_real) * steps;
+      threads[socket]++;
+    }
+  }
+
+  printf("Thread binding:\t\t\t%s%s\n",
+         (bind >= 0 && bind <= omp_proc_bind_spread) ? binding[bind] : "unknown",
+         (bind == omp_proc_bind_false) ? " (unpinned, so sockets may be inexact)" : "");
+  for(ii=0;ii<MAX_SOCKETS;ii++) {
+    if (threads[ii] == 0) continue;
+    printf("Socket %d bandwidth:\t\t%.3lf (GB/s) from %d threads\n",
+           ii, bytes[ii] / elapsed / 1.0E9, threads[ii]);
+  }
+}
+
+int cpu_socket(const int cpu)
+{
+  char   path[1024];   /* sysfs file giving the socket of the cpu */
+  FILE*  fp;           /* file pointer */
+  int    socket = 0;   /* the socket, taken as 0 if unknown */
+
+  sprintf(path,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  fp = (cpu < 0) ? NULL : fopen(path,"r");
+  if (fp != NULL) {
+    if (fscanf(fp,"%d",&socket) != 1) socket = 0;
+    fclose(fp);
+  }
+
+  return (socket >= 0 && socket < MAX_SOCKETS) ? socket : MAX_SOCKETS - 1;
+}
+
+double av_velocity(const t_param params, t_speed* cells, const t_runs* runs)
+{
+  int    ii,rr;          /* generic counters */
+  t_acc  local_density;  /* total density in cell */
+  t_acc  u_x;            /* x-component of velocity for current cell */
+  t_acc  u_y;            /* y-component of velocity for current cell */
+  t_acc  tot_u;          /* accumulated magnitudes of velocity for each cell */
+  int row_count,row_start,row_end;
+  const int nx = params.nx;
+  const t_real* restrict c0 = cells->speeds[0];
+  const t_real* restrict c1 = cells->speeds[1];
+  const t_real* restrict c2 = cells->speeds[2];
+  const t_real* restrict c3 = cells->speeds[3];
+  const t_real* restrict c4 = cells->speeds[4];
+  const t_real* restrict c5 = cells->speeds[5];
+  const t_real* restrict c6 = cells->speeds[6];
+  const t_real* restrict c7 = cells->speeds[7];
+  const t_real* restrict c8 = cells->speeds[8];
 
   /* initialise */
   tot_u = 0.0;
 
-  /* loop over all non-blocked cells */
-#pragma omp parallel for shared(cells,obstacles)\
- private(ii,kk,local_density,u_x,u_y,row_count,row_start,row_end)\
- reduction(+:tot_cells,tot_u)
+  /* loop over the runs of non-blocked cells */
+#pragma omp parallel for schedule(static)\
+ private(rr,local_density,u_x,u_y,row_count,row_start,row_end)\
+ reduction(+:tot_u)
   for(ii=0;ii<params.ny;ii++) {
-    row_start = ii*params.nx;
-    row_end = row_start + params.nx;
-    for(row_count=row_start;row_count<row_end;row_count++) {
-      /* ignore occupied cells */
-      if(!obstacles[row_count]) {
-	/* local density total */
-	local_density = 0.0;
-	for(kk=0;kk<NSPEEDS;kk++) {
-	  local_density += cells[row_count].speeds[kk];
-	}
-	/* x-component of velocity */
-	u_x = (cells[row_count].speeds[1] + 
-		    cells[row_count].speeds[5] + 
-		    cells[row_count].speeds[8]
-		    - (cells[row_count].speeds[3] + 
-		       cells[row_count].speeds[6] + 
-		       cells[row_count].speeds[7])) / 
-	  local_density;
-	/* compute y velocity component */
-	u_y = (cells[row_count].speeds[2] + 
-		    cells[row_count].speeds[5] + 
-		    cells[row_count].speeds[6]
-		    - (cells[row_count].speeds[4] + 
-		       cells[row_count].speeds[7] + 
-		       cells[row_count].speeds[8])) /
-	  local_density;
-	/* accumulate the norm of x- and y- velocity components */
-	tot_u = tot_u + sqrt((u_x * u_x) + (u_y * u_y));
-	/* increase counter of inspected cells */
-	tot_cells = tot_cells + 1;
+    for(rr=runs->row[ii];rr<runs->row[ii+1];rr++) {
+      if (runs->run[rr].kind != FLUID) continue;
+      row_start = ii*nx + runs->run[rr].start;
+      row_end   = ii*nx + runs->run[rr].end;
+#pragma omp simd private(local_density,u_x,u_y) reduction(+:tot_u)
+      for(row_count=row_start;row_count<row_end;row_count++) {
+        /* local density total */
+        local_density = (t_acc)c0[row_count] + c1[row_count] + c2[row_count]
+                      + c3[row_count] + c4[row_count] + c5[row_count]
+                      + c6[row_count] + c7[row_count] + c8[row_count];
+        /* x-component of velocity */
+        u_x = ((t_acc)c1[row_count] + c5[row_count] + c8[row_count]
+               - ((t_acc)c3[row_count] + c6[row_count] + c7[row_count])) /
+          local_density;
+        /* compute y velocity component */
+        u_y = ((t_acc)c2[row_count] + c5[row_count] + c6[row_count]
+               - ((t_acc)c4[row_count] + c7[row_count] + c8[row_count])) /
+          local_density;
+        /* accumulate the norm of x- and y- velocity components */
+        tot_u = tot_u + sqrt((u_x * u_x) + (u_y * u_y));
       }
     }
   }
 
-  return tot_u / (double)tot_cells;
+  return tot_u / (double)runs->tot_cells;
 }
 
-double calc_reynolds(const t_param params, t_speed* cells, int* obstacles)
+double calc_reynolds(const t_param params, t_speed* cells, const t_runs* runs)
 {
   const double viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
   
-  return av_velocity(params,cells,obstacles) * params.reynolds_dim / viscosity;
+  return av_velocity(params,cells,runs) * params.reynolds_dim / viscosity;
 }
 
-double total_density(const t_param params, t_speed* cells)
+t_acc total_density(const t_param params, t_speed* cells)
 {
   int ii,jj,kk;        /* generic counters */
-  double total = 0.0;  /* accumulator */
+  t_acc total = 0.0;   /* accumulator */
 
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
       for(kk=0;kk<NSPEEDS;kk++) {
-	total += cells[ii*params.nx + jj].speeds[kk];
+	total += cells->speeds[kk][ii*params.nx + jj];
       }
     }
   }
@@ -612,26 +1672,62 @@ double total_density(const t_param params, t_speed* cells)
   return total;
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, double* av_vels)
+int write_values(const t_param params, t_speed* cells, int* obstacles, double* av_vels,
+                 const int binary)
 {
+  FILE* fp;                     /* file pointer */
+  int ii;                       /* generic counter */
+
+  write_state(params,cells,obstacles,binary ? FINALSTATEBIN : FINALSTATEFILE,
+              params.maxIters,binary);
+
+  fp = fopen(AVVELSFILE,"w");
+  if (fp == NULL) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+  for (ii=0;ii<params.maxIters;ii++) {
+    fprintf(fp,"%d:\t%.12E\n", ii, av_vels[ii]);
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int write_state(const t_param params, t_speed* cells, const int* obstacles,
+                const char* name, const int iters, const int binary)
+{
+  char message[1024];           /* message buffer */
   FILE* fp;                     /* file pointer */
   int ii,jj,kk;                 /* generic counters */
+  int pos;                      /* index of the current cell in each plane */
   const double c_sq = 1.0/3.0;  /* sq. of speed of sound */
   double local_density;         /* per grid cell sum of densities */
   double pressure;              /* fluid pressure in grid cell */
   double u_x;                   /* x-component of velocity in grid cell */
   double u_y;                   /* y-component of velocity in grid cell */
   double u;                     /* norm--root of summed squares--of u_x and u_y */
+  t_real** s = cells->speeds;   /* shorthand for the speed planes */
+  size_t plane = (size_t)params.nx*params.ny;  /* values per field */
+  double* fields = NULL;        /* the planes of a binary file */
+  t_fields head;                /* and its header */
 
-  fp = fopen(FINALSTATEFILE,"w");
+  fp = fopen(name, binary ? "wb" : "w");
   if (fp == NULL) {
-    die("could not open file output file",__LINE__,__FILE__);
+    sprintf(message,"could not open output file: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
+  if (binary) {
+    fields = malloc(4*plane*sizeof(double));
+    if (fields == NULL)
+      die("cannot allocate memory for the output fields",__LINE__,__FILE__);
   }
 
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
+      pos = ii*params.nx + jj;
       /* an occupied cell */
-      if(obstacles[ii*params.nx + jj]) {
+      if(obstacles[pos]) {
 	u_x = u_y = u = 0.0;
 	pressure = params.density * c_sq;
       }
@@ -639,49 +1735,443 @@ int write_values(const t_param params, t_speed* cells, int* obstacles, double* a
       else {
 	local_density = 0.0;
 	for(kk=0;kk<NSPEEDS;kk++) {
-	  local_density += cells[ii*params.nx + jj].speeds[kk];
+	  local_density += s[kk][pos];
 	}
 	/* compute x velocity component */
-	u_x = (cells[ii*params.nx + jj].speeds[1] + 
-	       cells[ii*params.nx + jj].speeds[5] +
-	       cells[ii*params.nx + jj].speeds[8]
-	       - (cells[ii*params.nx + jj].speeds[3] + 
-		  cells[ii*params.nx + jj].speeds[6] + 
-		  cells[ii*params.nx + jj].speeds[7]))
+	u_x = (s[1][pos] + 
+	       s[5][pos] +
+	       s[8][pos]
+	       - (s[3][pos] + 
+		  s[6][pos] + 
+		  s[7][pos]))
 	  / local_density;
 	/* compute y velocity component */
-	u_y = (cells[ii*params.nx + jj].speeds[2] + 
-	       cells[ii*params.nx + jj].speeds[5] + 
-	       cells[ii*params.nx + jj].speeds[6]
-	       - (cells[ii*params.nx + jj].speeds[4] + 
-		  cells[ii*params.nx + jj].speeds[7] + 
-		  cells[ii*params.nx + jj].speeds[8]))
+	u_y = (s[2][pos] + 
+	       s[5][pos] + 
+	       s[6][pos]
+	       - (s[4][pos] + 
+		  s[7][pos] + 
+		  s[8][pos]))
 	  / local_density;
 	/* compute norm of velocity */
 	u = sqrt((u_x * u_x) + (u_y * u_y));
 	/* compute pressure */
 	pressure = local_density * c_sq;
       }
-      /* write to file */
-      fprintf(fp,"%d %d %.12E %.12E %.12E %.12E %d\n",jj,ii,u_x,u_y,u,pressure,obstacles[ii*params.nx + jj]);
+      if (binary) {
+        fields[pos]           = u_x;
+        fields[plane + pos]   = u_y;
+        fields[2*plane + pos] = u;
+        fields[3*plane + pos] = pressure;
+      }
+      else {
+        /* write to file */
+        fprintf(fp,"%d %d %.12E %.12E %.12E %.12E %d\n",jj,ii,u_x,u_y,u,pressure,obstacles[pos]);
+      }
     }
   }
 
+  /* each field in one go, rather than formatting each value */
+  if (binary) {
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, FIELDS_MAGIC, sizeof(head.magic));
+    head.nx    = params.nx;
+    head.ny    = params.ny;
+    head.iters = iters;
+    if (fwrite(&head, sizeof(head), 1, fp) != 1 ||
+        fwrite(fields, sizeof(double), 4*plane, fp) != 4*plane ||
+        fwrite(obstacles, sizeof(int), plane, fp) != plane)
+      die("could not write output fields",__LINE__,__FILE__);
+    free(fields);
+  }
+
   fclose(fp);
 
-  fp = fopen(AVVELSFILE,"w");
+  return EXIT_SUCCESS;
+}
+
+static void checkpoint_header(const t_param params, const int iters, t_checkpoint* head)
+{
+  memset(head, 0, sizeof(t_checkpoint));
+  memcpy(head->magic, CHECKPOINT_MAGIC, sizeof(head->magic));
+  head->real_size    = sizeof(t_real);
+  head->nx           = params.nx;
+  head->ny           = params.ny;
+  head->reynolds_dim = params.reynolds_dim;
+  head->density      = params.density;
+  head->accel        = params.accel;
+  head->omega        = params.omega;
+  head->iters        = iters;
+  /* only the final step leaves the flow unaccelerated */
+  head->accelerated  = iters < params.maxIters;
+}
+
+int checkpoint_write(const char* name, const t_param params, t_speed* cells,
+                     double* av_vels, const int iters)
+{
+  char   message[1024];      /* message buffer */
+  char   tmpname[1024];      /* the new checkpoint, until it is complete */
+  FILE*  fp;                 /* file pointer */
+  t_checkpoint head;         /* the header of the file */
+  size_t plane = (size_t)params.nx*params.ny;  /* densities per speed */
+  int    kk;                 /* generic counter */
+
+  checkpoint_header(params, iters, &head);
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  fp = fopen(tmpname,"wb");
   if (fp == NULL) {
-    die("could not open file output file",__LINE__,__FILE__);
+    sprintf(message,"could not open checkpoint file: %s", name);
+    die(message,__LINE__,__FILE__);
   }
-  for (ii=0;ii<params.maxIters;ii++) {
-    fprintf(fp,"%d:\t%.12E\n", ii, av_vels[ii]);
+
+  if (fwrite(&head, sizeof(head), 1, fp) != 1)
+    die("could not write checkpoint header",__LINE__,__FILE__);
+  for(kk=0;kk<NSPEEDS;kk++) {
+    if (fwrite(cells->speeds[kk], sizeof(t_real), plane, fp) != plane)
+      die("could not write checkpoint grid",__LINE__,__FILE__);
   }
+  if (fwrite(av_vels, sizeof(double), iters, fp) != (size_t)iters)
+    die("could not write checkpoint av velocities",__LINE__,__FILE__);
 
+  /* make sure it is on disk before it replaces the last one, so
+  ** a run stopped at any point leaves a complete checkpoint */
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    die("could not flush checkpoint file",__LINE__,__FILE__);
   fclose(fp);
+  if (rename(tmpname, name) != 0) {
+    sprintf(message,"could not rename checkpoint file to: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
 
   return EXIT_SUCCESS;
 }
 
+int checkpoint_read(const char* name, const t_param params, t_speed* cells,
+                    double* av_vels, int* accelerated)
+{
+  char   message[1024];      /* message buffer */
+  int    fd;                 /* file descriptor */
+  struct stat st;            /* to find the size of the file */
+  const char* map;           /* the mapped file */
+  t_checkpoint head;         /* the header of the file */
+  size_t plane;              /* bytes per speed in the file */
+  const char* row;           /* a row of the file */
+  t_real* dst;               /* the same row of the grid */
+  int    ii,jj,kk;           /* generic counters */
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    sprintf(message,"could not open checkpoint file: %s", name);
+    die(message,__LINE__,__FILE__);
+  }
+  if ((size_t)st.st_size < sizeof(head))
+    die("checkpoint file is too short",__LINE__,__FILE__);
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    die("could not map checkpoint file",__LINE__,__FILE__);
+  close(fd);
+
+  /* the header, and the sizes it gives, must match this run.  The
+  ** densities may be of either precision, and the parameters are
+  ** compared in single precision, which is all the OpenCL version keeps */
+  memcpy(&head, map, sizeof(head));
+  if (memcmp(head.magic, CHECKPOINT_MAGIC, sizeof(head.magic)) != 0)
+    die("not a checkpoint file",__LINE__,__FILE__);
+  if (head.real_size != sizeof(float) && head.real_size != sizeof(double))
+    die("checkpoint densities are of unknown precision",__LINE__,__FILE__);
+  if (head.nx != params.nx || head.ny != params.ny ||
+      head.reynolds_dim != params.reynolds_dim ||
+      (float)head.density != (float)params.density ||
+      (float)head.accel != (float)params.accel || (float)head.omega != (float)params.omega)
+    die("checkpoint parameters do not match the parameter file",__LINE__,__FILE__);
+  if (head.iters < 0 || head.iters > params.maxIters)
+    die("checkpoint has more timesteps than maxIters",__LINE__,__FILE__);
+  plane = (size_t)params.nx*params.ny*head.real_size;
+  if ((size_t)st.st_size != sizeof(head) + NSPEEDS*plane + head.iters*sizeof(double))
+    die("checkpoint file is the wrong size",__LINE__,__FILE__);
+
+  /* copy each row by the thread that first touched it in initialise() */
+#pragma omp parallel for schedule(static) private(jj,kk,row,dst)
+  for(ii=0;ii<params.ny;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      row = map + sizeof(head) + kk*plane + (size_t)ii*params.nx*head.real_size;
+      dst = cells->speeds[kk] + ii*params.nx;
+      if (head.real_size == sizeof(t_real))
+        memcpy(dst, row, params.nx*sizeof(t_real));
+      else if (head.real_size == sizeof(float))
+        for(jj=0;jj<params.nx;jj++) dst[jj] = ((const float*)row)[jj];
+      else
+        for(jj=0;jj<params.nx;jj++) dst[jj] = ((const double*)row)[jj];
+    }
+  }
+  /* which need not be aligned */
+  memcpy(av_vels, map + sizeof(head) + NSPEEDS*plane, head.iters*sizeof(double));
+
+  munmap((void*)map, st.st_size);
+
+  /* a finished run needs no more acceleration */
+  *accelerated = head.accelerated || head.iters == params.maxIters;
+
+  return head.iters;
+}
+
+static void* writer_main(void* arg)
+{
+  t_writer* writer = arg;
+  t_snapshot* snap;             /* the snapshot to write next */
+  char name[64];                /* and its file name */
+  int  turn = 0;                /* which snapshot that is */
+  int  full;                    /* whether it has been taken */
+
+  for(;;) {
+    snap = &writer->snap[turn];
+    pthread_mutex_lock(&writer->lock);
+    while (!snap->full && !writer->done)
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    full = snap->full;
+    pthread_mutex_unlock(&writer->lock);
+    /* every snapshot taken has been written */
+    if (!full) break;
+
+    /* which it can do at leisure, as only this thread uses it */
+    sprintf(name, writer->binary ? SNAPSHOTBIN : SNAPSHOTFILE, snap->iters);
+    write_state(writer->params,&snap->cells,writer->obstacles,name,snap->iters,writer->binary);
+
+    pthread_mutex_lock(&writer->lock);
+    snap->full = FALSE;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    turn = 1 - turn;
+  }
+
+  return NULL;
+}
+
+void writer_start(t_writer* writer, const t_param params, const int* obstacles,
+                  const int binary)
+{
+  int kk;  /* generic counter */
+
+  writer->params    = params;
+  writer->obstacles = obstacles;
+  writer->binary    = binary;
+  writer->next      = 0;
+  writer->done      = FALSE;
+  for(kk=0;kk<2;kk++) {
+    alloc_lattice(&params, params.ny, &writer->snap[kk].cells, "snapshot");
+    writer->snap[kk].full = FALSE;
+  }
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+  if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0)
+    die("could not start the snapshot writer",__LINE__,__FILE__);
+}
+
+void writer_snapshot(t_writer* writer, t_speed* cells, const int iters)
+{
+  t_snapshot* snap = &writer->snap[writer->next];
+  int ii,kk;  /* generic counters */
+
+  /* only waits if both snapshots are still to be written */
+  pthread_mutex_lock(&writer->lock);
+  while (snap->full)
+    pthread_cond_wait(&writer->changed, &writer->lock);
+  pthread_mutex_unlock(&writer->lock);
+
+  /* copy each row by the thread that updates it, which has it nearest */
+#pragma omp parallel for schedule(static) private(kk)
+  for(ii=0;ii<writer->params.ny;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      memcpy(&snap->cells.speeds[kk][ii*writer->params.nx],
+             &cells->speeds[kk][ii*writer->params.nx], writer->params.nx*sizeof(t_real));
+    }
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  snap->iters = iters;
+  snap->full = TRUE;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+  writer->next = 1 - writer->next;
+}
+
+void writer_stop(t_writer* writer)
+{
+  pthread_mutex_lock(&writer->lock);
+  writer->done = TRUE;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  free(writer->snap[0].cells.data);
+  free(writer->snap[1].cells.data);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->changed);
+}
+
+int output_due(const t_output* output, const int before, const int after)
+{
+  return step_due(output->checkpoint_every,before,after) ||
+         step_due(output->snapshot_every,before,after);
+}
+
+void output_save(const t_param params, t_speed* cells, const t_runs* runs, double* av_vels,
+                 const t_output* output, const int before, const int after)
+{
+  if (snapshot_due(output,before,after)) {
+    /* only the copy holds up the timesteps */
+    PROFILE_BEGIN(PH_IO);
+    writer_snapshot(output->writer,cells,after);
+    PROFILE_END(PH_IO, 2.0*NSPEEDS*sizeof(t_real)*params.nx*params.ny);
+    /* the acceleration the last step left out */
+    if (after < params.maxIters) {
+      PROFILE_BEGIN(PH_ACCELERATE);
+      accelerate_flow(params,cells,runs);
+      PROFILE_END(PH_ACCELERATE, 2.0*6*sizeof(t_real)*params.nx);
+    }
+  }
+  if (step_due(output->checkpoint_every,before,after)) {
+    PROFILE_BEGIN(PH_IO);
+    checkpoint_write(output->checkpointfile,params,cells,av_vels,after);
+    PROFILE_END(PH_IO, profile_file_bytes(output->checkpointfile));
+  }
+}
+
+int step_due(const int every, const int before, const int after)
+{
+  return every > 0 && after / every > before / every;
+}
+
+int snapshot_due(const t_output* output, const int before, const int after)
+{
+  return step_due(output->snapshot_every,before,after);
+}
+
+#ifdef PROFILE
+/*
+** Instrumentation.  Each phase is timed with PROFILE_BEGIN() and
+** PROFILE_END(), which also take the hardware counts of the calling
+** thread, if perf_event_open() is allowed, and the bytes the phase is
+** expected to move.  profile_write() reports it all as JSON.
+*/
+#define NCOUNTERS       2       /* cycles and last level cache misses */
+
+static const char* counter_name[NCOUNTERS] = { "cycles", "llc_misses" };
+
+/* what has been measured of each phase */
+static struct {
+  double    seconds[NPHASES];            /* wallclock time in the phase */
+  double    bytes[NPHASES];              /* traffic of the phase */
+  long      calls[NPHASES];              /* no. of times it ran */
+  long long counts[NPHASES][NCOUNTERS];  /* hardware counts in the phase */
+  double    tic[NPHASES];                /* when the current call began */
+  long long start[NPHASES][NCOUNTERS];   /* the counts when it began */
+  int       fd[NCOUNTERS];               /* the counters, -1 if unavailable */
+} profile;
+
+static double profile_time(void)
+{
+  struct timeval timstr;  /* structure to hold elapsed time */
+
+  gettimeofday(&timstr,NULL);
+  return timstr.tv_sec+(timstr.tv_usec/1000000.0);
+}
+
+static long long profile_count(const int counter)
+{
+  long long count = 0;    /* value of the counter */
+
+  if (profile.fd[counter] < 0 || read(profile.fd[counter],&count,sizeof(count)) != sizeof(count))
+    return 0;
+  return count;
+}
+
+/* size of a file that has been written, for the I/O traffic */
+double profile_file_bytes(const char* name)
+{
+  struct stat st;         /* the file's status */
+
+  return (stat(name,&st) == 0) ? (double)st.st_size : 0.0;
+}
+
+void profile_init(void)
+{
+  const unsigned long long config[NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;  /* what to count */
+  int    kk;                    /* generic counter */
+
+  memset(&profile,0,sizeof(profile));
+  for(kk=0;kk<NCOUNTERS;kk++) {
+    memset(&attr,0,sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[kk];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* the counters are often refused, e.g. by perf_event_paranoid or
+    ** in a container, in which case they are reported as null */
+    profile.fd[kk] = syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+  }
+}
+
+void profile_begin(const int phase)
+{
+  int kk;                 /* generic counter */
+
+  for(kk=0;kk<NCOUNTERS;kk++) profile.start[phase][kk] = profile_count(kk);
+  profile.tic[phase] = profile_time();
+}
+
+void profile_end(const int phase, const double bytes)
+{
+  int kk;                 /* generic counter */
+
+  profile.seconds[phase] += profile_time() - profile.tic[phase];
+  for(kk=0;kk<NCOUNTERS;kk++) {
+    profile.counts[phase][kk] += profile_count(kk) - profile.start[phase][kk];
+  }
+  profile.bytes[phase] += bytes;
+  profile.calls[phase]++;
+}
+
+void profile_write(const t_param params, const int steps, const double elapsed)
+{
+  FILE*  fp;              /* file pointer */
+  int    ii,kk;           /* generic counters */
+
+  fp = fopen(PROFILEFILE,"w");
+  if (fp == NULL) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+
+  fprintf(fp,"{\n");
+  fprintf(fp,"  \"driver\": \"openmp\",\n");
+  fprintf(fp,"  \"nx\": %d,\n  \"ny\": %d,\n  \"iterations\": %d,\n  \"steps\": %d,\n",
+          params.nx,params.ny,params.maxIters,steps);
+  fprintf(fp,"  \"threads\": %d,\n",omp_get_max_threads());
+  fprintf(fp,"  \"elapsed\": %.6f,\n",elapsed);
+  fprintf(fp,"  \"mlups\": %.3f,\n",
+          (elapsed > 0.0) ? (double)params.nx*params.ny*steps/elapsed/1.0E6 : 0.0);
+  fprintf(fp,"  \"phases\": {\n");
+  for(ii=0;ii<NPHASES;ii++) {
+    fprintf(fp,"    \"%s\": { \"calls\": %ld, \"seconds\": %.6f, \"bytes\": %.0f, \"gbytes_per_s\": %.3f",
+            phase_name[ii],profile.calls[ii],profile.seconds[ii],profile.bytes[ii],
+            (profile.seconds[ii] > 0.0) ? profile.bytes[ii]/profile.seconds[ii]/1.0E9 : 0.0);
+    for(kk=0;kk<NCOUNTERS;kk++) {
+      if (profile.fd[kk] < 0) fprintf(fp,", \"%s\": null",counter_name[kk]);
+      else fprintf(fp,", \"%s\": %lld",counter_name[kk],profile.counts[ii][kk]);
+    }
+    fprintf(fp," }%s\n",(ii < NPHASES-1) ? "," : "");
+  }
+  fprintf(fp,"  }\n}\n");
+
+  fclose(fp);
+}
+#endif
+
 void die(const char* message, const int line, const char *file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
@@ -0,0 +1,120 @@
+/*
+** Convert a binary field file, as written by the d2q9-bgk programs with
+** LBM_OUTPUT=binary (final_state.bin, or a snapshot_*.bin), to the text
+** format of final_state.dat:
+**
+**   bin2text final_state.bin > final_state.dat
+**   bin2text snapshot_000100.bin snapshot_000100.dat
+**
+** The file is mapped rather than read, and each line written as it is
+** formatted, so even large grids need little memory.  The output is the
+** same, character for character, as the text the program would have
+** written itself.
+**
+** The binary file holds a header, then planes of ny*nx values in row
+** major order: the x and y components of the velocity, its norm and the
+** pressure of each cell, as doubles, then whether each cell is blocked,
+** as ints.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+
+#define FIELDS_MAGIC    "LBMFLDS1"     /* first 8 bytes of a binary field file */
+#define NFIELDS         4              /* u_x, u_y, u and pressure */
+
+/* the header of a binary field file */
+typedef struct {
+  char   magic[8];      /* FIELDS_MAGIC */
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    iters;         /* no. of timesteps made */
+  int    pad;           /* keeps the planes aligned */
+} t_fields;
+
+/* utility functions */
+void die(const char* message, const int line, const char *file);
+void usage(const char* exe);
+
+int main(int argc, char* argv[])
+{
+  char   message[1024];      /* message buffer */
+  FILE*  fp = stdout;        /* where the text goes */
+  int    fd;                 /* file descriptor */
+  struct stat st;            /* to find the size of the file */
+  const char* map;           /* the mapped file */
+  t_fields head;             /* the header of the file */
+  const double* fields;      /* the planes of doubles */
+  const int* obstacles;      /* the plane of blocked cells */
+  size_t plane;              /* values per plane */
+  size_t pos;                /* index of the current cell in each plane */
+  int    ii,jj;              /* generic counters */
+
+  if (argc != 2 && argc != 3) usage(argv[0]);
+
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    sprintf(message,"could not open input file: %s", argv[1]);
+    die(message,__LINE__,__FILE__);
+  }
+  if ((size_t)st.st_size < sizeof(head))
+    die("input file is too short",__LINE__,__FILE__);
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    die("could not map input file",__LINE__,__FILE__);
+  close(fd);
+  /* it is read once, front to back */
+  madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+  memcpy(&head, map, sizeof(head));
+  if (memcmp(head.magic, FIELDS_MAGIC, sizeof(head.magic)) != 0)
+    die("not a binary field file",__LINE__,__FILE__);
+  plane = (size_t)head.nx*head.ny;
+  if (head.nx < 1 || head.ny < 1 ||
+      (size_t)st.st_size != sizeof(head) + plane*(NFIELDS*sizeof(double) + sizeof(int)))
+    die("binary field file is the wrong size",__LINE__,__FILE__);
+  fields    = (const double*)(map + sizeof(head));
+  obstacles = (const int*)(map + sizeof(head) + NFIELDS*plane*sizeof(double));
+
+  if (argc == 3) {
+    fp = fopen(argv[2],"w");
+    if (fp == NULL) {
+      sprintf(message,"could not open output file: %s", argv[2]);
+      die(message,__LINE__,__FILE__);
+    }
+  }
+
+  for(ii=0;ii<head.ny;ii++) {
+    for(jj=0;jj<head.nx;jj++) {
+      pos = (size_t)ii*head.nx + jj;
+      fprintf(fp,"%d %d %.12E %.12E %.12E %.12E %d\n",jj,ii,
+              fields[pos],fields[plane + pos],fields[2*plane + pos],fields[3*plane + pos],
+              obstacles[pos]);
+    }
+  }
+
+  if (fclose(fp) != 0)
+    die("could not write output file",__LINE__,__FILE__);
+  munmap((void*)map, st.st_size);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s <binary field file> [text file]\n", exe);
+  exit(EXIT_FAILURE);
+}